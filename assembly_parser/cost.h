@@ -0,0 +1,19 @@
+#ifndef __COST__
+#define __COST__
+
+// Clock cycles of each instruction of the machine
+// The simulator counts these, and the compiler picks its code by them
+#define COST_MOV_REG 10    // MOV reg reg
+#define COST_MOV_CONST 10  // MOV reg const
+#define COST_LOAD 200      // MOV reg [addr]
+#define COST_STORE 200     // MOV [addr] reg
+#define COST_ADD 10
+#define COST_SUB 10
+#define COST_MUL 30
+#define COST_DIV 50
+#define COST_AND 10
+#define COST_OR 10
+#define COST_XOR 10
+#define COST_EXIT 20
+
+#endif  // __COST__
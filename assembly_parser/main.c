@@ -2,6 +2,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include "cost.h"
 
 /**
 print error message.
@@ -28,6 +29,40 @@ typedef struct INST {
 
 } INST;
 
+/// clock cycles of an instruction, from the table in cost.h
+int cycles(const INST* i) {
+    switch (i->opcode) {
+        case MOV:
+            if (i->op1_type == ADDR)
+                return COST_STORE;
+            switch (i->op2_type) {
+                case REG:
+                    return COST_MOV_REG;
+                case CONST:
+                    return COST_MOV_CONST;
+                case ADDR:
+                    return COST_LOAD;
+            }
+        case ADD:
+            return COST_ADD;
+        case SUB:
+            return COST_SUB;
+        case MUL:
+            return COST_MUL;
+        case DIV:
+            return COST_DIV;
+        case AND:
+            return COST_AND;
+        case OR:
+            return COST_OR;
+        case XOR:
+            return COST_XOR;
+        case EXIT:
+            return COST_EXIT;
+    }
+    return 0;
+}
+
 void print(const INST* i) {
     switch (i->opcode) {
         case MOV:
@@ -85,43 +120,10 @@ void print(const INST* i) {
         }
     else
         printf("             |");
-    switch (i->opcode) {
-        case MOV:
-            if (i->op1_type == REG &&
-                (i->op2_type == REG || i->op2_type == CONST)) {
-                printf(" 10cc   |\n");
-                break;
-            }
-            if ((i->op1_type == REG && i->op2_type == ADDR) ||
-                (i->op1_type == ADDR && i->op2_type == REG)) {
-                printf(" 200cc  |\n");
-                break;
-            }
-        case ADD:
-            printf(" 10cc   |\n");
-            break;
-        case SUB:
-            printf(" 10cc   |\n");
-            break;
-        case MUL:
-            printf(" 30cc   |\n");
-            break;
-        case DIV:
-            printf(" 50cc   |\n");
-            break;
-        case EXIT:
-            printf(" 20cc   |\n");
-            break;
-        case AND:
-            printf(" 10cc   |\n");
-            break;
-        case OR:
-            printf(" 10cc   |\n");
-            break;
-        case XOR:
-            printf(" 10cc   |\n");
-            break;
-    }
+
+    char cc[16];
+    sprintf(cc, "%dcc", cycles(i));
+    printf(" %-7s|\n", cc);
 }
 
 /// check the op is register or not
@@ -411,60 +413,54 @@ int main(int argc, char** argv) {
         if ((state = readInst(&inst)) != 1)
             continue;
         print(inst);
+        totalClock += cycles(inst);
         switch (inst->opcode) {
             case MOV:
                 if (inst->op1_type == REG)
                     switch (inst->op2_type) {
                         case REG:
                             r[inst->op1_value] = r[inst->op2_value];
-                            totalClock += 10;
                             break;
                         case CONST:
                             r[inst->op1_value] = inst->op2_value;
-                            totalClock += 10;
                             break;
                         case ADDR:
                             r[inst->op1_value] = mem[inst->op2_value / 4];
-                            totalClock += 200;
                             break;
                     }
                 else {
                     mem[inst->op1_value / 4] = r[inst->op2_value];
-                    totalClock += 200;
                 }
                 break;
             case ADD:
                 r[inst->op1_value] += r[inst->op2_value];
-                totalClock += 10;
                 break;
             case SUB:
                 r[inst->op1_value] -= r[inst->op2_value];
-                totalClock += 10;
                 break;
             case MUL:
                 r[inst->op1_value] *= r[inst->op2_value];
-                totalClock += 30;
                 break;
             case DIV:
                 if (r[inst->op2_value] == 0) {
                     printf("**********************************\n");
                     printf("ERROR divisor is not equal to 0\n");
                     printf("**********************************\n");
-                } else
+                } else if (r[inst->op2_value] == -1)
+                    /// negate, INT_MIN / -1 wraps around to INT_MIN instead
+                    /// of trapping on the host, as the compiler folds it
+                    r[inst->op1_value] = (int)-(unsigned)r[inst->op1_value];
+                else
                     r[inst->op1_value] /= r[inst->op2_value];
-                totalClock += 50;
                 break;
             case AND:
                 r[inst->op1_value] &= r[inst->op2_value];
-                totalClock += 10;
                 break;
             case OR:
                 r[inst->op1_value] |= r[inst->op2_value];
-                totalClock += 10;
                 break;
             case XOR:
                 r[inst->op1_value] ^= r[inst->op2_value];
-                totalClock += 10;
                 break;
             case EXIT:
                 printf("-------------------------------------------\n");
@@ -473,7 +469,6 @@ int main(int argc, char** argv) {
                 else
                     printf("the expression cannot be evaluated\n");
                 state = 0;
-                totalClock += 20;
                 break;
         }
         free(inst);
@@ -0,0 +1,308 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "compiler.h"
+
+// Compile many input files in parallel
+// Usage: ./batch [-j threads] [-o dir] [-t] [-u] [-O level] [-e x,y,z] file...
+//        ./batch [-j threads] [-o dir] [-t] [-u] [-O level] [-e x,y,z] -
+//                < list of files
+//
+// With -o, the code for a/b/name.txt goes to dir/name.asm, otherwise the
+// code of every file goes to stdout in the order of the inputs, each
+// after a ";; file" line. -t prints the time taken to stderr. -u keeps
+// x, y and z in memory instead of pinning them to r0-r2. -O2 also
+// re-synthesizes every program, as main does. -e evaluates every program
+// at compile time with the given initial values of x, y and z.
+//
+// Every worker has its own Compiler. The jobs are dealt out to the
+// workers in contiguous ranges, and a worker that runs out steals half
+// of what is left of another's range.
+
+// The jobs of one worker, [next, end) of the input list
+typedef struct {
+    pthread_mutex_t lock;
+    int next, end;
+} Deque;
+
+typedef struct {
+    const char* path;
+    Buffer out;
+    int status;  // of compile(), -1 if the file could not be read
+} Job;
+
+typedef struct {
+    Job* jobs;
+    Deque* deques;
+    int nworker;
+    const char* outdir;
+    Options opt;
+} Batch;
+
+typedef struct {
+    Batch* batch;
+    int id;
+} Worker;
+
+// Take the next job of deque d, -1 if it is empty
+static int take(Deque* d) {
+    int job = -1;
+    pthread_mutex_lock(&d->lock);
+    if (d->next < d->end) {
+        job = d->next++;
+    }
+    pthread_mutex_unlock(&d->lock);
+    return job;
+}
+
+// Move the back half of a victim's jobs to deque self and take one
+static int steal(Batch* b, int self) {
+    for (int i = 1; i < b->nworker; i++) {
+        Deque* victim = &b->deques[(self + i) % b->nworker];
+        int from, to;
+
+        pthread_mutex_lock(&victim->lock);
+        to = victim->end;
+        from = to - (to - victim->next + 1) / 2;
+        victim->end = from;
+        pthread_mutex_unlock(&victim->lock);
+        if (from < to) {
+            Deque* own = &b->deques[self];
+            pthread_mutex_lock(&own->lock);
+            own->next = from + 1;
+            own->end = to;
+            pthread_mutex_unlock(&own->lock);
+            return from;
+        }
+    }
+    return -1;
+}
+
+// Read a file into buf, which is grown as needed, NULL on failure
+static char* readFile(const char* path, char* buf, size_t* cap,
+                      size_t* len) {
+    FILE* in = fopen(path, "rb");
+    size_t n;
+
+    if (!in) {
+        return NULL;
+    }
+    *len = 0;
+    while ((n = fread(buf + *len, 1, *cap - *len, in)) > 0) {
+        *len += n;
+        if (*len == *cap) {
+            char* more = (char*)realloc(buf, *cap << 1);
+            if (!more) {
+                fclose(in);
+                return NULL;
+            }
+            buf = more;
+            *cap <<= 1;
+        }
+    }
+    fclose(in);
+    return buf;
+}
+
+// Write the code of path to dir/stem.asm, 0 on success
+static int writeFile(const char* dir, const char* path, const Buffer* out) {
+    const char* base = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+    const char* dot = strrchr(base, '.');
+    int stem = dot && dot != base ? (int)(dot - base) : (int)strlen(base);
+    char* name = (char*)malloc(strlen(dir) + stem + 6);
+    FILE* f;
+
+    if (!name) {
+        return -1;
+    }
+    sprintf(name, "%s/%.*s.asm", dir, stem, base);
+    f = fopen(name, "wb");
+    free(name);
+    if (!f) {
+        return -1;
+    }
+    fwrite(out->data, 1, out->len, f);
+    return fclose(f);
+}
+
+static void* work(void* arg) {
+    Worker* w = (Worker*)arg;
+    Batch* b = w->batch;
+    Compiler* c = newCompiler();
+    size_t cap = 1 << 16, len;
+    char* src = (char*)malloc(cap);
+    int i;
+
+    if (!c || !src) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    c->opt = b->opt;
+    while ((i = take(&b->deques[w->id])) >= 0 ||
+           (i = steal(b, w->id)) >= 0) {
+        Job* job = &b->jobs[i];
+        char* buf = readFile(job->path, src, &cap, &len);
+        if (!buf) {
+            job->status = -1;
+            continue;
+        }
+        src = buf;
+        job->status = compile(c, src, len, &job->out);
+        if (b->outdir && writeFile(b->outdir, job->path, &job->out)) {
+            job->status = -1;
+        }
+        if (b->outdir) {
+            free(job->out.data);
+            job->out.data = NULL;
+        }
+    }
+    freeCompiler(c);
+    free(src);
+    return NULL;
+}
+
+// Read the list of files, one per line
+static char** readList(FILE* in, int* n) {
+    char** paths = NULL;
+    char line[4096];
+    int cap = 0;
+
+    *n = 0;
+    while (fgets(line, sizeof line, in)) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (!*line) {
+            continue;
+        }
+        if (*n == cap) {
+            cap = cap ? cap << 1 : 1024;
+            paths = (char**)realloc(paths, cap * sizeof(char*));
+        }
+        if (!paths || !(paths[*n] = strdup(line))) {
+            fprintf(stderr, "out of memory\n");
+            exit(1);
+        }
+        ++*n;
+    }
+    return paths;
+}
+
+static int usage(const char* prog) {
+    fprintf(stderr,
+            "usage: %s [-j threads] [-o dir] [-t] [-u] [-O level] "
+            "[-e x,y,z] file... | -\n",
+            prog);
+    return 2;
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int main(int argc, char** argv) {
+    // The options default as in newCompiler()
+    Batch b = {.nworker = (int)sysconf(_SC_NPROCESSORS_ONLN),
+               .opt = {.pin = 1, .level = 1}};
+    char** paths = NULL;
+    pthread_t* threads;
+    Worker* workers;
+    int njob, timing = 0, failed = 0, opt;
+    double t;
+
+    while ((opt = getopt(argc, argv, "j:o:tuO:e:")) != -1) {
+        switch (opt) {
+            case 'j':
+                b.nworker = atoi(optarg);
+                break;
+            case 'o':
+                b.outdir = optarg;
+                break;
+            case 't':
+                timing = 1;
+                break;
+            case 'u':
+                b.opt.pin = 0;
+                break;
+            case 'O':
+                b.opt.level = atoi(optarg);
+                break;
+            case 'e':
+                if (sscanf(optarg, "%d,%d,%d", &b.opt.mem[0], &b.opt.mem[1],
+                           &b.opt.mem[2]) != 3) {
+                    return usage(argv[0]);
+                }
+                b.opt.eval = 1;
+                break;
+            default:
+                return usage(argv[0]);
+        }
+    }
+    if (optind + 1 == argc && strcmp(argv[optind], "-") == 0) {
+        paths = readList(stdin, &njob);
+    } else {
+        paths = argv + optind;
+        njob = argc - optind;
+    }
+    if (b.nworker < 1) {
+        b.nworker = 1;
+    }
+
+    b.jobs = (Job*)calloc(njob + 1, sizeof(Job));
+    b.deques = (Deque*)calloc(b.nworker, sizeof(Deque));
+    threads = (pthread_t*)calloc(b.nworker, sizeof(pthread_t));
+    workers = (Worker*)calloc(b.nworker, sizeof(Worker));
+    if (!b.jobs || !b.deques || !threads || !workers) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+    for (int i = 0; i < njob; i++) {
+        b.jobs[i].path = paths[i];
+    }
+    // Deal out the jobs in contiguous ranges
+    for (int i = 0; i < b.nworker; i++) {
+        pthread_mutex_init(&b.deques[i].lock, NULL);
+        b.deques[i].next = (int)((long long)njob * i / b.nworker);
+        b.deques[i].end = (int)((long long)njob * (i + 1) / b.nworker);
+    }
+
+    t = now();
+    for (int i = 0; i < b.nworker; i++) {
+        workers[i].batch = &b;
+        workers[i].id = i;
+        if (pthread_create(&threads[i], NULL, work, &workers[i])) {
+            fprintf(stderr, "cannot start thread %d\n", i);
+            return 1;
+        }
+    }
+    for (int i = 0; i < b.nworker; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    t = now() - t;
+
+    // Write the code in the order of the inputs, not of completion
+    for (int i = 0; i < njob; i++) {
+        Job* job = &b.jobs[i];
+        if (job->status < 0) {
+            fprintf(stderr, "%s: cannot %s\n", job->path,
+                    b.outdir ? "read or write" : "read");
+            failed = 1;
+        }
+        if (!b.outdir) {
+            printf(";; %s\n", job->path);
+            fwrite(job->out.data, 1, job->out.len, stdout);
+            if (job->out.len && job->out.data[job->out.len - 1] != '\n') {
+                putchar('\n');
+            }
+        }
+        free(job->out.data);
+    }
+    if (timing) {
+        fprintf(stderr, "%d files, %d threads: %.3f s\n", njob, b.nworker,
+                t);
+    }
+    return failed;
+}
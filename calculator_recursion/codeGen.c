@@ -2,100 +2,936 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include "compiler.h"
+#include "../assembly_parser/cost.h"
 
-int sbcount = 0;
-Symbol table[TBLSIZE];
-
-void initTable(void) {
-    strcpy(table[0].name, "x");
-    strcpy(table[1].name, "y");
-    strcpy(table[2].name, "z");
-    sbcount = 3;
+static unsigned hash(const char* name, int len) {
+    unsigned h = 2166136261u;
+    for (int i = 0; i < len; i++) {
+        h = (h ^ (unsigned char)name[i]) * 16777619u;
+    }
+    return h;
 }
 
-int get_addr(char* str, int add_var) {
-    for (int i = 0; i < sbcount; i++) {
-        if (strcmp(str, table[i].name) == 0) {
-            return i << 2;
+static int* find_slot(SymbolTable* st, const char* name, int len,
+                      unsigned h) {
+    for (int i = h & (st->slotcap - 1);; i = (i + 1) & (st->slotcap - 1)) {
+        int sym = st->slots[i] - 1;
+        if (sym < 0 ||
+            (st->table[sym].len == len &&
+             memcmp(st->names + st->table[sym].name, name, len) == 0)) {
+            return &st->slots[i];
         }
     }
-    if (!add_var) {
-        error(NOTFOUND);
+}
+
+static void rehash(Compiler* c) {
+    SymbolTable* st = &c->symbols;
+    int cap = st->slotcap ? st->slotcap << 1 : 64;
+    int* slots = (int*)calloc(cap, sizeof(int));
+    if (!slots) {
+        error(c, RUNOUT);
+    }
+    free(st->slots);
+    st->slots = slots;
+    st->slotcap = cap;
+    for (int i = 0; i < st->count; i++) {
+        const char* name = st->names + st->table[i].name;
+        *find_slot(st, name, st->table[i].len, hash(name, st->table[i].len)) =
+            i + 1;
     }
-    strcpy(table[sbcount++].name, str);
-    return (sbcount - 1) << 2;
 }
 
-void generate_code(BTNode* root, int use_reg) {
-    if (root != NULL) {
-        switch (root->token_type) {
-            case ID:
-                printf("MOV r%d [%d]\n", use_reg, get_addr(root->lexeme, 0));
+static void cache(Compiler* c, int sym, int r);
+
+// Forget what the registers hold, as at the start of the program
+static void resetRegs(Compiler* c) {
+    for (int r = 0; r < 8; r++) {
+        c->codegen.cached[r] = -1;
+    }
+    for (int sym = 0; sym < c->symbols.count; sym++) {
+        c->symbols.table[sym].reg = -1;
+    }
+    // x, y and z are in their registers from the start, but their initial
+    // values are only loaded when needed
+    c->codegen.first = c->opt.pin ? 3 : 0;
+    c->codegen.loaded = 0;
+    c->codegen.nslot = c->codegen.nfree = 0;
+    for (int sym = 0; sym < c->codegen.first; sym++) {
+        cache(c, sym, sym);
+    }
+}
+
+void initTable(Compiler* c) {
+    SymbolTable* st = &c->symbols;
+    st->count = st->namelen = 0;
+    if (st->slots) {
+        memset(st->slots, 0, st->slotcap * sizeof(int));
+    }
+    intern(c, "x", 1);
+    intern(c, "y", 1);
+    intern(c, "z", 1);
+    for (int sym = 0; sym < 3; sym++) {
+        st->table[sym].addr = sym << 2;
+        st->table[sym].set = 1;
+    }
+    resetRegs(c);
+    for (int sym = 0; sym < 3 && c->opt.eval; sym++) {
+        st->table[sym].known = 1;
+        st->table[sym].value = c->opt.mem[sym];
+    }
+}
+
+int intern(Compiler* c, const char* name, int len) {
+    SymbolTable* st = &c->symbols;
+    unsigned h = hash(name, len);
+    int* slot;
+
+    if (2 * (st->count + 1) > st->slotcap) {
+        rehash(c);
+    }
+    slot = find_slot(st, name, len, h);
+    if (*slot) {
+        return *slot - 1;
+    }
+    st->table = (Symbol*)grow(c, st->table, &st->cap, st->count + 1,
+                              sizeof(Symbol));
+    st->names = (char*)grow(c, st->names, &st->namecap, st->namelen + len, 1);
+    memcpy(st->names + st->namelen, name, len);
+    st->table[st->count].name = st->namelen;
+    st->table[st->count].len = len;
+    st->table[st->count].addr = -1;
+    st->table[st->count].set = 0;
+    st->table[st->count].reg = -1;
+    st->table[st->count].known = 0;
+    st->table[st->count].value = 0;
+    st->namelen += len;
+    *slot = st->count + 1;
+    return st->count++;
+}
+
+int get_addr(Compiler* c, int sym) {
+    return c->symbols.table[sym].addr;
+}
+
+void bind_vars(Compiler* c, const BTNode* code, int n) {
+    Symbol* table = c->symbols.table;
+    for (int i = 1; i <= n; i++) {
+        switch (code[i].op) {
+            case OP_ID:
+            case OP_ADD_ASSIGN:
+            case OP_SUB_ASSIGN:
+            case OP_INC:
+            case OP_DEC:
+                if (!table[code[i].val].set) {
+                    error(c, NOTFOUND);
+                }
+                break;
+            case OP_ASSIGN:
+                table[code[i].val].set = 1;
                 break;
-            case INT:
-                printf("MOV r%d %d\n", use_reg, root->val);
+            default:
                 break;
-            case ASSIGN:
-                if (root->left->token_type != ID) {
-                    error(NOTID);
+        }
+    }
+}
+
+void freeSymbols(SymbolTable* st) {
+    free(st->table);
+    free(st->slots);
+    free(st->names);
+}
+
+// Instruction of each binary operator, and MOV for a step of a chain
+static const Opcode opcodes[] = {
+    [OP_ADD] = I_ADD, [OP_SUB] = I_SUB, [OP_MUL] = I_MUL, [OP_DIV] = I_DIV,
+    [OP_AND] = I_AND, [OP_OR] = I_OR,   [OP_XOR] = I_XOR,
+    [OP_ADD_ASSIGN] = I_ADD, [OP_SUB_ASSIGN] = I_SUB,
+    [OP_INC] = I_ADD, [OP_DEC] = I_SUB, [OP_ASSIGN] = I_MOV,
+};
+
+// What MOV k and MUL cost, which a chain has to beat
+#define MUL_BUDGET (COST_MOV_CONST + COST_MUL)
+
+static void addChain(CodeGen* g, unsigned k, int cost, const MulStep* step,
+                     int n) {
+    MulChain* chain = NULL;
+    for (int i = 0; i < g->nchain; i++) {
+        if (g->chains[i].k == (int)k) {
+            chain = &g->chains[i];
+        }
+    }
+    if (!chain) {
+        if (g->nchain == MULCHAINS) {
+            return;
+        }
+        chain = &g->chains[g->nchain++];
+        chain->k = (int)k;
+    } else if (chain->cost <= cost) {
+        return;
+    }
+    chain->cost = cost;
+    chain->n = n;
+    memcpy(chain->step, step, n * sizeof(MulStep));
+}
+
+// Try every chain of up to MULSTEPS steps under MUL_BUDGET
+// val[0] and val[1] are the multiples of the operand in the two
+// registers, the scratch register is unknown until written
+static void searchChains(CodeGen* g, unsigned val[2], int known, int cost,
+                         MulStep* step, int n) {
+    static const MulStep moves[] = {
+        {OP_ASSIGN, 1, 0}, {OP_ASSIGN, 0, 1}, {OP_ADD, 0, 0}, {OP_ADD, 0, 1},
+        {OP_ADD, 1, 0},    {OP_ADD, 1, 1},    {OP_SUB, 0, 0}, {OP_SUB, 0, 1},
+        {OP_SUB, 1, 0},    {OP_SUB, 1, 1},
+    };
+
+    addChain(g, val[0], cost, step, n);
+    if (n == MULSTEPS) {
+        return;
+    }
+    for (size_t i = 0; i < sizeof(moves) / sizeof(moves[0]); i++) {
+        MulStep m = moves[i];
+        unsigned next[2] = {val[0], val[1]};
+        int more;
+        if ((m.src == 1 && !known) ||
+            (m.op != OP_ASSIGN && m.dst == 1 && !known)) {
+            continue;
+        }
+        if (m.op == OP_ASSIGN) {
+            next[m.dst] = val[m.src];
+            more = COST_MOV_REG;
+        } else if (m.op == OP_ADD) {
+            next[m.dst] = val[m.dst] + val[m.src];
+            more = COST_ADD;
+        } else {
+            next[m.dst] = val[m.dst] - val[m.src];
+            more = COST_SUB;
+        }
+        if (cost + more < MUL_BUDGET) {
+            step[n] = m;
+            searchChains(g, next, known || m.dst == 1, cost + more, step,
+                         n + 1);
+        }
+    }
+}
+
+// The chain for a MUL by k, NULL if MUL is cheaper
+static const MulChain* findChain(CodeGen* g, int k) {
+    if (!g->nchain) {
+        unsigned val[2] = {1, 0};
+        MulStep step[MULSTEPS];
+        searchChains(g, val, 0, 0, step, 0);
+    }
+    for (int i = 0; i < g->nchain; i++) {
+        if (g->chains[i].k == k) {
+            return &g->chains[i];
+        }
+    }
+    return NULL;
+}
+
+// The chain for a MUL whose operand *k is an INT, NULL if MUL is cheaper
+// *x is set to the other operand
+static const MulChain* mulChain(Compiler* c, const BTNode* code,
+                                const BTNode* inst, int* k, int* x) {
+    CodeGen* g = &c->codegen;
+
+    if (inst->op != OP_MUL) {
+        return NULL;
+    }
+    if (code[inst->right].op == OP_INT) {
+        *k = inst->right;
+        *x = inst->left;
+    } else if (code[inst->left].op == OP_INT) {
+        *k = inst->left;
+        *x = inst->right;
+    } else {
+        return NULL;
+    }
+    return findChain(g, code[*k].val);
+}
+
+int mulCost(Compiler* c, int k) {
+    const MulChain* chain = findChain(&c->codegen, k);
+    return chain ? chain->cost : MUL_BUDGET;
+}
+
+// The value of an operand, an ASSIGN has the value it stores and an ID
+// may be a value that is already in a register
+static int value(const CodeGen* g, const BTNode* code, int i) {
+    while (code[i].op == OP_ASSIGN || g->alias[i]) {
+        i = code[i].op == OP_ASSIGN ? code[i].right : g->alias[i];
+    }
+    return i;
+}
+
+// The first instruction from code[at] on that uses value v, or
+// at + LOOKAHEAD if none is that close
+static int nextUse(const CodeGen* g, const BTNode* code, int n, int at,
+                   int v) {
+    int end = n - at < LOOKAHEAD ? n : at + LOOKAHEAD - 1;
+    for (int i = at; i <= end; i++) {
+        if ((code[i].left && value(g, code, code[i].left) == v) ||
+            (code[i].right && value(g, code, code[i].right) == v)) {
+            return i;
+        }
+    }
+    return at + LOOKAHEAD;
+}
+
+// Forget the variables cached in register r, which is about to change
+static void clobber(Compiler* c, int r) {
+    Symbol* table = c->symbols.table;
+    for (int sym = c->codegen.cached[r]; sym >= 0; sym = table[sym].next) {
+        table[sym].reg = -1;
+    }
+    c->codegen.cached[r] = -1;
+}
+
+// Note that register r holds the value of variable sym, which no other
+// register does any more
+static void cache(Compiler* c, int sym, int r) {
+    Symbol* table = c->symbols.table;
+    CodeGen* g = &c->codegen;
+    if (table[sym].reg >= 0) {
+        int* link = &g->cached[table[sym].reg];
+        while (*link != sym) {
+            link = &table[*link].next;
+        }
+        *link = table[sym].next;
+    }
+    table[sym].reg = r;
+    table[sym].next = g->cached[r];
+    g->cached[r] = sym;
+    g->stamp[r] = ++g->clock;
+}
+
+// A register that holds neither a value nor a variable, -1 if none
+static int freeReg(const CodeGen* g) {
+    for (int r = g->first; r < 8; r++) {
+        if (!g->owner[r] && g->cached[r] < 0) {
+            return r;
+        }
+    }
+    return -1;
+}
+
+static int cachedCount(Compiler* c, int r) {
+    int count = 0;
+    for (int sym = c->codegen.cached[r]; sym >= 0;
+         sym = c->symbols.table[sym].next) {
+        count++;
+    }
+    return count;
+}
+
+// A register without a value that caches fewer variables than register
+// than, which are cheaper to lose, -1 if none
+static int spareReg(Compiler* c, int than) {
+    CodeGen* g = &c->codegen;
+    int best = -1, bestCount = cachedCount(c, than);
+    for (int r = g->first; r < 8; r++) {
+        if (r != than && !g->owner[r]) {
+            int count = cachedCount(c, r);
+            if (count < bestCount ||
+                (count == bestCount && best >= 0 &&
+                 g->stamp[r] < g->stamp[best])) {
+                best = r;
+                bestCount = count;
+            }
+        }
+    }
+    return best;
+}
+
+// What it costs to take the register of value v and get it back: an INT
+// is made again, a value that was spilled is still in its slot, any
+// other value is stored first
+static int evictCost(const CodeGen* g, const BTNode* code, int v) {
+    return code[v].op == OP_INT ? COST_MOV_CONST
+           : g->spill[v] >= 0   ? COST_LOAD
+                                : COST_STORE + COST_LOAD;
+}
+
+// A free spill slot, one of a dead value if there is one
+static int takeSlot(Compiler* c) {
+    CodeGen* g = &c->codegen;
+    if (g->nfree) {
+        return g->freeslot[--g->nfree];
+    }
+    // Memory below the slots holds x, y and z
+    if (3 + g->nslot == MEMSIZE / 4) {
+        error(c, RUNOUT);
+    }
+    return MEMSIZE - 4 * ++g->nslot;
+}
+
+// Get a register to write for the instruction at. If all are taken,
+// drop the variable used longest ago, which costs a load if it is read
+// again, or else spill the value whose next use is furthest for what it
+// costs to get it back. The values in pin[] are never spilled
+static int takeReg(Compiler* c, const BTNode* code, int n, int at) {
+    CodeGen* g = &c->codegen;
+    int victim = freeReg(g), far = 0, cost = 1;
+
+    if (victim >= 0) {
+        return victim;
+    }
+    for (int r = g->first; r < 8; r++) {
+        if (!g->owner[r] && (victim < 0 || g->stamp[r] < g->stamp[victim])) {
+            victim = r;
+        }
+    }
+    if (victim >= 0) {
+        clobber(c, victim);
+        return victim;
+    }
+    for (int r = g->first; r < 8; r++) {
+        int v = g->owner[r], next, more;
+        if (v == g->pin[0] || v == g->pin[1] || v == g->pin[2]) {
+            continue;
+        }
+        next = nextUse(g, code, n, at, v) - at;
+        more = evictCost(g, code, v);
+        if ((long)next * cost > (long)far * more) {
+            victim = r;
+            far = next;
+            cost = more;
+        }
+    }
+    // A value already spilled is still in its slot, values never change
+    if (code[g->owner[victim]].op != OP_INT && g->spill[g->owner[victim]] < 0) {
+        g->spill[g->owner[victim]] = takeSlot(c);
+        put(c, I_MOV, A_ADDR, g->spill[g->owner[victim]], A_REG, victim);
+    }
+    g->regs[g->owner[victim]] = -1;
+    g->owner[victim] = 0;
+    clobber(c, victim);
+    return victim;
+}
+
+// Get the register of value v, reloading it if it was spilled
+static int load(Compiler* c, const BTNode* code, int n, int at, int v) {
+    CodeGen* g = &c->codegen;
+    if (g->regs[v] < 0) {
+        int r = takeReg(c, code, n, at);
+        if (code[v].op == OP_INT) {
+            put(c, I_MOV, A_REG, r, A_CONST, code[v].val);
+        } else {
+            put(c, I_MOV, A_REG, r, A_ADDR, g->spill[v]);
+        }
+        g->regs[v] = r;
+        g->owner[r] = v;
+    }
+    return g->regs[v];
+}
+
+// Put value v in register r
+static void define(CodeGen* g, int v, int r) {
+    g->regs[v] = r;
+    g->owner[r] = v;
+}
+
+// Free the register and the spill slot of value v, which is dead
+static void retire(CodeGen* g, int v) {
+    if (g->regs[v] >= 0) {
+        g->owner[g->regs[v]] = 0;
+        g->regs[v] = -1;
+    }
+    if (g->spill[v] >= 0) {
+        g->freeslot[g->nfree++] = g->spill[v];
+        g->spill[v] = -1;
+    }
+}
+
+// Count a use of value v, and free it after the last one
+static void drop(CodeGen* g, int v) {
+    if (--g->uses[v] == 0) {
+        retire(g, v);
+    }
+}
+
+// Load the initial value of a pinned variable, unless it was already
+static void loadPinned(Compiler* c, int sym) {
+    if (!(c->codegen.loaded & 1 << sym)) {
+        put(c, I_MOV, A_REG, sym, A_ADDR, get_addr(c, sym));
+        c->codegen.loaded |= 1 << sym;
+    }
+}
+
+// Move the value in the register of a pinned variable to another
+// register, before the variable changes
+static void vacate(Compiler* c, const BTNode* code, int n, int at, int r) {
+    CodeGen* g = &c->codegen;
+    int v = g->owner[r];
+    if (v) {
+        int to = takeReg(c, code, n, at);
+        put(c, I_MOV, A_REG, to, A_REG, r);
+        g->owner[r] = 0;
+        define(g, v, to);
+    }
+}
+
+// The register of the pinned variable that instruction at is assigned
+// to right away, if at can compute its value there, else -1
+static int target(Compiler* c, const BTNode* code, int n, int at) {
+    const CodeGen* g = &c->codegen;
+    int r;
+    if (at == n || code[at + 1].op != OP_ASSIGN ||
+        code[at + 1].right != at || code[at + 1].val >= g->first) {
+        return -1;
+    }
+    r = code[at + 1].val;
+    return g->owner[r] ? -1 : r;
+}
+
+// Get the register for instruction at, which updates variable sym, with
+// the old value of sym in it
+static int updateReg(Compiler* c, const BTNode* code, int n, int at,
+                     int sym) {
+    CodeGen* g = &c->codegen;
+    int r = c->symbols.table[sym].reg, use_reg;
+
+    if (sym < g->first) {
+        loadPinned(c, sym);
+        vacate(c, code, n, at, sym);
+        clobber(c, sym);
+        define(g, at, sym);
+        return sym;
+    }
+    if (r >= g->first && !g->owner[r]) {
+        clobber(c, r);
+        define(g, at, r);
+        return r;
+    }
+    if (r >= 0) {
+        g->pin[0] = g->owner[r];
+    }
+    define(g, at, use_reg = takeReg(c, code, n, at));
+    if (r >= 0) {
+        put(c, I_MOV, A_REG, use_reg, A_REG, r);
+    } else {
+        put(c, I_MOV, A_REG, use_reg, A_ADDR, get_addr(c, sym));
+    }
+    return use_reg;
+}
+
+// Whether instruction at can put its result in register r of an
+// operand: if this is the last use of the operand and r does not hold
+// more variables than another register would lose; a pinned variable
+// only gives its register to its own new value
+static int reusable(Compiler* c, const BTNode* code, int n, int at, int dies,
+                    int r) {
+    const CodeGen* g = &c->codegen;
+    if (!dies) {
+        return 0;
+    }
+    if (r < g->first) {
+        return at < n && code[at + 1].op == OP_ASSIGN &&
+               code[at + 1].right == at && code[at + 1].val == r;
+    }
+    return g->cached[r] < 0 || spareReg(c, r) < 0;
+}
+
+void generate_code(Compiler* c, const BTNode* code, int n) {
+    CodeGen* g = &c->codegen;
+    const MulChain* chain;
+    int i, k, x;
+
+    g->regs = (int*)grow(c, g->regs, &g->regcap, n + 1, sizeof(int));
+    g->uses = (int*)grow(c, g->uses, &g->usecap, n + 1, sizeof(int));
+    g->spill = (int*)grow(c, g->spill, &g->spillcap, n + 1, sizeof(int));
+    g->alias = (int*)grow(c, g->alias, &g->aliascap, n + 1, sizeof(int));
+    memset(g->owner, 0, sizeof(g->owner));
+    g->nslot = g->nfree = 0;
+
+    // A shared value is used by each of its users
+    // The constant of a MUL done as a chain is never loaded
+    for (i = 1; i <= n; i++) {
+        g->regs[i] = g->spill[i] = -1;
+        g->uses[i] = g->alias[i] = 0;
+    }
+    for (i = 1; i <= n; i++) {
+        const BTNode* inst = &code[i];
+        if ((chain = mulChain(c, code, inst, &k, &x))) {
+            g->uses[value(g, code, x)]++;
+        } else {
+            if (inst->left) {
+                g->uses[value(g, code, inst->left)]++;
+            }
+            if (inst->right) {
+                g->uses[value(g, code, inst->right)]++;
+            }
+        }
+    }
+
+    for (i = 1; i <= n; i++) {
+        const BTNode* inst = &code[i];
+        int left = inst->left ? value(g, code, inst->left) : NIL;
+        int right = inst->right ? value(g, code, inst->right) : NIL;
+        int use_reg, src, scratch, dies, into;
+
+        g->pin[0] = left;
+        g->pin[1] = right;
+        g->pin[2] = i;
+        switch (inst->op) {
+            case OP_ID:
+                // A variable still in a register is not loaded again
+                // or is the value that holds it
+                if (inst->val < g->first) {
+                    loadPinned(c, inst->val);
                 }
-                generate_code(root->right, use_reg);
-                printf("MOV [%d] r%d\n", get_addr(root->left->lexeme, 1),
-                       use_reg);
+                src = c->symbols.table[inst->val].reg;
+                if (src >= 0 && !g->owner[src]) {
+                    define(g, i, src);
+                    g->stamp[src] = ++g->clock;
+                } else if (src >= 0) {
+                    g->alias[i] = g->owner[src];
+                    g->uses[g->owner[src]] += g->uses[i];
+                    g->stamp[src] = ++g->clock;
+                    continue;
+                } else {
+                    use_reg = target(c, code, n, i);
+                    if (use_reg < 0) {
+                        use_reg = takeReg(c, code, n, i);
+                    }
+                    clobber(c, use_reg);
+                    define(g, i, use_reg);
+                    put(c, I_MOV, A_REG, use_reg, A_ADDR,
+                        get_addr(c, inst->val));
+                    cache(c, inst->val, use_reg);
+                }
+                break;
+            case OP_INT:
+                if (!g->uses[i] && i != n) {
+                    continue;
+                }
+                use_reg = target(c, code, n, i);
+                if (use_reg < 0) {
+                    use_reg = takeReg(c, code, n, i);
+                }
+                clobber(c, use_reg);
+                define(g, i, use_reg);
+                put(c, I_MOV, A_REG, use_reg, A_CONST, inst->val);
                 break;
-            case ADDSUB_ASSIGN:
-                if (root->left->token_type != ID) {
-                    error(NOTID);
-                }
-                generate_code(root->right, (use_reg + 1) % 8);
-                generate_code(root->left, use_reg);
-                if (root->lexeme[0] == '+') {
-                    printf("ADD r%d r%d\n", use_reg, (use_reg + 1) % 8);
+            case OP_ASSIGN:
+                use_reg = load(c, code, n, i, right);
+                if (inst->val < g->first) {
+                    // A pinned variable is never stored
+                    if (use_reg != inst->val) {
+                        vacate(c, code, n, i, inst->val);
+                        clobber(c, inst->val);
+                        put(c, I_MOV, A_REG, inst->val, A_REG, use_reg);
+                    }
+                    g->loaded |= 1 << inst->val;
+                    cache(c, inst->val, inst->val);
                 } else {
-                    printf("SUB r%d r%d\n", use_reg, (use_reg + 1) % 8);
+                    put(c, I_MOV, A_ADDR, get_addr(c, inst->val), A_REG,
+                        use_reg);
+                    cache(c, inst->val, use_reg);
+                }
+                drop(g, right);
+                continue;
+            case OP_ADD_ASSIGN:
+            case OP_SUB_ASSIGN:
+                load(c, code, n, i, right);
+                use_reg = updateReg(c, code, n, i, inst->val);
+                // The operand may have been moved out of a pinned register
+                src = load(c, code, n, i, right);
+                put(c, opcodes[inst->op], A_REG, use_reg, A_REG, src);
+                if (inst->val >= g->first) {
+                    put(c, I_MOV, A_ADDR, get_addr(c, inst->val), A_REG,
+                        use_reg);
                 }
-                printf("MOV [%d] r%d\n", get_addr(root->left->lexeme, 0),
-                       use_reg);
+                cache(c, inst->val, use_reg);
+                drop(g, right);
                 break;
-            case INCDEC:
-                if (root->left->token_type != ID) {
-                    error(NOTID);
-                }
-                generate_code(root->left, use_reg);
-                printf("MOV r%d, 1\n", (use_reg + 1) % 8);
-                if (root->lexeme[0] == '+') {
-                    printf("ADD r%d r%d\n", use_reg, (use_reg + 1) % 8);
+            case OP_INC:
+            case OP_DEC:
+                use_reg = updateReg(c, code, n, i, inst->val);
+                scratch = takeReg(c, code, n, i);
+                put(c, I_MOV, A_REG, scratch, A_CONST, 1);
+                put(c, opcodes[inst->op], A_REG, use_reg, A_REG, scratch);
+                if (inst->val >= g->first) {
+                    put(c, I_MOV, A_ADDR, get_addr(c, inst->val), A_REG,
+                        use_reg);
+                }
+                cache(c, inst->val, use_reg);
+                break;
+            default:
+                chain = mulChain(c, code, inst, &k, &x);
+                if (chain) {
+                    left = value(g, code, x);
+                    right = g->pin[1] = NIL;
+                }
+                use_reg = load(c, code, n, i, left);
+                src = right ? load(c, code, n, i, right) : -1;
+                // Operands of ADD, MUL, AND, OR and XOR can be swapped, so
+                // that the result goes to the register of the right one
+                dies = g->uses[left] == (left == right ? 2 : 1);
+                if (!chain && right != left && inst->op != OP_SUB &&
+                    inst->op != OP_DIV &&
+                    !reusable(c, code, n, i, dies, use_reg) &&
+                    reusable(c, code, n, i, g->uses[right] == 1, src)) {
+                    int t = left;
+                    left = right;
+                    right = t;
+                    src = use_reg;
+                    use_reg = g->regs[left];
+                    dies = 1;
+                }
+                into = target(c, code, n, i);
+                if (reusable(c, code, n, i, dies, use_reg)) {
+                    clobber(c, use_reg);
+                    g->regs[left] = -1;
+                } else {
+                    int copy = into >= 0 ? into
+                               : dies && use_reg >= g->first
+                                   ? spareReg(c, use_reg)
+                                   : takeReg(c, code, n, i);
+                    clobber(c, copy);
+                    put(c, I_MOV, A_REG, copy, A_REG, use_reg);
+                    use_reg = copy;
+                }
+                define(g, i, use_reg);
+                if (chain) {
+                    int reg[2] = {use_reg, -1};
+                    for (int j = 0; j < chain->n; j++) {
+                        const MulStep* step = &chain->step[j];
+                        if (reg[1] < 0 && (step->dst || step->src)) {
+                            reg[1] = takeReg(c, code, n, i);
+                        }
+                        put(c, opcodes[step->op], A_REG, reg[step->dst], A_REG,
+                            reg[step->src]);
+                    }
                 } else {
-                    printf("SUB r%d r%d\n", use_reg, (use_reg + 1) % 8);
+                    put(c, opcodes[inst->op], A_REG, use_reg, A_REG, src);
+                }
+                drop(g, left);
+                if (right) {
+                    drop(g, right);
                 }
-                printf("MOV [%d] r%d\n", get_addr(root->left->lexeme, 0),
-                       use_reg);
                 break;
-            case AND:
-            case OR:
-            case XOR:
-            case ADDSUB:
-            case MULDIV:
-                generate_code(root->left, use_reg);
-                generate_code(root->right, (use_reg + 1) % 8);
-                if (root->lexeme[0] == '+') {
-                    printf("ADD r%d r%d\n", use_reg, (use_reg + 1) % 8);
-                } else if (root->lexeme[0] == '-') {
-                    printf("SUB r%d r%d\n", use_reg, (use_reg + 1) % 8);
-                } else if (root->lexeme[0] == '*') {
-                    printf("MUL r%d r%d\n", use_reg, (use_reg + 1) % 8);
-                } else if (root->lexeme[0] == '/') {
-                    printf("DIV r%d r%d\n", use_reg, (use_reg + 1) % 8);
-                } else if (root->lexeme[0] == '&') {
-                    printf("AND r%d r%d\n", use_reg, (use_reg + 1) % 8);
-                } else if (root->lexeme[0] == '|') {
-                    printf("OR r%d r%d\n", use_reg, (use_reg + 1) % 8);
-                } else if (root->lexeme[0] == '^') {
-                    printf("XOR r%d r%d\n", use_reg, (use_reg + 1) % 8);
+        }
+        // A value nobody uses, like the root, is not kept
+        if (!g->uses[i]) {
+            retire(g, i);
+        }
+    }
+}
+
+static void generate_exit(Compiler* c) {
+    for (int sym = 0; sym < 3; sym++) {
+        const Symbol* s = &c->symbols.table[sym];
+        // With eval every variable is known, unless a statement that
+        // writes it was left to run time, and then it is where the
+        // generated code keeps it
+        if (c->opt.eval && s->known) {
+            put(c, I_MOV, A_REG, sym, A_CONST, s->value);
+        } else if (c->opt.pin) {
+            loadPinned(c, sym);
+        } else {
+            put(c, I_MOV, A_REG, sym, A_ADDR, get_addr(c, sym));
+        }
+    }
+    put(c, I_EXIT, A_CONST, 0, A_CONST, 0);
+}
+
+// Mark the instructions of statement s that are kept, from the variables
+// that are live after it, and leave live[] as it is before it
+static void liveness(Compiler* c, int s) {
+    const Parser* p = &c->parser;
+    const BTNode* code = p->prog + p->stmts[s];
+    unsigned char* need = c->codegen.need + p->stmts[s];
+    unsigned char* live = c->codegen.live;
+
+    for (int i = p->stmts[s + 1] - p->stmts[s]; i > 0; i--) {
+        const BTNode* inst = &code[i];
+        switch (inst->op) {
+            case OP_ASSIGN:
+            case OP_ADD_ASSIGN:
+            case OP_SUB_ASSIGN:
+            case OP_INC:
+            case OP_DEC:
+                if (live[inst->val]) {
+                    need[i] |= N_STORE | N_KEEP;
+                } else if (need[i] & N_USED) {
+                    need[i] |= N_KEEP;
+                }
+                // An update reads the variable, an assignment kills it
+                live[inst->val] = inst->op != OP_ASSIGN && (need[i] & N_KEEP);
+                break;
+            case OP_ID:
+                if (need[i] & N_USED) {
+                    need[i] |= N_KEEP;
+                    live[inst->val] = 1;
+                }
+                break;
+            case OP_DIV:
+                // A division that may be by zero stays, used or not
+                if (code[inst->right].op != OP_INT ||
+                    code[inst->right].val == 0 || (need[i] & N_USED)) {
+                    need[i] |= N_KEEP;
                 }
                 break;
             default:
+                if (need[i] & N_USED) {
+                    need[i] |= N_KEEP;
+                }
                 break;
         }
+        if ((need[i] & N_KEEP) && inst->left) {
+            need[inst->left] |= N_USED;
+        }
+        if ((need[i] & N_KEEP) && inst->right) {
+            need[inst->right] |= N_USED;
+        }
     }
 }
+
+// Append the kept instructions of statement s to kept[k + 1..] and
+// return the new size. A variable other than x, y and z is the value
+// last assigned to it, and an update of one is the plain operation on
+// that value. So is an update of x, y or z that is never read again
+static int keep(Compiler* c, int s, int k) {
+    const Parser* p = &c->parser;
+    CodeGen* g = &c->codegen;
+    const BTNode* code = p->prog + p->stmts[s];
+    const unsigned char* need = g->need + p->stmts[s];
+    int n = p->stmts[s + 1] - p->stmts[s];
+
+    // An update becomes up to three instructions
+    g->kept = (BTNode*)grow(c, g->kept, &g->keptcap, k + 3 * n + 1,
+                            sizeof(BTNode));
+    g->map = (int*)grow(c, g->map, &g->mapcap, n + 1, sizeof(int));
+    g->map[NIL] = NIL;
+    for (int i = 1; i <= n; i++) {
+        BTNode inst = code[i];
+        BTNode* out = g->kept;
+        int sym = inst.val, old;
+        if (!(need[i] & N_KEEP)) {
+            continue;
+        }
+        inst.left = g->map[inst.left];
+        inst.right = g->map[inst.right];
+        if (inst.op == OP_ID && sym >= 3) {
+            g->map[i] = g->def[sym];
+            continue;
+        }
+        if (inst.op >= OP_ASSIGN && (sym >= 3 || !(need[i] & N_STORE))) {
+            if (inst.op == OP_ASSIGN) {
+                g->map[i] = inst.right;
+                if (sym >= 3) {
+                    g->def[sym] = inst.right;
+                }
+                continue;
+            }
+            if (sym >= 3) {
+                old = g->def[sym];
+            } else {
+                out[++k] = (BTNode){OP_ID, sym, NIL, NIL};
+                old = k;
+            }
+            switch (inst.op) {
+                case OP_ADD_ASSIGN:
+                case OP_SUB_ASSIGN:
+                    inst = (BTNode){inst.op == OP_ADD_ASSIGN ? OP_ADD : OP_SUB,
+                                    0, old, inst.right};
+                    break;
+                default:
+                    out[++k] = (BTNode){OP_INT, 1, NIL, NIL};
+                    inst = (BTNode){inst.op == OP_INC ? OP_ADD : OP_SUB, 0,
+                                    old, k};
+                    break;
+            }
+            if (sym >= 3) {
+                g->def[sym] = k + 1;
+            }
+        }
+        out[++k] = inst;
+        g->map[i] = k;
+    }
+    return k;
+}
+
+// Generate the statements that are kept and the end of the program
+static void generate_statements(Compiler* c) {
+    const Parser* p = &c->parser;
+    CodeGen* g = &c->codegen;
+    int s, n;
+
+    g->need = (unsigned char*)grow(c, g->need, &g->needcap, p->progsize + 1,
+                                   sizeof(unsigned char));
+    g->live = (unsigned char*)grow(c, g->live, &g->livecap,
+                                   c->symbols.count, sizeof(unsigned char));
+    g->def = (int*)grow(c, g->def, &g->defcap, c->symbols.count,
+                        sizeof(int));
+    memset(g->need, 0, p->progsize + 1);
+    memset(g->live, 0, c->symbols.count);
+    // Only x, y and z are read at the end
+    memset(g->live, 1, 3);
+    for (s = p->nstmt - 1; s >= 0; s--) {
+        liveness(c, s);
+    }
+    for (s = n = 0; s < p->nstmt; s++) {
+        n = keep(c, s, n);
+    }
+    if (n) {
+        generate_code(c, g->kept, n);
+    }
+    generate_exit(c);
+}
+
+// Start a way of generating the program in buffer b
+static void begin(Compiler* c, InstBuffer* b) {
+    b->n = 0;
+    memset(b->fired, 0, sizeof(b->fired));
+    c->insts = b;
+}
+
+void generate_program(Compiler* c) {
+    jmp_buf fail;
+    Buffer scratch = {NULL, 0, 0}, *out = c->out;
+    volatile int best = 0;  // set between setjmp() and a longjmp()
+    int n;
+
+    begin(c, &c->alt[0]);
+    generate_statements(c);
+    peephole(&c->alt[0]);
+    // At level 2 both ways, and the cheaper one is kept
+    // Running out of memory for spills only rules the second way out, so
+    // the "EXIT 1" err() writes for it goes to scratch, not to the output
+    memcpy(fail, c->fail, sizeof(jmp_buf));
+    c->out = &scratch;
+    if (c->opt.level >= 2 && !c->opt.eval && !setjmp(c->fail)) {
+        begin(c, &c->alt[1]);
+        n = resynthesize(c);
+        resetRegs(c);
+        if (n) {
+            generate_code(c, c->symbolic.code, n);
+        }
+        generate_exit(c);
+        peephole(&c->alt[1]);
+        best = instCycles(&c->alt[1]) < instCycles(&c->alt[0]);
+    }
+    memcpy(c->fail, fail, sizeof(jmp_buf));
+    c->out = out;
+    free(scratch.data);
+    for (int rule = 0; rule < P_RULES; rule++) {
+        c->fired[rule] += c->alt[best].fired[rule];
+    }
+    writeInsts(c, &c->alt[best]);
+}
+
+void freeCodeGen(CodeGen* g) {
+    free(g->regs);
+    free(g->uses);
+    free(g->spill);
+    free(g->alias);
+    free(g->need);
+    free(g->live);
+    free(g->kept);
+    free(g->map);
+    free(g->def);
+}
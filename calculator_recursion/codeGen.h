@@ -3,25 +3,135 @@
 
 #include "parser.h"
 
-#define TBLSIZE 64
+// Bytes of data memory, variables get one 4-byte word each
+#define MEMSIZE 256
 
 
 // Structure of the symbol table
 typedef struct {
-    char name[MAXLEN];
+    int name;  // offset of the name in the name pool
+    int len;
+    int addr;  // address of x, y and z, -1 for the others
+    int set;   // 1 once the parser has seen the variable assigned
+    int reg;   // register that still holds its value, -1 if none
+    int next;  // next symbol cached in the same register, -1 if none
+
+    // Constant propagation: known is 1 while the variable surely holds
+    // value at the point the parser is at, 0 while it depends on the
+    // input or is not assigned yet
+    int known;
+    int value;
 } Symbol;
 
 
-// The symbol table
-extern Symbol table[TBLSIZE];
+// The symbol table, a hash table that grows as needed
+typedef struct {
+    Symbol *table;
+    int count, cap;
+
+    // Open addressing slots holding symbol ID + 1, 0 if empty
+    int *slots;
+    int slotcap;
+
+    // All names back to back
+    char *names;
+    int namelen, namecap;
+} SymbolTable;
+
+// A multiplication by a constant as MOV, ADD and SUB on the register of
+// the product and one scratch register
+#define MULSTEPS 4
+#define MULCHAINS 32
+
+typedef struct {
+    unsigned char op;        // OP_ADD, OP_SUB, or OP_ASSIGN for a MOV
+    unsigned char dst, src;  // 0 for the product, 1 for the scratch register
+} MulStep;
+
+typedef struct {
+    int k;
+    int n, cost;
+    MulStep step[MULSTEPS];
+} MulChain;
+
+// Instructions takeReg() looks ahead for the next use of a value
+#define LOOKAHEAD 256
+
+// State of the code generator
+typedef struct {
+    // Register allocation of the whole program, by instruction
+    int *regs;   // register holding the value, -1 if it is in none
+    int *uses;   // uses of the value that are still to be generated
+    int *spill;  // address of the slot it was spilled to, -1 if none
+    int *alias;  // the value an ID is, if it was in a register, else 0
+    int regcap, usecap, spillcap, aliascap;
+    int owner[8];  // value in each register, 0 if it is free
+    int pin[3];    // values the current instruction needs in registers
+    int nslot;     // spill slots made, from the top of memory down
+    int freeslot[MEMSIZE / 4];  // slots of values that are dead
+    int nfree;
+
+    // x, y and z while their value is still in a register. Every
+    // assignment is stored at once, so a register never holds a value
+    // that memory does not have, unless they are pinned to r0-r2
+    int first;      // first register for values, 3 if x, y, z are pinned
+    int loaded;     // bit of each pinned variable that has its value
+    int cached[8];  // first symbol cached in each register, -1 if none
+    int stamp[8];   // when the register was last used for a variable
+    int clock;
+
+    // Chains cheaper than a MUL by a constant, found once per compiler
+    MulChain chains[MULCHAINS];
+    int nchain;
+
+    // Liveness of the buffered program, so that only what can change
+    // x, y and z or divide by zero is generated
+    unsigned char *need;  // N_* bits of each instruction of the program
+    unsigned char *live;  // variables that are read before the next write
+    BTNode *kept;         // the instructions of the program that are kept
+    int *map;             // index in kept of each instruction's value
+    int *def;             // index in kept of each variable's value
+    int needcap, livecap, keptcap, mapcap, defcap;
+} CodeGen;
+
+// Bits of need[]
+#define N_USED 1   // the value is an operand of a kept instruction
+#define N_KEEP 2   // the instruction is generated
+#define N_STORE 4  // the variable it writes is read again
+
+// Initialize the symbol table with builtin variables, with none of them
+// in a register
+extern void initTable(Compiler *c);
+
+// Get the symbol ID of a name, adding it to the table if it is new
+extern int intern(Compiler *c, const char *name, int len);
+
+// Get the address of x, y or z, the only variables in memory
+extern int get_addr(Compiler *c, int sym);
+
+// Mark each variable code[1..n] assigns as set, in order, and fail with
+// NOTFOUND on a read of one that is not set yet
+extern void bind_vars(Compiler *c, const BTNode *code, int n);
+
+// Cycles of a multiplication by the constant k, with its MOV, as a
+// chain or as a MUL
+extern int mulCost(Compiler *c, int k);
 
-// Initialize the symbol table with builtin variables
-extern void initTable(void);
+// Generate code for the post-order instructions code[1..n]
+extern void generate_code(Compiler *c, const BTNode *code, int n);
 
-// Get the address of a variable
-extern int get_addr(char *str, int add_var);
+// Generate the buffered statements as one block, without the
+// instructions whose result is never read, and the end of the program
+// with x, y and z in r0-r2. The other variables never go to memory: a
+// read of one is the value last assigned to it, which stays in a
+// register until it is spilled
+// At level 2 the code re-synthesized from the normal forms of x, y and z
+// is generated too, and the cheaper of the two is kept
+// The code goes through peephole() before it is written out
+extern void generate_program(Compiler *c);
 
-// Evaluate the syntax tree
-extern void generate_code(BTNode *root, int use_reg);
+// Release the memory of the symbol table and the code generator
+extern void freeSymbols(SymbolTable *st);
+extern void freeCodeGen(CodeGen *g);
 
 #endif // __CODEGEN__
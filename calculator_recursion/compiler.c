@@ -0,0 +1,90 @@
+#include "compiler.h"
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+Compiler *newCompiler(void) {
+    Compiler *c = (Compiler *)calloc(1, sizeof(Compiler));
+    if (c) {
+        c->opt.pin = 1;
+        c->opt.level = 1;
+    }
+    return c;
+}
+
+void freeCompiler(Compiler *c) {
+    if (c) {
+        freeParser(&c->parser);
+        freeSymbols(&c->symbols);
+        freeCodeGen(&c->codegen);
+        freeSymbolic(&c->symbolic);
+        freeSuperopt(&c->superopt);
+        free(c->alt[0].inst);
+        free(c->alt[1].inst);
+        free(c);
+    }
+}
+
+int compile(Compiler *c, const char *src, size_t len, Buffer *out) {
+    int status;
+
+    c->out = out;
+    status = setjmp(c->fail);
+    if (status) {
+        return status;
+    }
+    freeTree(c);
+    c->parser.progsize = c->parser.nstmt = 0;
+    initTable(c);
+    setInput(c, src, len);
+    while (statement(c))
+        ;
+    return 0;
+}
+
+void emit(Compiler *c, const char *fmt, ...) {
+    Buffer *out = c->out;
+    va_list ap;
+    int n;
+
+    va_start(ap, fmt);
+    n = vsnprintf(out->cap ? out->data + out->len : NULL, out->cap - out->len,
+                  fmt, ap);
+    va_end(ap);
+    if (out->len + n >= out->cap) {
+        size_t cap = out->cap ? out->cap : 4096;
+        char *data;
+        while (out->len + n >= cap) {
+            cap <<= 1;
+        }
+        data = (char *)realloc(out->data, cap);
+        if (!data) {
+            // Nowhere to report it, so the output is only cut short
+            longjmp(c->fail, RUNOUT);
+        }
+        out->data = data;
+        out->cap = cap;
+        va_start(ap, fmt);
+        vsnprintf(out->data + out->len, out->cap - out->len, fmt, ap);
+        va_end(ap);
+    }
+    out->len += n;
+}
+
+void *grow(Compiler *c, void *ptr, int *cap, int need, size_t size) {
+    if (need > *cap) {
+        int newcap = *cap ? *cap : 64;
+        while (need > newcap) {
+            newcap <<= 1;
+        }
+        // On failure ptr and *cap are left as they were, for the next
+        // compilation
+        ptr = realloc(ptr, (size_t)newcap * size);
+        if (!ptr) {
+            error(c, RUNOUT);
+        }
+        *cap = newcap;
+    }
+    return ptr;
+}
@@ -0,0 +1,68 @@
+#ifndef __COMPILER__
+#define __COMPILER__
+
+#include <setjmp.h>
+#include <stddef.h>
+#include "lex.h"
+#include "parser.h"
+#include "codeGen.h"
+#include "symbolic.h"
+#include "inst.h"
+#include "superopt.h"
+
+// Growable output buffer, owned by the caller
+// data is allocated with malloc() and may be moved by compile()
+typedef struct {
+    char *data;
+    size_t len, cap;
+} Buffer;
+
+// Code generation choices, set by the caller before compile()
+typedef struct {
+    int pin;  // keep x, y and z in r0-r2 instead of in memory, default 1
+
+    // 2 also re-synthesizes the program from the normal forms of x, y
+    // and z, default 1
+    int level;
+
+    // Evaluate the whole program at compile time, with x, y and z
+    // starting as mem[0..2] instead of unknown, default 0
+    int eval;
+    int mem[3];
+} Options;
+
+// All state of one compilation
+// Nothing is global, so each thread can compile with its own Compiler
+struct Compiler {
+    Lexer lex;
+    Parser parser;
+    SymbolTable symbols;
+    CodeGen codegen;
+    Symbolic symbolic;
+    Superopt superopt;
+    Options opt;
+    Buffer *out;
+    InstBuffer *insts;    // where the code generator puts instructions
+    InstBuffer alt[2];    // the code of each way generate_program() tries
+    long fired[P_RULES];  // peephole rules fired in the code written out
+    jmp_buf fail;         // where err() returns to
+};
+
+// Make a compiler, NULL if out of memory
+// A compiler can be reused, it keeps its memory between compilations
+extern Compiler *newCompiler(void);
+extern void freeCompiler(Compiler *c);
+
+// Compile src[0..len) and append the assembly to out
+// Return 0, or the ErrorType of the error that stopped the compilation
+// The statements are only generated at the end of the input, so an
+// error in the input leaves nothing in out but "EXIT 1"
+extern int compile(Compiler *c, const char *src, size_t len, Buffer *out);
+
+// Append formatted text to the output
+extern void emit(Compiler *c, const char *fmt, ...);
+
+// Grow an array to hold need elements of size bytes
+extern void *grow(Compiler *c, void *ptr, int *cap, int need, size_t size);
+
+#endif  // __COMPILER__
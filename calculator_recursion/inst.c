@@ -0,0 +1,270 @@
+#include "inst.h"
+#include <stdio.h>
+#include <string.h>
+#include "compiler.h"
+#include "../assembly_parser/cost.h"
+
+// Words of data memory, as the simulator has
+#define WORDS 64
+
+const char* ruleNames[P_RULES] = {
+    [P_LOAD] = "redundant load",
+    [P_MOVE] = "redundant move",
+    [P_PAIR] = "store/load pair",
+    [P_DEAD] = "dead register",
+};
+
+static const char* names[] = {
+    [I_MOV] = "MOV", [I_ADD] = "ADD", [I_SUB] = "SUB",
+    [I_MUL] = "MUL", [I_DIV] = "DIV", [I_EXIT] = "EXIT",
+    [I_AND] = "AND", [I_OR] = "OR",   [I_XOR] = "XOR",
+};
+
+void put(Compiler* c, Opcode opcode, ArgType op1_type, int op1_value,
+         ArgType op2_type, int op2_value) {
+    InstBuffer* b = c->insts;
+    Inst* inst;
+
+    b->inst = (Inst*)grow(c, b->inst, &b->cap, b->n + 1, sizeof(Inst));
+    inst = &b->inst[b->n++];
+    inst->opcode = opcode;
+    inst->op1_type = op1_type;
+    inst->op1_value = op1_value;
+    inst->op2_type = op2_type;
+    inst->op2_value = op2_value;
+}
+
+// What a register or a word holds: a constant, or the id of a value
+// that is not known until run time
+typedef struct {
+    int known;
+    int value;
+} Val;
+
+static int same(Val a, Val b) {
+    return a.known == b.known && a.value == b.value;
+}
+
+// Whether memory word addr is one the passes track
+static int tracked(int addr) {
+    return addr >= 0 && addr / 4 < WORDS;
+}
+
+// One pass forward, with what each register and word holds: remove the
+// MOVs that change nothing, load from a register instead of memory, and
+// read the lowest register that has a value, so that copies of it die
+static int forward(InstBuffer* b) {
+    Val reg[8], mem[WORDS];
+    int i, w, r, fresh = 0, changed = 0;
+
+    // Registers start with garbage and memory with the input
+    for (r = 0; r < 8; r++) {
+        reg[r].known = 0;
+        reg[r].value = fresh++;
+    }
+    for (i = 0; i < WORDS; i++) {
+        mem[i].known = 0;
+        mem[i].value = fresh++;
+    }
+    for (i = w = 0; i < b->n; i++) {
+        Inst inst = b->inst[i];
+        Val v;
+
+        if (inst.opcode == I_MOV && inst.op1_type == A_ADDR) {
+            if (!tracked(inst.op1_value)) {
+                b->inst[w++] = inst;
+                continue;
+            }
+            v = reg[inst.op2_value];
+            if (same(mem[inst.op1_value / 4], v)) {
+                b->fired[P_PAIR]++;
+                changed = 1;
+                continue;
+            }
+            mem[inst.op1_value / 4] = v;
+            b->inst[w++] = inst;
+            continue;
+        }
+        if (inst.opcode == I_EXIT) {
+            b->inst[w++] = inst;
+            continue;
+        }
+        if (inst.op2_type == A_REG) {
+            v = reg[inst.op2_value];
+            for (r = 0; r < inst.op2_value; r++) {
+                if (same(reg[r], v)) {
+                    inst.op2_value = r;
+                    b->fired[P_MOVE]++;
+                    changed = 1;
+                    break;
+                }
+            }
+        }
+        if (inst.opcode != I_MOV) {
+            // The result is a new value, a DIV by zero leaves the old one
+            // but that is not known either
+            reg[inst.op1_value].known = 0;
+            reg[inst.op1_value].value = fresh++;
+            b->inst[w++] = inst;
+            continue;
+        }
+        if (inst.op2_type == A_CONST) {
+            v.known = 1;
+            v.value = inst.op2_value;
+        } else if (inst.op2_type == A_REG) {
+            v = reg[inst.op2_value];
+        } else if (tracked(inst.op2_value)) {
+            v = mem[inst.op2_value / 4];
+        } else {
+            v.known = 0;
+            v.value = fresh++;
+        }
+        if (same(reg[inst.op1_value], v)) {
+            b->fired[inst.op2_type == A_ADDR ? P_LOAD : P_MOVE]++;
+            changed = 1;
+            continue;
+        }
+        if (inst.op2_type == A_ADDR) {
+            for (r = 0; r < 8; r++) {
+                if (same(reg[r], v)) {
+                    inst.op2_type = A_REG;
+                    inst.op2_value = r;
+                    b->fired[P_PAIR]++;
+                    changed = 1;
+                    break;
+                }
+            }
+        }
+        reg[inst.op1_value] = v;
+        b->inst[w++] = inst;
+    }
+    b->n = w;
+    return changed;
+}
+
+// One pass backward, with the registers and words that are read later:
+// remove the writes to the others. Only r0-r2 are seen at the EXIT, and
+// a DIV stays for the error a zero divisor gives
+static int backward(InstBuffer* b) {
+    unsigned live = 0;
+    unsigned long long words = 0;
+    int i, w, changed = 0;
+
+    for (i = w = b->n - 1; i >= 0; i--) {
+        Inst inst = b->inst[i];
+
+        switch (inst.opcode) {
+            case I_EXIT:
+                live = 7;
+                words = 0;
+                break;
+            case I_MOV:
+                if (inst.op1_type == A_ADDR) {
+                    if (!tracked(inst.op1_value)) {
+                        live |= 1u << inst.op2_value;
+                        break;
+                    }
+                    if (!(words >> (inst.op1_value / 4) & 1)) {
+                        b->fired[P_DEAD]++;
+                        changed = 1;
+                        continue;
+                    }
+                    words &= ~(1ull << (inst.op1_value / 4));
+                    live |= 1u << inst.op2_value;
+                    break;
+                }
+                if (!(live >> inst.op1_value & 1)) {
+                    b->fired[P_DEAD]++;
+                    changed = 1;
+                    continue;
+                }
+                live &= ~(1u << inst.op1_value);
+                if (inst.op2_type == A_REG) {
+                    live |= 1u << inst.op2_value;
+                } else if (inst.op2_type == A_ADDR) {
+                    // An untracked word is never written, so not dead
+                    if (tracked(inst.op2_value)) {
+                        words |= 1ull << (inst.op2_value / 4);
+                    }
+                }
+                break;
+            default:
+                if (inst.opcode != I_DIV && !(live >> inst.op1_value & 1)) {
+                    b->fired[P_DEAD]++;
+                    changed = 1;
+                    continue;
+                }
+                live |= 1u << inst.op1_value | 1u << inst.op2_value;
+                break;
+        }
+        b->inst[w--] = inst;
+    }
+    // The kept instructions are at the end
+    memmove(b->inst, b->inst + w + 1, (size_t)(b->n - w - 1) * sizeof(Inst));
+    b->n -= w + 1;
+    return changed;
+}
+
+void peephole(InstBuffer* b) {
+    int changed;
+    do {
+        changed = forward(b);
+        changed |= backward(b);
+    } while (changed);
+}
+
+// As cycles() of the simulator
+static int cost(const Inst* i) {
+    switch (i->opcode) {
+        case I_MOV:
+            if (i->op1_type == A_ADDR) {
+                return COST_STORE;
+            }
+            return i->op2_type == A_REG     ? COST_MOV_REG
+                   : i->op2_type == A_CONST ? COST_MOV_CONST
+                                            : COST_LOAD;
+        case I_ADD:
+            return COST_ADD;
+        case I_SUB:
+            return COST_SUB;
+        case I_MUL:
+            return COST_MUL;
+        case I_DIV:
+            return COST_DIV;
+        case I_AND:
+            return COST_AND;
+        case I_OR:
+            return COST_OR;
+        case I_XOR:
+            return COST_XOR;
+        case I_EXIT:
+            return COST_EXIT;
+    }
+    return 0;
+}
+
+long instCycles(const InstBuffer* b) {
+    long total = 0;
+    for (int i = 0; i < b->n; i++) {
+        total += cost(&b->inst[i]);
+    }
+    return total;
+}
+
+void writeInsts(Compiler* c, const InstBuffer* b) {
+    for (int i = 0; i < b->n; i++) {
+        const Inst* inst = &b->inst[i];
+        if (inst->opcode == I_EXIT) {
+            emit(c, "EXIT %d\n", inst->op1_value);
+        } else if (inst->op1_type == A_ADDR) {
+            emit(c, "MOV [%d] r%d\n", inst->op1_value, inst->op2_value);
+        } else if (inst->op2_type == A_REG) {
+            emit(c, "%s r%d r%d\n", names[inst->opcode], inst->op1_value,
+                 inst->op2_value);
+        } else if (inst->op2_type == A_CONST) {
+            emit(c, "MOV r%d %d\n", inst->op1_value, inst->op2_value);
+        } else {
+            emit(c, "MOV r%d [%d]\n", inst->op1_value, inst->op2_value);
+        }
+    }
+}
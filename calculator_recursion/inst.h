@@ -0,0 +1,56 @@
+#ifndef __INST__
+#define __INST__
+
+#include "parser.h"
+
+// Instructions of the target machine, as INST of the simulator
+typedef enum {
+    I_MOV, I_ADD, I_SUB, I_MUL, I_DIV, I_EXIT, I_AND, I_OR, I_XOR
+} Opcode;
+
+typedef enum { A_REG, A_CONST, A_ADDR } ArgType;
+
+typedef struct {
+    Opcode opcode;
+    ArgType op1_type;
+    int op1_value;
+    ArgType op2_type;  // not used by EXIT
+    int op2_value;
+} Inst;
+
+// Rules of the peephole pass
+typedef enum {
+    P_LOAD,  // load of the value the register already has
+    P_MOVE,  // MOV of the value the register already has, or a read of a
+             // register whose value a lower one has too
+    P_PAIR,  // load of a value a register has, or store of the value
+             // the word already has
+    P_DEAD,  // write to a register or a word that is never read
+    P_RULES
+} Rule;
+
+extern const char *ruleNames[P_RULES];
+
+// Growable array of instructions
+typedef struct {
+    Inst *inst;
+    int n, cap;
+    int fired[P_RULES];  // times each rule changed it
+} InstBuffer;
+
+// Append an instruction to c->insts
+extern void put(Compiler *c, Opcode opcode, ArgType op1_type, int op1_value,
+                ArgType op2_type, int op2_value);
+
+// Remove and rewrite the instructions of b that do not change what r0-r2
+// hold at the EXIT, or the divisions b does, and count the rules that
+// fired in b->fired
+extern void peephole(InstBuffer *b);
+
+// Clock cycles of b, by the costs the simulator counts
+extern long instCycles(const InstBuffer *b);
+
+// Append b to the output as text
+extern void writeInsts(Compiler *c, const InstBuffer *b);
+
+#endif  // __INST__
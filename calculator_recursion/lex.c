@@ -1,107 +1,280 @@
 #include "lex.h"
-#include <ctype.h>
-#include <stdio.h>
+#include <stdint.h>
 #include <string.h>
+#include "compiler.h"
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
-static TokenSet getToken(void);
-static TokenSet curToken = UNKNOWN;
-static char lexeme[MAXLEN];
-
-TokenSet getToken(void) {
-    int i = 0;
-    char c = '\0';
-
-    while ((c = fgetc(stdin)) == ' ' || c == '\t')
-        ;
-
-    if (isdigit(c)) {
-        lexeme[0] = c;
-        c = fgetc(stdin);
-        i = 1;
-        while (isdigit(c) && i < MAXLEN) {
-            lexeme[i] = c;
-            ++i;
-            c = fgetc(stdin);
-        }
-        ungetc(c, stdin);
-        lexeme[i] = '\0';
-        return INT;
-    } else if (c == '+' || c == '-') {
-        lexeme[0] = c;
-        c = fgetc(stdin);
-        if (c == '=') {
-            lexeme[1] = c;
-            lexeme[2] = '\0';
-            return ADDSUB_ASSIGN;
-        }
-        if (c == lexeme[0]) {
-            lexeme[1] = c;
-            lexeme[2] = '\0';
-            return INCDEC;
-        }
-        ungetc(c, stdin);
-        lexeme[1] = '\0';
-        return ADDSUB;
-    } else if (c == '*' || c == '/') {
-        lexeme[0] = c;
-        lexeme[1] = '\0';
-        return MULDIV;
-    } else if (c == '&') {
-        lexeme[0] = c;
-        lexeme[1] = '\0';
-        return AND;
-    } else if (c == '|') {
-        lexeme[0] = c;
-        lexeme[1] = '\0';
-        return OR;
-    } else if (c == '^') {
-        lexeme[0] = c;
-        lexeme[1] = '\0';
-        return XOR;
-    } else if (c == '\n') {
-        lexeme[0] = '\0';
-        return END;
-    } else if (c == '=') {
-        lexeme[0] = '=';
-        lexeme[1] = '\0';
-        return ASSIGN;
-    } else if (c == '(') {
-        lexeme[0] = '(';
-        lexeme[1] = '\0';
-        return LPAREN;
-    } else if (c == ')') {
-        lexeme[0] = ')';
-        lexeme[1] = '\0';
-        return RPAREN;
-    } else if (isalpha(c) || c == '_') {
-        lexeme[0] = c;
-        c = fgetc(stdin);
-        i = 1;
-        while ((isalnum(c) || c == '_') && i < MAXLEN) {
-            lexeme[i] = c;
-            ++i;
-            c = fgetc(stdin);
-        }
-        ungetc(c, stdin);
-        lexeme[i] = '\0';
-        return ID;
-    } else if (c == EOF) {
+// Character classes of the tokenizer
+typedef enum {
+    C_OTHER, C_BLANK, C_NEWLINE,
+    C_DIGIT, C_ALPHA,
+    C_ADDSUB, C_MULDIV,
+    C_ASSIGN, C_LPAREN, C_RPAREN,
+    C_AND, C_OR, C_XOR,
+    // Two-character tokens, told apart by the character after '+' or '-'
+    C_ADDSUB_ASSIGN, C_INCDEC,
+} CharClass;
+
+// Runs that are scanned several bytes at a time
+typedef enum { RUN_BLANK, RUN_DIGIT, RUN_IDENT } RunKind;
+
+static TokenSet getToken(Compiler *c);
+
+static const unsigned char charClass[256] = {
+    ['0' ... '9'] = C_DIGIT,
+    ['a' ... 'z'] = C_ALPHA, ['A' ... 'Z'] = C_ALPHA, ['_'] = C_ALPHA,
+    [' '] = C_BLANK,         ['\t'] = C_BLANK,      ['\n'] = C_NEWLINE,
+    ['+'] = C_ADDSUB,        ['-'] = C_ADDSUB,
+    ['*'] = C_MULDIV,        ['/'] = C_MULDIV,
+    ['='] = C_ASSIGN,        ['('] = C_LPAREN,       [')'] = C_RPAREN,
+    ['&'] = C_AND,           ['|'] = C_OR,           ['^'] = C_XOR,
+};
+
+// Token of each class, INT and ID continue as runs
+static const TokenSet classToken[] = {
+    [C_OTHER] = UNKNOWN, [C_BLANK] = UNKNOWN, [C_NEWLINE] = END,
+    [C_DIGIT] = INT,     [C_ALPHA] = ID,
+    [C_ADDSUB] = ADDSUB, [C_MULDIV] = MULDIV,
+    [C_ASSIGN] = ASSIGN, [C_LPAREN] = LPAREN, [C_RPAREN] = RPAREN,
+    [C_AND] = AND,       [C_OR] = OR,         [C_XOR] = XOR,
+    [C_ADDSUB_ASSIGN] = ADDSUB_ASSIGN, [C_INCDEC] = INCDEC,
+};
+
+void setInput(Compiler *c, const char *src, size_t len) {
+    c->lex.buf = src;
+    c->lex.len = len;
+    c->lex.pos = 0;
+    c->lex.token = UNKNOWN;
+}
+
+/*
+ * SWAR helpers: eight bytes at a time in a uint64_t, with the result of
+ * a per-byte test in the high bit of each byte.
+ */
+#define ONES 0x0101010101010101ULL
+#define HIGH 0x8080808080808080ULL
+
+static inline uint64_t load8(const char *p) {
+    uint64_t v;
+    memcpy(&v, p, 8);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap64(v);
+#endif
+    return v;
+}
+
+// Bytes equal to c
+static inline uint64_t swarEq(uint64_t v, unsigned char c) {
+    uint64_t t = v ^ (ONES * c);
+    return ~(((t & ~HIGH) + ~HIGH) | t) & HIGH;
+}
+
+// Bytes in [lo, hi], both below 0x80
+static inline uint64_t swarRange(uint64_t v, unsigned char lo,
+                                 unsigned char hi) {
+    uint64_t x = v & ~HIGH;
+    uint64_t ge = x + ONES * (0x80 - lo);
+    uint64_t gt = x + ONES * (0x7f - hi);
+    return ge & ~gt & ~v & HIGH;
+}
+
+static inline uint64_t swarRun(uint64_t v, RunKind kind) {
+    switch (kind) {
+        case RUN_BLANK:
+            return swarEq(v, ' ') | swarEq(v, '\t');
+        case RUN_DIGIT:
+            return swarRange(v, '0', '9');
+        default:
+            return swarRange(v | (ONES * 0x20), 'a', 'z') |
+                   swarRange(v, '0', '9') | swarEq(v, '_');
+    }
+}
+
+#if defined(__AVX2__)
+typedef __m256i vec;
+#define VWIDTH 32
+#define vload(p) _mm256_loadu_si256((const __m256i *)(p))
+#define vset(c) _mm256_set1_epi8((char)(c))
+#define vor(a, b) _mm256_or_si256(a, b)
+#define veq(a, b) _mm256_cmpeq_epi8(a, b)
+#define vsub(a, b) _mm256_sub_epi8(a, b)
+#define vmin(a, b) _mm256_min_epu8(a, b)
+#define vmask(a) ((uint32_t)_mm256_movemask_epi8(a))
+#elif defined(__SSE2__)
+typedef __m128i vec;
+#define VWIDTH 16
+#define vload(p) _mm_loadu_si128((const __m128i *)(p))
+#define vset(c) _mm_set1_epi8((char)(c))
+#define vor(a, b) _mm_or_si128(a, b)
+#define veq(a, b) _mm_cmpeq_epi8(a, b)
+#define vsub(a, b) _mm_sub_epi8(a, b)
+#define vmin(a, b) _mm_min_epu8(a, b)
+#define vmask(a) ((uint32_t)_mm_movemask_epi8(a))
+#endif
+
+#ifdef VWIDTH
+// Bytes in [lo, hi], as an unsigned compare of byte - lo against hi - lo
+static inline vec vrange(vec v, unsigned char lo, unsigned char hi) {
+    vec d = vsub(v, vset(lo));
+    return veq(vmin(d, vset(hi - lo)), d);
+}
+
+static inline uint32_t vecRun(vec v, RunKind kind) {
+    switch (kind) {
+        case RUN_BLANK:
+            return vmask(vor(veq(v, vset(' ')), veq(v, vset('\t'))));
+        case RUN_DIGIT:
+            return vmask(vrange(v, '0', '9'));
+        default:
+            return vmask(vor(vor(vrange(vor(v, vset(0x20)), 'a', 'z'),
+                                 vrange(v, '0', '9')),
+                             veq(v, vset('_'))));
+    }
+}
+#endif
+
+static inline int inRun(unsigned char c, RunKind kind) {
+    switch (kind) {
+        case RUN_BLANK:
+            return charClass[c] == C_BLANK;
+        case RUN_DIGIT:
+            return charClass[c] == C_DIGIT;
+        default:
+            return charClass[c] == C_DIGIT || charClass[c] == C_ALPHA;
+    }
+}
+
+// Length of the run of kind at p, looking at no more than n bytes
+static size_t scanRun(const char *p, size_t n, RunKind kind) {
+    size_t i = 0;
+    uint64_t stop;
+
+#ifdef VWIDTH
+    for (; i + VWIDTH <= n; i += VWIDTH) {
+        uint32_t vstop = ~vecRun(vload(p + i), kind);
+#if VWIDTH < 32
+        vstop &= (1u << VWIDTH) - 1;
+#endif
+        if (vstop)
+            return i + __builtin_ctz(vstop);
+    }
+#endif
+    for (; i + 8 <= n; i += 8) {
+        stop = ~swarRun(load8(p + i), kind) & HIGH;
+        if (stop)
+            return i + (__builtin_ctzll(stop) >> 3);
+    }
+    while (i < n && inRun((unsigned char)p[i], kind))
+        ++i;
+    return i;
+}
+
+// Value of eight ASCII digits
+static inline uint32_t parse8(const char *p) {
+    uint64_t v;
+    memcpy(&v, p, 8);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap64(v);
+#endif
+    v -= ONES * '0';
+    v = v * 10 + (v >> 8);
+    v = (((v & 0x000000FF000000FFULL) * (100 + (1000000ULL << 32))) +
+         (((v >> 16) & 0x000000FF000000FFULL) * (1 + (10000ULL << 32)))) >>
+        32;
+    return (uint32_t)v;
+}
+
+// Scan an integer literal at p and build its value (modulo 2^32) on the way
+static size_t scanNumber(const char *p, size_t n, int *value) {
+    uint32_t val = 0;
+    size_t i = 0, run;
+
+    for (; i + 8 <= n; i += 8) {
+        if (~swarRun(load8(p + i), RUN_DIGIT) & HIGH)
+            break;
+        val = val * 100000000u + parse8(p + i);
+    }
+    run = i + scanRun(p + i, n - i, RUN_DIGIT);
+    for (; i < run; i++)
+        val = val * 10 + (uint32_t)(p[i] - '0');
+    *value = (int)val;
+    return run;
+}
+
+TokenSet getToken(Compiler *c) {
+    Lexer *lex = &c->lex;
+    const char *buf = lex->buf;
+    size_t start, pos = lex->pos, len = lex->len;
+    unsigned char ch;
+    CharClass cls;
+
+    if (pos < len && charClass[(unsigned char)buf[pos]] == C_BLANK)
+        pos += scanRun(buf + pos, len - pos, RUN_BLANK);
+    start = pos;
+    lex->span.offset = start;
+    lex->span.length = 0;
+    if (pos >= len) {
+        lex->pos = pos;
         return ENDFILE;
-    } else {
-        return UNKNOWN;
     }
+
+    ch = (unsigned char)buf[pos++];
+    cls = (CharClass)charClass[ch];
+    switch (cls) {
+        case C_DIGIT:
+            pos += scanNumber(buf + start, len - start, &lex->value) - 1;
+            break;
+        case C_ALPHA:
+            // Identifiers are split every MAXLEN - 1 characters, as before
+            pos += scanRun(buf + pos,
+                           len - pos < MAXLEN - 2 ? len - pos : MAXLEN - 2,
+                           RUN_IDENT);
+            // Intern once here so that codegen never compares names
+            lex->symbol = intern(c, buf + start, (int)(pos - start));
+            break;
+        case C_ADDSUB:
+            if (pos < len && (buf[pos] == '=' || buf[pos] == (char)ch)) {
+                cls = buf[pos++] == '=' ? C_ADDSUB_ASSIGN : C_INCDEC;
+            }
+            break;
+        default:
+            break;
+    }
+    lex->pos = pos;
+    lex->span.length = (int)(pos - start);
+    return classToken[cls];
+}
+
+void advance(Compiler *c) {
+    c->lex.token = getToken(c);
+}
+
+int match(Compiler *c, TokenSet token) {
+    if (c->lex.token == UNKNOWN)
+        advance(c);
+    return token == c->lex.token;
+}
+
+const char *getLexeme(Compiler *c) {
+    return c->lex.buf + c->lex.span.offset;
+}
+
+Span getSpan(Compiler *c) {
+    return c->lex.span;
 }
 
-void advance(void) {
-    curToken = getToken();
+int getValue(Compiler *c) {
+    return c->lex.value;
 }
 
-int match(TokenSet token) {
-    if (curToken == UNKNOWN)
-        advance();
-    return token == curToken;
+int getSymbol(Compiler *c) {
+    return c->lex.symbol;
 }
 
-char* getLexeme(void) {
-    return lexeme;
+const char *spanText(Compiler *c, Span span) {
+    return c->lex.buf + span.offset;
 }
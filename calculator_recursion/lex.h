@@ -1,8 +1,13 @@
 #ifndef __LEX__
 #define __LEX__
 
+#include <stddef.h>
+
 #define MAXLEN 256
 
+// All state of one compilation, see compiler.h
+typedef struct Compiler Compiler;
+
 // Token types
 typedef enum {
     UNKNOWN, END, ENDFILE, 
@@ -14,13 +19,44 @@ typedef enum {
     INCDEC,
 } TokenSet;
 
+// A lexeme as an (offset, length) span of the input buffer
+typedef struct {
+    size_t offset;
+    int length;
+} Span;
+
+// State of the lexer
+typedef struct {
+    const char *buf;
+    size_t len, pos;
+    TokenSet token;
+    Span span;
+    int value, symbol;
+} Lexer;
+
+// Lex from src[0..len)
+extern void setInput(Compiler *c, const char *src, size_t len);
+
 // Test if a token matches the current token 
-extern int match(TokenSet token);
+extern int match(Compiler *c, TokenSet token);
 
 // Get the next token
-extern void advance(void);
+extern void advance(Compiler *c);
 
 // Get the lexeme of the current token
-extern char *getLexeme(void);
+// The text is not null-terminated, use getSpan() for its length
+extern const char *getLexeme(Compiler *c);
+
+// Get the value of the current INT token
+extern int getValue(Compiler *c);
+
+// Get the symbol ID of the current ID token
+extern int getSymbol(Compiler *c);
+
+// Get the span of the current token
+extern Span getSpan(Compiler *c);
+
+// Get the text of a span
+extern const char *spanText(Compiler *c, Span span);
 
 #endif // __LEX__
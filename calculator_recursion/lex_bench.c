@@ -0,0 +1,152 @@
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "compiler.h"
+
+// Throughput of the lexer against the old fgetc()/ungetc() one
+// Usage: ./lex_bench [MB of synthetic input]
+
+static char legacyLexeme[MAXLEN];
+
+// The lexer as it was before the whole-input buffer
+static TokenSet legacyToken(FILE* in) {
+    int i = 0;
+    int c = '\0';
+
+    while ((c = fgetc(in)) == ' ' || c == '\t')
+        ;
+
+    if (isdigit(c)) {
+        legacyLexeme[0] = c;
+        c = fgetc(in);
+        i = 1;
+        while (isdigit(c) && i < MAXLEN - 1) {
+            legacyLexeme[i] = c;
+            ++i;
+            c = fgetc(in);
+        }
+        ungetc(c, in);
+        legacyLexeme[i] = '\0';
+        return INT;
+    } else if (c == '+' || c == '-') {
+        legacyLexeme[0] = c;
+        c = fgetc(in);
+        if (c == '=' || c == legacyLexeme[0]) {
+            legacyLexeme[1] = c;
+            legacyLexeme[2] = '\0';
+            return c == '=' ? ADDSUB_ASSIGN : INCDEC;
+        }
+        ungetc(c, in);
+        legacyLexeme[1] = '\0';
+        return ADDSUB;
+    } else if (c == '*' || c == '/') {
+        legacyLexeme[0] = c;
+        legacyLexeme[1] = '\0';
+        return MULDIV;
+    } else if (c == '&') {
+        legacyLexeme[0] = c;
+        legacyLexeme[1] = '\0';
+        return AND;
+    } else if (c == '|') {
+        legacyLexeme[0] = c;
+        legacyLexeme[1] = '\0';
+        return OR;
+    } else if (c == '^') {
+        legacyLexeme[0] = c;
+        legacyLexeme[1] = '\0';
+        return XOR;
+    } else if (c == '\n') {
+        legacyLexeme[0] = '\0';
+        return END;
+    } else if (c == '=') {
+        strcpy(legacyLexeme, "=");
+        return ASSIGN;
+    } else if (c == '(') {
+        strcpy(legacyLexeme, "(");
+        return LPAREN;
+    } else if (c == ')') {
+        strcpy(legacyLexeme, ")");
+        return RPAREN;
+    } else if (isalpha(c) || c == '_') {
+        legacyLexeme[0] = c;
+        c = fgetc(in);
+        i = 1;
+        while ((isalnum(c) || c == '_') && i < MAXLEN - 1) {
+            legacyLexeme[i] = c;
+            ++i;
+            c = fgetc(in);
+        }
+        ungetc(c, in);
+        legacyLexeme[i] = '\0';
+        return ID;
+    } else if (c == EOF) {
+        return ENDFILE;
+    } else {
+        return UNKNOWN;
+    }
+}
+
+// Statements in the shape of our generated scripts
+static char* synthesize(size_t size, size_t* len) {
+    static const char* names[] = {"x", "y", "z", "alpha", "beta_2",
+                                  "temporary_value", "i", "counter"};
+    static const char* ops[] = {" + ", " - ", " * ", " / ", " & ", " | ",
+                                " ^ ", "+", "*"};
+    char* src = (char*)malloc(size + 256);
+    size_t n = 0;
+    unsigned seed = 12345;
+
+    while (n < size) {
+        int terms = 2 + (seed >> 16) % 6;
+        n += sprintf(src + n, "%s = ", names[(seed >> 8) % 8]);
+        while (terms--) {
+            seed = seed * 1103515245 + 12345;
+            if ((seed >> 12) & 1)
+                n += sprintf(src + n, "%u", (seed >> 4) % 100000);
+            else
+                n += sprintf(src + n, "%s", names[(seed >> 8) % 8]);
+            n += sprintf(src + n, "%s", terms ? ops[(seed >> 20) % 9] : "\n");
+        }
+    }
+    src[n] = '\0';
+    *len = n;
+    return src;
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int main(int argc, char** argv) {
+    size_t mb = argc > 1 ? (size_t)atoi(argv[1]) : 64, len, tokens;
+    char* src = synthesize(mb << 20, &len);
+    FILE* in = tmpfile();
+    Compiler* c;
+    double t;
+
+    fwrite(src, 1, len, in);
+
+    rewind(in);
+    t = now();
+    for (tokens = 0; legacyToken(in) != ENDFILE; tokens++)
+        ;
+    t = now() - t;
+    printf("fgetc lexer:  %10zu tokens  %8.1f MB/s\n", tokens,
+           len / t / (1 << 20));
+
+    c = newCompiler();
+    initTable(c);
+    t = now();
+    setInput(c, src, len);
+    for (tokens = 0; advance(c), !match(c, ENDFILE); tokens++)
+        ;
+    t = now() - t;
+    printf("table lexer:  %10zu tokens  %8.1f MB/s\n", tokens,
+           len / t / (1 << 20));
+    freeCompiler(c);
+    return 0;
+}
@@ -2,9 +2,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
-#include "lex.h"
-#include "parser.h"
-#include "codeGen.h"
+#include "compiler.h"
 
 // This package is a calculator
 // It works like a Python interpretor
@@ -29,10 +27,91 @@
 //		   	      LPAREN expr RPAREN |
 //		   	      ADDSUB LPAREN expr RPAREN
 
-int main() {
-    initTable();
-    while (1) {
-        statement();
+#define CHUNK (1 << 20)  // 1 MB
+
+// Read all of stdin into a malloc'ed buffer
+static char* readInput(size_t* len) {
+    size_t cap = CHUNK, n;
+    char* in = (char*)malloc(cap);
+
+    *len = 0;
+    while (in && (n = fread(in + *len, 1, cap - *len, stdin)) > 0) {
+        *len += n;
+        if (*len == cap) {
+            char* more = (char*)realloc(in, cap << 1);
+            if (!more) {
+                free(in);
+                return NULL;
+            }
+            in = more;
+            cap <<= 1;
+        }
+    }
+    return in;
+}
+
+// Usage: main [-u] [-O1 | -O2] [-s] [x y z] < input
+//   -u     keep x, y and z in memory, unpinned
+//   -O1    the default
+//   -O2    also re-synthesize the program from the normal forms of x, y
+//          and z, and keep the cheaper code
+//   -s     print how often each peephole rule fired to stderr
+//   x y z  the initial values of x, y and z, all three or none, to
+//          evaluate the program at compile time
+int main(int argc, char** argv) {
+    Buffer out = {NULL, 0, 0};
+    Compiler* c = newCompiler();
+    size_t len;
+    char* src;
+    int nmem = 0, stats = 0;
+
+    if (!c) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+    // Not getopt(), a negative initial value looks like an option
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-u") == 0) {
+            c->opt.pin = 0;
+        } else if (strcmp(argv[i], "-O1") == 0 ||
+                   strcmp(argv[i], "-O2") == 0) {
+            c->opt.level = argv[i][2] - '0';
+        } else if (strcmp(argv[i], "-s") == 0) {
+            stats = 1;
+        } else if (argv[i][0] == '-' &&
+                   !isdigit((unsigned char)argv[i][1])) {
+            // An option this does not know, not a number
+            nmem = -1;
+            break;
+        } else if (nmem < 3) {
+            c->opt.mem[nmem++] = atoi(argv[i]);
+        } else {
+            nmem = -1;
+            break;
+        }
+    }
+    if (nmem != 0 && nmem != 3) {
+        fprintf(stderr,
+                "usage: %s [-u] [-O1 | -O2] [-s] [x y z] < input\n"
+                "  x y z: the initial values, all three or none\n",
+                argv[0]);
+        freeCompiler(c);
+        return 1;
+    }
+    c->opt.eval = nmem == 3;
+    src = readInput(&len);
+    if (!src) {
+        fprintf(stderr, "out of memory while reading input\n");
+        freeCompiler(c);
+        return 1;
+    }
+    compile(c, src, len, &out);
+    fwrite(out.data, 1, out.len, stdout);
+    for (int rule = 0; stats && rule < P_RULES; rule++) {
+        fprintf(stderr, "%-16s %ld\n", ruleNames[rule], c->fired[rule]);
     }
+    freeCompiler(c);
+    free(src);
+    free(out.data);
     return 0;
 }
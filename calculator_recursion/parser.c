@@ -3,275 +3,964 @@
 #include <stdlib.h>
 #include <string.h>
 #include "codeGen.h"
+#include "compiler.h"
+#include "../assembly_parser/cost.h"
 
-BTNode* makeNode(TokenSet tok, const char* lexe) {
-    BTNode* node = (BTNode*)malloc(sizeof(BTNode));
-    strcpy(node->lexeme, lexe);
-    node->token_type = tok;
-    node->val = 0;
-    node->left = NULL;
-    node->right = NULL;
+// Flags of a new node, from its operator and its operands
+static int nodeFlags(Compiler* c, const BTNode* n) {
+    const BTNode* pool = c->parser.pool;
+    const unsigned char* flags = c->parser.flags;
+    switch (n->op) {
+        case OP_INT:
+            return 0;
+        case OP_ID:
+            return c->symbols.table[n->val].set ? F_VARIABLE
+                                                : F_VARIABLE | F_TRAP;
+        case OP_ASSIGN:
+        case OP_ADD_ASSIGN:
+        case OP_SUB_ASSIGN:
+        case OP_INC:
+        case OP_DEC:
+            return F_WRITE | F_TRAP | F_VARIABLE | flags[n->right];
+        case OP_DIV:
+            // A divisor that is not a nonzero INT may be zero at run time
+            if (pool[n->right].op != OP_INT || pool[n->right].val == 0) {
+                return flags[n->left] | flags[n->right] | F_TRAP;
+            }
+            return flags[n->left] | flags[n->right];
+        default:
+            return flags[n->left] | flags[n->right];
+    }
+}
+
+static unsigned nodeHash(OpType op, int val, int left, int right) {
+    unsigned h = 2166136261u;
+    h = (h ^ op) * 16777619u;
+    h = (h ^ (unsigned)val) * 16777619u;
+    h = (h ^ (unsigned)left) * 16777619u;
+    return (h ^ (unsigned)right) * 16777619u;
+}
+
+// INT nodes are not shared, a constant zero may or may not be DIVZERO
+static int sharable(OpType op) {
+    return op == OP_ID || (op >= OP_ADD && op <= OP_XOR);
+}
+
+// The slot of a node equal to (op, val, left, right), or the empty slot
+// where it goes
+static int* findNode(Parser* p, OpType op, int val, int left, int right) {
+    unsigned mask = p->conscap - 1;
+    for (unsigned i = nodeHash(op, val, left, right) & mask;;
+         i = (i + 1) & mask) {
+        int node = p->cons[i];
+        const BTNode* n = &p->pool[node];
+        if (!node || (node >= p->barrier && node < p->poolsize &&
+                      n->op == op && n->val == val && n->left == left &&
+                      n->right == right)) {
+            return &p->cons[i];
+        }
+    }
+}
+
+static void rehashNodes(Compiler* c) {
+    Parser* p = &c->parser;
+    int cap = p->conscap ? p->conscap << 1 : 256;
+    int* cons = (int*)calloc(cap, sizeof(int));
+    if (!cons) {
+        error(c, RUNOUT);
+    }
+    free(p->cons);
+    p->cons = cons;
+    p->conscap = cap;
+    for (int i = p->barrier; i < p->poolsize; i++) {
+        const BTNode* n = &p->pool[i];
+        if (sharable(n->op) && !(p->flags[i] & F_WRITE)) {
+            *findNode(p, n->op, n->val, n->left, n->right) = i;
+        }
+    }
+}
+
+int makeNode(Compiler* c, OpType op, int val, int left, int right) {
+    Parser* p = &c->parser;
+    BTNode* n;
+    int* slot = NULL;
+
+    if (sharable(op) && !(left && (p->flags[left] & F_WRITE)) &&
+        !(right && (p->flags[right] & F_WRITE))) {
+        if (2 * p->poolsize >= p->conscap) {
+            rehashNodes(c);
+        }
+        slot = findNode(p, op, val, left, right);
+        if (*slot) {
+            return *slot;
+        }
+    }
+    p->pool = (BTNode*)grow(c, p->pool, &p->poolcap, p->poolsize + 1,
+                            sizeof(BTNode));
+    p->flags = (unsigned char*)grow(c, p->flags, &p->flagcap,
+                                    p->poolsize + 1, 1);
+    n = &p->pool[p->poolsize];
+    n->op = op;
+    n->val = val;
+    n->left = left;
+    n->right = right;
+    p->flags[p->poolsize] = nodeFlags(c, n);
+    if (slot) {
+        *slot = p->poolsize;
+    } else if (p->flags[p->poolsize] & F_WRITE) {
+        // What is read after a write may differ from what was read before
+        p->barrier = p->poolsize + 1;
+    }
+    return p->poolsize++;
+}
+
+// Operator of the current ADDSUB, MULDIV, AND, OR or XOR token
+static OpType binaryOp(Compiler* c) {
+    char ch = *getLexeme(c);
+    if (match(c, AND)) {
+        return OP_AND;
+    } else if (match(c, OR)) {
+        return OP_OR;
+    } else if (match(c, XOR)) {
+        return OP_XOR;
+    }
+    switch (ch) {
+        case '+':
+            return OP_ADD;
+        case '-':
+            return OP_SUB;
+        case '*':
+            return OP_MUL;
+        default:
+            return OP_DIV;
+    }
+}
+
+// Test if two side-effect free subtrees compute the same value
+static int sameTree(Compiler* c, int a, int b) {
+    Parser* p = &c->parser;
+    const BTNode* pool;
+    int top = 0;
+
+    for (;;) {
+        pool = p->pool;
+        if (a != b) {
+            if (pool[a].op != pool[b].op || pool[a].val != pool[b].val) {
+                return 0;
+            }
+            if (pool[a].left) {
+                p->pairs = (int*)grow(c, p->pairs, &p->paircap, top + 2,
+                                      sizeof(int));
+                p->pairs[top++] = pool[a].right;
+                p->pairs[top++] = pool[b].right;
+                a = pool[a].left;
+                b = pool[b].left;
+                continue;
+            }
+        }
+        if (top == 0) {
+            return 1;
+        }
+        b = p->pairs[--top];
+        a = p->pairs[--top];
+    }
+}
+
+// Turn a node whose value is known although it reads variables into an
+// INT, which is not a constant zero for DIVZERO
+static int constant(Compiler* c, int node, int val) {
+    BTNode* n = &c->parser.pool[node];
+    n->op = OP_INT;
+    n->val = val;
+    n->left = n->right = NIL;
+    c->parser.flags[node] = F_VARIABLE;
+    return node;
+}
+
+#define IS_INT(node, v) (pool[node].op == OP_INT && pool[node].val == (v))
+
+// Apply the algebraic identities to a binary node whose operands are not
+// both INT and return the node that replaces it
+// An operand is dropped only if it neither writes nor traps, an operand
+// that is kept is still evaluated exactly once
+static int simplify(Compiler* c, int node) {
+    const BTNode* pool = c->parser.pool;
+    const unsigned char* flags = c->parser.flags;
+    BTNode* n = &c->parser.pool[node];
+    int left = n->left, right = n->right;
+    int pureLeft = !(flags[left] & (F_WRITE | F_TRAP));
+    int pureRight = !(flags[right] & (F_WRITE | F_TRAP));
+
+    switch (n->op) {
+        case OP_ADD:
+            if (IS_INT(right, 0)) {
+                return left;
+            }
+            if (IS_INT(left, 0)) {
+                return right;
+            }
+            break;
+        case OP_SUB:
+            if (IS_INT(right, 0)) {
+                return left;
+            }
+            if (pureLeft && pureRight && sameTree(c, left, right)) {
+                return constant(c, node, 0);
+            }
+            break;
+        case OP_MUL:
+            if (IS_INT(right, 1)) {
+                return left;
+            }
+            if (IS_INT(left, 1)) {
+                return right;
+            }
+            if ((IS_INT(left, 0) && pureRight) ||
+                (IS_INT(right, 0) && pureLeft)) {
+                return constant(c, node, 0);
+            }
+            break;
+        case OP_DIV:
+            // 0 / x must still divide, x may be zero
+            if (IS_INT(right, 1)) {
+                return left;
+            }
+            break;
+        case OP_AND:
+            if (IS_INT(right, -1)) {
+                return left;
+            }
+            if (IS_INT(left, -1)) {
+                return right;
+            }
+            if ((IS_INT(left, 0) && pureRight) ||
+                (IS_INT(right, 0) && pureLeft)) {
+                return constant(c, node, 0);
+            }
+            if (!(flags[node] & F_WRITE) && sameTree(c, left, right)) {
+                return left;
+            }
+            break;
+        case OP_OR:
+            if (IS_INT(right, 0)) {
+                return left;
+            }
+            if (IS_INT(left, 0)) {
+                return right;
+            }
+            if ((IS_INT(left, -1) && pureRight) ||
+                (IS_INT(right, -1) && pureLeft)) {
+                return constant(c, node, -1);
+            }
+            if (!(flags[node] & F_WRITE) && sameTree(c, left, right)) {
+                return left;
+            }
+            break;
+        case OP_XOR:
+            if (IS_INT(right, 0)) {
+                return left;
+            }
+            if (IS_INT(left, 0)) {
+                return right;
+            }
+            if (pureLeft && pureRight && sameTree(c, left, right)) {
+                return constant(c, node, 0);
+            }
+            break;
+        default:
+            break;
+    }
     return node;
 }
 
-void optimize(BTNode* node) {
-    if (node->left && node->right && node->left->token_type == INT &&
-        node->right->token_type == INT) {
-        int a = node->left->val, b = node->right->val;
-        switch (node->lexeme[0]) {
-            case '+':
-                node->val = a + b;
+static int optimize(Compiler* c, int node);
+
+// A term of a chain of one operator, split into its variable part e and
+// its constant k: sign * e + k for ADD and SUB, e op k for the others
+// e is NIL if the term is a constant
+typedef struct {
+    int e, sign;
+    unsigned k;
+    int consts;  // INT nodes that the term is made of
+} Term;
+
+static unsigned identity(OpType op) {
+    return op == OP_MUL ? 1 : op == OP_AND ? ~0u : 0;
+}
+
+static unsigned combine(OpType op, unsigned a, unsigned b) {
+    switch (op) {
+        case OP_MUL:
+            return a * b;
+        case OP_AND:
+            return a & b;
+        case OP_OR:
+            return a | b;
+        case OP_XOR:
+            return a ^ b;
+        default:
+            return a + b;
+    }
+}
+
+static Term split(Compiler* c, OpType family, int node) {
+    const BTNode* pool = c->parser.pool;
+    const BTNode* n = &pool[node];
+    Term t = {node, 1, identity(family), 0};
+
+    if (n->op == OP_INT) {
+        t.e = NIL;
+        t.k = n->val;
+        t.consts = 1;
+    } else if (n->op == family || (family == OP_ADD && n->op == OP_SUB)) {
+        if (pool[n->right].op == OP_INT) {
+            t.e = n->left;
+            t.k = n->op == OP_SUB ? -(unsigned)pool[n->right].val
+                                  : (unsigned)pool[n->right].val;
+            t.consts = 1;
+        } else if (pool[n->left].op == OP_INT) {
+            t.e = n->right;
+            t.sign = n->op == OP_SUB ? -1 : 1;
+            t.k = pool[n->left].val;
+            t.consts = 1;
+        }
+    }
+    return t;
+}
+
+static int build(Compiler* c, OpType op, int left, int right) {
+    return optimize(c, makeNode(c, op, 0, left, right));
+}
+
+static int buildInt(Compiler* c, unsigned k) {
+    return makeNode(c, OP_INT, (int)k, NIL, NIL);
+}
+
+// Move the constants of a chain of ADD and SUB, or of one of MUL, AND,
+// OR and XOR, to its root and fold them there:
+// (a + 1) + 2 -> a + 3, (1 - a) + b -> (b - a) + 1,
+// (2 * a) * b -> (a * b) * 2
+// Every node is built this way, so only the operands can have a
+// constant, at their root, and one level is enough. The variable parts
+// are evaluated in the same order, unless neither of them writes
+static int reassociate(Compiler* c, int node) {
+    const BTNode* pool = c->parser.pool;
+    OpType op = pool[node].op, family = op == OP_SUB ? OP_ADD : op;
+    int left = pool[node].left, right = pool[node].right;
+    int writes, e, sign;
+    Term l, r;
+    unsigned k;
+
+    if (op < OP_ADD || op > OP_XOR || op == OP_DIV) {
+        return node;
+    }
+    l = split(c, family, left);
+    r = split(c, family, right);
+    if (!(l.consts && l.e) && !(r.consts && r.e) && l.consts + r.consts < 2) {
+        return node;
+    }
+    writes = l.e && r.e &&
+             ((c->parser.flags[l.e] | c->parser.flags[r.e]) & F_WRITE);
+
+    if (family != OP_ADD) {
+        k = combine(op, l.k, r.k);
+        e = l.e && r.e ? build(c, op, l.e, r.e) : l.e ? l.e : r.e;
+        if (k == identity(op)) {
+            return e;
+        }
+        return build(c, op, e, buildInt(c, k));
+    }
+
+    if (op == OP_SUB) {
+        r.sign = -r.sign;
+        r.k = -r.k;
+    }
+    k = l.k + r.k;
+    if (!r.e) {
+        e = l.e;
+        sign = l.sign;
+    } else if (!l.e) {
+        e = r.e;
+        sign = r.sign;
+    } else if (l.sign > 0) {
+        e = build(c, r.sign > 0 ? OP_ADD : OP_SUB, l.e, r.e);
+        sign = 1;
+    } else if (r.sign < 0) {
+        e = build(c, OP_ADD, l.e, r.e);
+        sign = -1;
+    } else if (!writes) {
+        e = build(c, OP_SUB, r.e, l.e);
+        sign = 1;
+    } else if (r.consts) {
+        // k - l + r, so that l is still evaluated first
+        return build(c, OP_ADD, build(c, OP_SUB, buildInt(c, k), l.e), r.e);
+    } else {
+        return node;
+    }
+    if (sign < 0) {
+        return build(c, OP_SUB, buildInt(c, k), e);
+    } else if (k == 0) {
+        return e;
+    } else if ((int)k < 0 && k != 0x80000000u) {
+        return build(c, OP_SUB, e, buildInt(c, -k));
+    }
+    return build(c, OP_ADD, e, buildInt(c, k));
+}
+
+// Whether node is an operation of a chain of family, ADD and SUB for
+// OP_ADD
+static int inChain(const BTNode* pool, OpType family, int node) {
+    return pool[node].op == family ||
+           (family == OP_ADD && pool[node].op == OP_SUB);
+}
+
+// Make a chain left-deep: a + (b - c) -> (a + b) - c,
+// a - (b - c) -> (a - b) + c, a * (b * c) -> (a * b) * c
+// The operands are still evaluated in the same order, even if one of
+// them writes, and the chain needs no more registers than its operands.
+// Only one level is rotated, if b is not a chain itself: the operands
+// were built this way, so a long chain in parentheses is not rebuilt
+// once per term
+static int rotate(Compiler* c, int node) {
+    const BTNode* pool = c->parser.pool;
+    OpType op = pool[node].op, family = op == OP_SUB ? OP_ADD : op;
+    int a = pool[node].left, right = pool[node].right, b, d;
+    OpType inner, outer;
+
+    // k - (b + c) is how reassociate() puts the constant of a chain at
+    // its root, so it stays
+    if (op < OP_ADD || op > OP_XOR || op == OP_DIV || pool[a].op == OP_INT ||
+        !inChain(pool, family, right)) {
+        return node;
+    }
+    inner = pool[right].op;
+    b = pool[right].left;
+    d = pool[right].right;
+    if (inChain(pool, family, b)) {
+        return node;
+    }
+    // The sign of c flips if exactly one of the two is a SUB
+    outer = family != OP_ADD ? op : op == inner ? OP_ADD : OP_SUB;
+    return build(c, outer, build(c, op, a, b), d);
+}
+
+// The operand of a negation 0 - e, which unary minus makes, NIL if
+// node is not one
+static int negated(const BTNode* pool, int node) {
+    return pool[node].op == OP_SUB && IS_INT(pool[node].left, 0)
+               ? pool[node].right
+               : NIL;
+}
+
+// The INT operand of a MUL, NIL if it has none
+static int factor(const BTNode* pool, int node) {
+    if (pool[node].op != OP_MUL) {
+        return NIL;
+    }
+    return pool[pool[node].right].op == OP_INT  ? pool[node].right
+           : pool[pool[node].left].op == OP_INT ? pool[node].left
+                                                : NIL;
+}
+
+// -e for a MUL e that is cheaper to negate than to compute: one with a
+// negated factor, or by a constant whose negation is cheaper, else NIL
+static int opposite(Compiler* c, int node) {
+    const BTNode* pool = c->parser.pool;
+    int left = pool[node].left, right = pool[node].right;
+    int k = factor(pool, node);
+    unsigned minus;
+
+    if (pool[node].op != OP_MUL) {
+        return NIL;
+    }
+    if (negated(pool, left)) {
+        return build(c, OP_MUL, negated(pool, left), right);
+    }
+    if (negated(pool, right)) {
+        return build(c, OP_MUL, left, negated(pool, right));
+    }
+    if (!k) {
+        return NIL;
+    }
+    minus = -(unsigned)pool[k].val;
+    if (mulCost(c, (int)minus) < mulCost(c, pool[k].val)) {
+        return build(c, OP_MUL, k == right ? left : right,
+                     buildInt(c, minus));
+    }
+    return NIL;
+}
+
+// a * -k for -(a * k), if that is cheaper than the negation, else NIL
+static int sink(Compiler* c, int a, int k) {
+    int val = c->parser.pool[k].val;
+    unsigned minus = -(unsigned)val;
+    if (mulCost(c, (int)minus) <=
+        COST_MOV_CONST + COST_SUB + mulCost(c, val)) {
+        return build(c, OP_MUL, a, buildInt(c, minus));
+    }
+    return NIL;
+}
+
+// Cancel the negations that unary minus makes, a MOV and a SUB each:
+// a + (-b) * c -> a - b * c, a - (-b) * c -> a + b * c, and so for
+// (-b) * c + a unless a or b writes, as reassociate() does for -b alone
+// (-a) * (-b) -> a * b
+// -(a - b) -> b - a unless a or b writes
+// (-a) * k and -(a * k) -> a * -k if that is cheaper
+// DIV is left alone, -a / b is not -(a / b) for a = INT_MIN
+static int negate(Compiler* c, int node) {
+    const BTNode* pool = c->parser.pool;
+    const unsigned char* flags = c->parser.flags;
+    OpType op = pool[node].op;
+    int left = pool[node].left, right = pool[node].right, k, x;
+
+    if (op == OP_ADD || op == OP_SUB) {
+        if ((x = opposite(c, right))) {
+            return build(c, op == OP_ADD ? OP_SUB : OP_ADD, left, x);
+        }
+        if (op == OP_ADD && !((flags[left] | flags[right]) & F_WRITE) &&
+            (x = opposite(c, left))) {
+            return build(c, OP_SUB, right, x);
+        }
+    }
+    if (op == OP_SUB && IS_INT(left, 0)) {
+        if (pool[right].op == OP_SUB &&
+            !((flags[pool[right].left] | flags[pool[right].right]) &
+              F_WRITE)) {
+            return build(c, OP_SUB, pool[right].right, pool[right].left);
+        }
+        k = factor(pool, right);
+        if (k && (x = sink(c,
+                           k == pool[right].right ? pool[right].left
+                                                  : pool[right].right,
+                           k))) {
+            return x;
+        }
+    } else if (op == OP_MUL) {
+        if (negated(pool, left) && negated(pool, right)) {
+            return build(c, OP_MUL, negated(pool, left),
+                         negated(pool, right));
+        }
+        k = factor(pool, node);
+        x = k == right ? negated(pool, left) : negated(pool, right);
+        if (k && x && (x = sink(c, x, k))) {
+            return x;
+        }
+    }
+    return node;
+}
+
+static int optimize(Compiler* c, int node) {
+    BTNode* pool = c->parser.pool;
+    BTNode* n = &pool[node];
+    int reassociated, propagated, simplified, superoptimized;
+    if (n->left && n->right && pool[n->left].op == OP_INT &&
+        pool[n->right].op == OP_INT) {
+        int a = pool[n->left].val, b = pool[n->right].val;
+        // Wrapping around as the machine does, without signed overflow
+        switch (n->op) {
+            case OP_ADD:
+                n->val = (int)((unsigned)a + (unsigned)b);
                 break;
-            case '-':
-                node->val = a - b;
+            case OP_SUB:
+                n->val = (int)((unsigned)a - (unsigned)b);
                 break;
-            case '*':
-                node->val = a * b;
+            case OP_MUL:
+                n->val = (int)((unsigned)a * (unsigned)b);
                 break;
-            case '/':
-                if (node->right->val == 0) {
-                    error(DIVZERO);
+            case OP_DIV:
+                if (b == 0) {
+                    // Divides by zero at run time if the divisor only
+                    // became known by simplification, unless the whole
+                    // program is evaluated now
+                    if ((c->parser.flags[node] & F_VARIABLE) &&
+                        !c->opt.eval) {
+                        return node;
+                    }
+                    error(c, DIVZERO);
                 }
-                node->val = a / b;
+                // INT_MIN / -1 wraps around to INT_MIN, as on the machine
+                n->val = b == -1 ? (int)(0u - (unsigned)a) : a / b;
                 break;
-
-            case '&':
-                node->val = a & b;
+            case OP_AND:
+                n->val = a & b;
                 break;
-            case '|':
-                node->val = a | b;
+            case OP_OR:
+                n->val = a | b;
                 break;
-            case '^':
-                node->val = a ^ b;
+            case OP_XOR:
+                n->val = a ^ b;
                 break;
             default:
-                break;
+                return node;
         }
-        freeTree(node->left);
-        freeTree(node->right);
-        node->left = node->right = 0;
-        node->token_type = INT;
-    }
-}
-
-void freeTree(BTNode* root) {
-    if (root != NULL) {
-        freeTree(root->left);
-        freeTree(root->right);
-        free(root);
-    }
-}
-
-// factor := INT | ID |
-//           INCDEC ID |
-//		   	 LPAREN assign_expr RPAREN
-BTNode* factor(void) {
-    BTNode* retp = NULL;
-
-    if (match(INT)) {
-        retp = makeNode(INT, getLexeme());
-        retp->val = atoi(getLexeme());
-        advance();
-    } else if (match(ID)) {
-        retp = makeNode(ID, getLexeme());
-        advance();
-    } else if (match(INCDEC)) {
-        retp = makeNode(INCDEC, getLexeme());
-        advance();
-        if (match(ID)) {
-            retp->left = makeNode(ID, getLexeme());
-            advance();
-        } else {
-            error(NOTID);
-        }
-    } else if (match(LPAREN)) {
-        advance();
-        retp = assign_expr();
-        if (match(RPAREN))
-            advance();
-        else
-            error(MISPAREN);
-    } else {
-        error(SYNTAXERR);
+        n->left = n->right = NIL;
+        n->op = OP_INT;
+        c->parser.flags[node] &= F_VARIABLE;
+        return node;
+    }
+    reassociated = reassociate(c, node);
+    if (reassociated != node) {
+        return reassociated;
     }
-    return retp;
+    propagated = negate(c, node);
+    if (propagated != node) {
+        return propagated;
+    }
+    simplified = simplify(c, node);
+    if (simplified != node) {
+        return simplified;
+    }
+    superoptimized = superoptimize(c, node);
+    if (superoptimized != node) {
+        return superoptimized;
+    }
+    return rotate(c, node);
 }
 
-// unary_expr := ADDSUB unary_expr | factor
-BTNode* unary_expr(void) {
-    BTNode* node = NULL;
-    if (match(ADDSUB)) {
-        node = makeNode(ADDSUB, getLexeme());
-        advance();
-        if (node->lexeme[0] == '+') {
-            return unary_expr();
-        }
-        node->left = makeNode(INT, "0");
-        node->left->val = 0;
-        node->right = unary_expr();
-        optimize(node);
-        return node;
-    } else {
-        return factor();
+void freeTree(Compiler* c) {
+    Parser* p = &c->parser;
+    p->poolsize = p->barrier = 1;
+    if (p->cons) {
+        memset(p->cons, 0, p->conscap * sizeof(int));
     }
 }
 
-// muldiv_expr := unary_expr muldiv_expr_tail
-BTNode* muldiv_expr(void) {
-    BTNode* node = unary_expr();
-    return muldiv_expr_tail(node);
+// Sethi-Ullman numbers: the registers the subtree of each node needs
+// if its heavier operand is evaluated first. Operands are made before
+// the nodes that use them, so one pass in pool order is enough
+static void labelNodes(Compiler* c) {
+    Parser* p = &c->parser;
+    const BTNode* pool = p->pool;
+    int* label = p->label;
+
+    label[NIL] = 0;
+    for (int i = 1; i < p->poolsize; i++) {
+        int l = label[pool[i].left], r = label[pool[i].right];
+        label[i] = l == r ? l + 1 : l > r ? l : r;
+    }
 }
 
-// muldiv_expr_tail := MULDIV unary_expr muldiv_expr_tail | NiL
-BTNode* muldiv_expr_tail(BTNode* left) {
-    BTNode* node = NULL;
+int linearize(Compiler* c, int root) {
+    Parser* p = &c->parser;
+    const BTNode* pool = p->pool;
+    BTNode* ir;
+    int *placed, *work;
+    int top = 0, irsize = 0;
 
-    if (match(MULDIV)) {
-        node = makeNode(MULDIV, getLexeme());
-        advance();
-        node->left = left;
-        node->right = unary_expr();
-        optimize(node);
-        return muldiv_expr_tail(node);
-    } else {
-        return left;
+    p->ir = (BTNode*)grow(c, p->ir, &p->ircap, p->poolsize + 1,
+                          sizeof(BTNode));
+    p->placed = (int*)grow(c, p->placed, &p->placedcap, p->poolsize + 1,
+                           sizeof(int));
+    p->label = (int*)grow(c, p->label, &p->labelcap, p->poolsize + 1,
+                          sizeof(int));
+    p->work = (int*)grow(c, p->work, &p->workcap, 3 * (p->poolsize + 1),
+                         sizeof(int));
+    ir = p->ir;
+    placed = p->placed;
+    work = p->work;
+    memset(placed, 0, p->poolsize * sizeof(int));
+    labelNodes(c);
+    // A node is pushed once to visit its operands, then once negated to
+    // be placed after them. A shared node is pushed by each of its users
+    // but only visited by the first
+    // The operand that needs more registers goes first, so that fewer
+    // values wait in registers, unless one of them writes a variable
+    // that the other may read
+    work[top++] = root;
+    while (top > 0) {
+        int node = work[--top];
+        if (placed[node > 0 ? node : -node]) {
+            continue;
+        } else if (node > 0) {
+            int left = pool[node].left, right = pool[node].right;
+            work[top++] = -node;
+            if (left && right && p->label[right] > p->label[left] &&
+                !((p->flags[left] | p->flags[right]) & F_WRITE)) {
+                work[top++] = left;
+                work[top++] = right;
+            } else {
+                if (right) {
+                    work[top++] = right;
+                }
+                if (left) {
+                    work[top++] = left;
+                }
+            }
+        } else {
+            BTNode* inst = &ir[++irsize];
+            *inst = pool[-node];
+            inst->left = placed[inst->left];
+            inst->right = placed[inst->right];
+            placed[-node] = irsize;
+        }
     }
+    return p->irsize = irsize;
 }
 
-// addsub_expr := muldiv_expr addsub_expr_tail
-BTNode* addsub_expr(void) {
-    BTNode* node = muldiv_expr();
-    return addsub_expr_tail(node);
-}
+// Binding power of the binary operators, NEG is unary minus
+#define PREC_NEG 6
+static const int precedence[] = {
+    [OP_OR] = 1,  [OP_XOR] = 2, [OP_AND] = 3,
+    [OP_ADD] = 4, [OP_SUB] = 4, [OP_MUL] = 5, [OP_DIV] = 5,
+};
 
-// addsub_expr_tail := ADDSUB muldiv_expr addsub_expr_tail | NiL
-BTNode* addsub_expr_tail(BTNode* left) {
-    BTNode* node = NULL;
+#define PREC_PAREN -1
+#define PREC_ASSIGN 0
 
-    if (match(ADDSUB)) {
-        node = makeNode(ADDSUB, getLexeme());
-        advance();
-        node->left = left;
-        node->right = muldiv_expr();
-        optimize(node);
-        return addsub_expr_tail(node);
-    } else {
-        return left;
-    }
+static void pushOperand(Compiler* c, int node) {
+    Parser* p = &c->parser;
+    p->operands = (int*)grow(c, p->operands, &p->operandcap,
+                             p->noperand + 1, sizeof(int));
+    p->operands[p->noperand++] = node;
 }
 
-// and_expr := addsub_expr and_expr_tail
-BTNode* and_expr(void) {
-    BTNode* node = addsub_expr();
-    return and_expr_tail(node);
+static void pushOperator(Compiler* c, OpType op, int prec, int sym) {
+    Parser* p = &c->parser;
+    p->operators = (Pending*)grow(c, p->operators, &p->operatorcap,
+                                  p->noperator + 1, sizeof(Pending));
+    p->operators[p->noperator].op = op;
+    p->operators[p->noperator].prec = prec;
+    p->operators[p->noperator++].sym = sym;
 }
 
-// and_expr_tail := AND addsub_expr and_expr_tail | NiL
-BTNode* and_expr_tail(BTNode* left) {
-    BTNode* node = NULL;
-
-    if (match(AND)) {
-        node = makeNode(AND, getLexeme());
-        advance();
-        node->left = left;
-        node->right = addsub_expr();
-        optimize(node);
-        return and_expr_tail(node);
-    } else {
-        return left;
-    }
+// An INT for a value known from a variable, which is not a constant
+// zero for DIVZERO
+int knownInt(Compiler* c, int val) {
+    int node = makeNode(c, OP_INT, val, NIL, NIL);
+    c->parser.flags[node] = F_VARIABLE;
+    return node;
 }
 
-// xor_expr := and_expr xor_expr_tail
-BTNode* xor_expr(void) {
-    BTNode* node = and_expr();
-    return xor_expr_tail(node);
+// A read of variable sym, as its value if that is known at this point
+static int readVar(Compiler* c, int sym) {
+    const Symbol* s = &c->symbols.table[sym];
+    return s->known ? knownInt(c, s->value)
+                    : makeNode(c, OP_ID, sym, NIL, NIL);
 }
 
-// xor_expr_tail := XOR and_expr xor_expr_tail | NiL
-BTNode* xor_expr_tail(BTNode* left) {
-    BTNode* node = NULL;
+// Make the node of an assignment, update or INC/DEC of variable sym, as
+// an assignment of the new value if that is known, and record whether
+// sym has a known value after it
+// Nodes are made in the order the program runs, so the value a
+// variable is known to have is the one it has when it is read
+static int writeVar(Compiler* c, OpType op, int sym, int right) {
+    Symbol* s = &c->symbols.table[sym];
+    int node;
+    if (s->known && (op == OP_INC || op == OP_DEC ||
+                     (op != OP_ASSIGN && c->parser.pool[right].op == OP_INT))) {
+        unsigned k = op == OP_INC || op == OP_DEC ? 1
+                                                  : c->parser.pool[right].val;
+        unsigned v = op == OP_INC || op == OP_ADD_ASSIGN ? s->value + k
+                                                         : s->value - k;
+        right = knownInt(c, (int)v);
+        op = OP_ASSIGN;
+    }
+    if (c->opt.eval && op == OP_ASSIGN && c->parser.pool[right].op == OP_INT) {
+        // Only the final values of x, y and z are generated
+        s->known = 1;
+        s->value = c->parser.pool[right].val;
+        return right;
+    }
+    node = makeNode(c, op, sym, NIL, right);
+    s->known = op == OP_ASSIGN && c->parser.pool[right].op == OP_INT;
+    s->value = s->known ? c->parser.pool[right].val : 0;
+    return node;
+}
 
-    if (match(XOR)) {
-        node = makeNode(XOR, getLexeme());
-        advance();
-        node->left = left;
-        node->right = and_expr();
-        optimize(node);
-        return xor_expr_tail(node);
+// Pop the top operator and combine its operands into a node
+static void reduce(Compiler* c) {
+    Parser* p = &c->parser;
+    Pending top = p->operators[--p->noperator];
+    int right = p->operands[--p->noperand];
+    if (top.prec == PREC_ASSIGN) {
+        pushOperand(c, writeVar(c, top.op, top.sym, right));
     } else {
-        return left;
+        int left = p->operands[--p->noperand];
+        pushOperand(c, optimize(c, makeNode(c, top.op, 0, left, right)));
     }
 }
 
-// or_expr := xor_expr or_expr_tail
-BTNode* or_expr(void) {
-    BTNode* node = xor_expr();
-    return or_expr_tail(node);
+// Reduce every operator above the innermost LPAREN or assignment
+static void reduceFrame(Compiler* c) {
+    Parser* p = &c->parser;
+    while (p->noperator > 0 &&
+           p->operators[p->noperator - 1].prec > PREC_ASSIGN) {
+        reduce(c);
+    }
 }
 
-// or_expr_tail := OR xor_expr or_expr_tail | NiL
-BTNode* or_expr_tail(BTNode* left) {
-    BTNode* node = NULL;
+// The operand on top as a read of its variable, once it is known not to
+// be assigned: a variable is kept as an ID until then, also inside
+// parentheses, as in "(a) = 3"
+static void readTop(Compiler* c) {
+    Parser* p = &c->parser;
+    int* top = &p->operands[p->noperand - 1];
+    if (p->pool[*top].op == OP_ID) {
+        *top = readVar(c, p->pool[*top].val);
+    }
+}
 
-    if (match(OR)) {
-        node = makeNode(OR, getLexeme());
-        advance();
-        node->left = left;
-        node->right = xor_expr();
-        optimize(node);
-        return or_expr_tail(node);
-    } else {
-        return left;
+// Reduce everything above the innermost LPAREN, which is left in place
+static void reduceParen(Compiler* c) {
+    Parser* p = &c->parser;
+    while (p->noperator > 0 &&
+           p->operators[p->noperator - 1].prec != PREC_PAREN) {
+        reduce(c);
     }
 }
 
 // assign_expr := ID ASSIGN assign_expr | ID ADDSUB_ASSIGN assign_expr | or_expr
-BTNode* assign_expr(void) {
-    BTNode *retp = NULL, *left = or_expr();
-    if (left->token_type == ID) {
-        if (match(ASSIGN)) {
-            retp = makeNode(ASSIGN, getLexeme());
-            retp->left = left;
-            advance();
-            retp->right = assign_expr();
-            return retp;
-        } else if (match(ADDSUB_ASSIGN)) {
-            retp = makeNode(ADDSUB_ASSIGN, getLexeme());
-            retp->left = left;
-            advance();
-            retp->right = assign_expr();
-            return retp;
+// or_expr     := xor_expr { OR xor_expr }
+// xor_expr    := and_expr { XOR and_expr }
+// and_expr    := addsub_expr { AND addsub_expr }
+// addsub_expr := muldiv_expr { ADDSUB muldiv_expr }
+// muldiv_expr := unary_expr { MULDIV unary_expr }
+// unary_expr  := ADDSUB unary_expr | factor
+// factor      := INT | ID | INCDEC ID | LPAREN assign_expr RPAREN
+//
+// Parsed by operator precedence with explicit stacks, so neither long nor
+// deeply nested lines use native stack. The trees are the ones the
+// recursive descent parser built: left-associative binary operators,
+// right-associative assignments, and unary minus as 0 - operand.
+int assign_expr(Compiler* c) {
+    Parser* p = &c->parser;
+    int depth = 0;
+
+    p->noperand = p->noperator = 0;
+    while (1) {
+        // An operand, after any prefix operators
+        if (match(c, ADDSUB)) {
+            if (*getLexeme(c) == '-') {
+                pushOperand(c, makeNode(c, OP_INT, 0, NIL, NIL));
+                pushOperator(c, OP_SUB, PREC_NEG, 0);
+            }
+            advance(c);
+            continue;
+        } else if (match(c, LPAREN)) {
+            pushOperator(c, OP_INT, PREC_PAREN, 0);
+            depth++;
+            advance(c);
+            continue;
+        } else if (match(c, INT)) {
+            pushOperand(c, makeNode(c, OP_INT, getValue(c), NIL, NIL));
+        } else if (match(c, ID)) {
+            pushOperand(c, makeNode(c, OP_ID, getSymbol(c), NIL, NIL));
+        } else if (match(c, INCDEC)) {
+            OpType op = *getLexeme(c) == '+' ? OP_INC : OP_DEC;
+            advance(c);
+            if (!match(c, ID)) {
+                error(c, NOTID);
+            }
+            pushOperand(c, writeVar(c, op, getSymbol(c), NIL));
+        } else {
+            error(c, SYNTAXERR);
+        }
+        advance(c);
+
+        // Then operators that follow it
+        while (1) {
+            if (match(c, RPAREN) && depth > 0) {
+                if (p->operators[p->noperator - 1].prec != PREC_PAREN) {
+                    readTop(c);
+                }
+                reduceParen(c);
+                p->noperator--;
+                depth--;
+                advance(c);
+            } else if (match(c, ASSIGN) || match(c, ADDSUB_ASSIGN)) {
+                OpType op = match(c, ASSIGN) ? OP_ASSIGN
+                            : *getLexeme(c) == '+' ? OP_ADD_ASSIGN
+                                                   : OP_SUB_ASSIGN;
+                int target;
+                reduceFrame(c);
+                target = p->operands[p->noperand - 1];
+                if (p->pool[target].op != OP_ID) {
+                    error(c, depth ? MISPAREN : SYNTAXERR);
+                }
+                p->noperand--;
+                pushOperator(c, op, PREC_ASSIGN, p->pool[target].val);
+                advance(c);
+                break;
+            } else if (match(c, ADDSUB) || match(c, MULDIV) ||
+                       match(c, AND) || match(c, OR) || match(c, XOR)) {
+                OpType op = binaryOp(c);
+                int prec = precedence[op];
+                readTop(c);
+                while (p->noperator > 0 &&
+                       p->operators[p->noperator - 1].prec >= prec) {
+                    reduce(c);
+                }
+                pushOperator(c, op, prec, 0);
+                advance(c);
+                break;
+            } else {
+                if (depth > 0) {
+                    error(c, MISPAREN);
+                }
+                readTop(c);
+                while (p->noperator > 0) {
+                    reduce(c);
+                }
+                return p->operands[--p->noperand];
+            }
         }
     }
-    return left;
+}
+
+// Append ir[1..n] to the program
+static void keepStatement(Compiler* c, int n) {
+    Parser* p = &c->parser;
+    p->prog = (BTNode*)grow(c, p->prog, &p->progcap, p->progsize + n + 1,
+                            sizeof(BTNode));
+    p->stmts = (int*)grow(c, p->stmts, &p->stmtcap, p->nstmt + 2,
+                          sizeof(int));
+    memcpy(p->prog + p->progsize + 1, p->ir + 1, n * sizeof(BTNode));
+    p->stmts[p->nstmt] = p->progsize;
+    p->progsize += n;
+    p->stmts[++p->nstmt] = p->progsize;
 }
 
 // statement := ENDFILE | END | assign_expr END
-void statement(void) {
-    BTNode* retp = NULL;
-
-    if (match(ENDFILE)) {
-        puts("MOV r0 [0]");
-        puts("MOV r1 [4]");
-        puts("MOV r2 [8]");
-        puts("EXIT 0");
-        exit(0);
-    } else if (match(END)) {
-        advance();
+int statement(Compiler* c) {
+    int retp = NIL, n;
+
+    if (match(c, ENDFILE)) {
+        generate_program(c);
+        return 0;
+    } else if (match(c, END)) {
+        advance(c);
     } else {
-        retp = assign_expr();
-        if (match(END)) {
-            generate_code(retp, 0);
-            freeTree(retp);
-            advance();
+        retp = assign_expr(c);
+        if (match(c, END)) {
+            n = linearize(c, retp);
+            bind_vars(c, c->parser.ir, n);
+            keepStatement(c, n);
+            freeTree(c);
+            advance(c);
         } else {
-            error(SYNTAXERR);
+            error(c, SYNTAXERR);
         }
     }
+    return 1;
+}
+
+void freeParser(Parser* p) {
+    free(p->pool);
+    free(p->flags);
+    free(p->ir);
+    free(p->placed);
+    free(p->label);
+    free(p->work);
+    free(p->operands);
+    free(p->operators);
+    free(p->pairs);
+    free(p->cons);
+    free(p->prog);
+    free(p->stmts);
 }
 
-void err(ErrorType errorNum) {
+void err(Compiler* c, ErrorType errorNum) {
     if (PRINTERR) {
         fprintf(stderr, "error: ");
         switch (errorNum) {
@@ -304,6 +993,6 @@ void err(ErrorType errorNum) {
                 break;
         }
     }
-    printf("EXIT 1");
-    exit(0);
+    emit(c, "EXIT 1");
+    longjmp(c->fail, errorNum);
 }
@@ -7,13 +7,13 @@
 // Make sure you set PRINTERR to 0 before you submit your code
 #define PRINTERR 0
 
-// Call this macro to print error message and exit the program
+// Call this macro to print error message and abort the compilation
 // This will also print where you called it in your program
-#define error(errorNum)                                                       \
+#define error(c, errorNum)                                                    \
     {                                                                         \
         if (PRINTERR)                                                         \
             fprintf(stderr, "error() called at %s:%d: ", __FILE__, __LINE__); \
-        err(errorNum);                                                        \
+        err(c, errorNum);                                                     \
     }
 
 // Error types
@@ -29,36 +29,106 @@ typedef enum {
     SYNTAXERR
 } ErrorType;
 
-// Structure of a tree node
-typedef struct _Node {
-    TokenSet token_type;
-    int val;
-    char lexeme[MAXLEN];
-    struct _Node* left;
-    struct _Node* right;
+// Operators of a tree node
+typedef enum {
+    OP_INT, OP_ID,
+    OP_ADD, OP_SUB, OP_MUL, OP_DIV,
+    OP_AND, OP_OR, OP_XOR,
+    OP_ASSIGN, OP_ADD_ASSIGN, OP_SUB_ASSIGN,
+    OP_INC, OP_DEC,
+} OpType;
+
+// Structure of a tree node, 16 bytes
+// Children are indices into the node pool, NIL if there is none
+typedef struct {
+    OpType op;
+    int val;  // value of an INT, symbol ID of an ID or of an INC/DEC target
+    int left;
+    int right;
 } BTNode;
 
-// Make a new node according to token type and lexeme
-extern BTNode* makeNode(TokenSet tok, const char* lexe);
-
-// Free the syntax tree
-extern void freeTree(BTNode* root);
-
-extern BTNode* factor(void);
-extern BTNode* muldiv_expr(void);
-extern BTNode* muldiv_expr_tail(BTNode* left);
-extern BTNode* addsub_expr(void);
-extern BTNode* addsub_expr_tail(BTNode* left);
-extern BTNode* xor_expr(void);
-extern BTNode* xor_expr_tail(BTNode* left);
-extern BTNode* or_expr(void);
-extern BTNode* or_expr_tail(BTNode* left);
-extern BTNode* and_expr(void);
-extern BTNode* and_expr_tail(BTNode* left);
-extern BTNode* assign_expr(void);
-extern void statement(void);
-
-// Print error message and exit the program
-extern void err(ErrorType errorNum);
+#define NIL 0
+
+// Flags of a subtree
+#define F_WRITE 1     // assigns a variable
+#define F_TRAP 2      // may divide by zero or read an undefined variable
+#define F_VARIABLE 4  // reads a variable, even if its value is now known
+
+// Entry of the operator stack
+// A LPAREN or an assignment also marks where its operand starts
+typedef struct {
+    OpType op;
+    int prec;  // PREC_PAREN, PREC_ASSIGN or the binding power
+    int sym;   // target of an assignment
+} Pending;
+
+// State of the parser
+typedef struct {
+    // The node pool of the current statement, index 0 is never used
+    BTNode *pool;
+    unsigned char *flags;  // flags of each node
+    int poolsize, poolcap, flagcap;
+
+    // The tree of the current statement flattened in post-order, so that
+    // every instruction comes after its operands: ir[1..irsize]
+    BTNode *ir;
+    int irsize, ircap;
+    int *placed;  // ir index of each pool node
+    int *label;   // registers the subtree of each pool node needs
+    int *work;
+    int placedcap, labelcap, workcap;
+
+    // Operand and operator stacks of assign_expr()
+    int *operands;
+    Pending *operators;
+    int noperand, noperator, operandcap, operatorcap;
+
+    // Pairs of nodes still to compare in sameTree()
+    int *pairs;
+    int paircap;
+
+    // Open addressing table of the nodes that can be shared, so that
+    // equal side-effect free subtrees are built once: node index, 0 if
+    // empty. Nodes made before barrier, the node after the last write,
+    // are not shared
+    int *cons;
+    int conscap, barrier;
+
+    // The statements of the program, flattened one after another and
+    // kept until the end: statement s is prog[stmts[s] + 1 .. stmts[s + 1]]
+    // and its operands are relative to prog + stmts[s]
+    BTNode *prog;
+    int progsize, progcap;
+    int *stmts;
+    int nstmt, stmtcap;
+} Parser;
+
+// Make a new node and return its index in the pool, or the index of an
+// equal node if the statement already has one that can be shared
+// The pool may move, so do not keep pointers into it across this call
+extern int makeNode(Compiler *c, OpType op, int val, int left, int right);
+
+// Make an INT for a value that is known without being written as a
+// constant, so a division by it when it is zero is left to run time
+// instead of being DIVZERO
+extern int knownInt(Compiler *c, int val);
+
+// Free the syntax tree of the statement by resetting the node pool
+extern void freeTree(Compiler *c);
+
+// Flatten the tree under root into ir[], a shared node only once, and
+// return its size
+extern int linearize(Compiler *c, int root);
+
+extern int assign_expr(Compiler *c);
+
+// Compile one statement, return 0 once the input is exhausted
+extern int statement(Compiler *c);
+
+// Release the memory of the parser
+extern void freeParser(Parser *p);
+
+// Print error message and abort the compilation
+extern void err(Compiler *c, ErrorType errorNum);
 
 #endif  // __PARSER__
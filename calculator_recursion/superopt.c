@@ -0,0 +1,380 @@
+#include "superopt.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "compiler.h"
+#include "../assembly_parser/cost.h"
+
+// Inputs a replacement is compared on before it is verified
+#define NTEST 16
+// Random inputs it is verified on, besides the boundary ones
+#define NRANDOM 1024
+
+static const unsigned boundary[] = {0, 1, ~0u, 2, 0x7fffffffu, 0x80000000u};
+#define NBOUNDARY (int)(sizeof boundary / sizeof *boundary)
+
+static const int costs[] = {
+    [OP_ADD] = COST_ADD, [OP_SUB] = COST_SUB, [OP_MUL] = COST_MUL,
+    [OP_AND] = COST_AND, [OP_OR] = COST_OR,   [OP_XOR] = COST_XOR,
+};
+
+// The operators a window is made of, DIV may trap
+static int isOp(OpType op) {
+    return op >= OP_ADD && op <= OP_XOR && op != OP_DIV;
+}
+
+static unsigned apply(int op, unsigned a, unsigned b) {
+    switch (op) {
+        case OP_ADD:
+            return a + b;
+        case OP_SUB:
+            return a - b;
+        case OP_MUL:
+            return a * b;
+        case OP_AND:
+            return a & b;
+        case OP_OR:
+            return a | b;
+        default:
+            return a ^ b;
+    }
+}
+
+// Value of a shape with operands in[]
+static unsigned eval(unsigned shape, const unsigned* in) {
+    unsigned stack[SUPEROPS + 2];
+    int sp = 0;
+    for (; shape; shape >>= 4) {
+        int t = shape & 15;
+        if (t >= LEAF(0)) {
+            stack[sp++] = in[t - LEAF(0)];
+        } else {
+            sp--;
+            stack[sp - 1] = apply(t, stack[sp - 1], stack[sp]);
+        }
+    }
+    return stack[0];
+}
+
+// Cycles of the operators of a shape
+static int shapeCost(unsigned shape) {
+    int total = 0;
+    for (; shape; shape >>= 4) {
+        if ((shape & 15) < LEAF(0)) {
+            total += costs[shape & 15];
+        }
+    }
+    return total;
+}
+
+// Bit of each operand a shape reads
+static unsigned uses(unsigned shape) {
+    unsigned bits = 0;
+    for (; shape; shape >>= 4) {
+        if ((shape & 15) >= LEAF(0)) {
+            bits |= 1u << ((shape & 15) - LEAF(0));
+        }
+    }
+    return bits;
+}
+
+static unsigned random32(unsigned* seed) {
+    *seed = *seed * 1103515245u + 12345u;
+    return *seed ^ *seed << 13 ^ *seed >> 17;
+}
+
+// Whether the replacement of e gives the same low bits of mask as the
+// window, with operands in[]
+static int agrees(const Shape* e, const unsigned* in, unsigned mask) {
+    unsigned want = e->known ? (unsigned)e->value : eval(e->best, in);
+    return ((eval(e->shape, in) ^ want) & mask) == 0;
+}
+
+// Compare the window and the replacement of e, with k operands, on all
+// combinations of boundary values, on random values, and on every
+// input of 8 bits, or of 5 bits for 3 operands. ADD, SUB, MUL, AND, OR
+// and XOR never carry into lower bits, so the low bits of the values
+// are the values on the narrow inputs
+static int verify(const Shape* e, int k) {
+    unsigned in[SUPERLEAVES] = {0}, seed = 7, bits = k <= 2 ? 8 : 5;
+    int i, j, n, m;
+
+    for (n = 1, i = 0; i < k; i++) {
+        n *= NBOUNDARY;
+    }
+    for (i = 0; i < n; i++) {
+        for (j = 0, m = i; j < k; j++, m /= NBOUNDARY) {
+            in[j] = boundary[m % NBOUNDARY];
+        }
+        if (!agrees(e, in, ~0u)) {
+            return 0;
+        }
+    }
+    for (i = 0; i < NRANDOM; i++) {
+        for (j = 0; j < k; j++) {
+            in[j] = random32(&seed);
+        }
+        if (!agrees(e, in, ~0u)) {
+            return 0;
+        }
+    }
+    for (i = 0; i < 1 << bits * k; i++) {
+        for (j = 0; j < k; j++) {
+            in[j] = i >> bits * j & ((1u << bits) - 1);
+        }
+        if (!agrees(e, in, (1u << bits) - 1)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static void addCand(Compiler* c, unsigned shape) {
+    Superopt* s = &c->superopt;
+    s->cands = (unsigned*)grow(c, s->cands, &s->candcap, s->ncand + 1,
+                               sizeof(unsigned));
+    s->cands[s->ncand++] = shape;
+}
+
+static int byCost(const void* a, const void* b) {
+    unsigned x = *(const unsigned*)a, y = *(const unsigned*)b;
+    if (shapeCost(x) != shapeCost(y)) {
+        return shapeCost(x) - shapeCost(y);
+    }
+    return x < y ? -1 : x > y;
+}
+
+// Every expression of up to two operators over three operands: a,
+// a op b, (a op b) op d and d op (a op b)
+static void makeCands(Compiler* c) {
+    static const OpType ops[] = {OP_ADD, OP_SUB, OP_MUL,
+                                 OP_AND, OP_OR,  OP_XOR};
+    int nop = sizeof ops / sizeof *ops;
+
+    for (int a = 0; a < SUPERLEAVES; a++) {
+        addCand(c, LEAF(a));
+    }
+    for (int o = 0; o < nop; o++) {
+        for (int a = 0; a < SUPERLEAVES; a++) {
+            for (int b = 0; b < SUPERLEAVES; b++) {
+                unsigned e = LEAF(a) | LEAF(b) << 4 | ops[o] << 8;
+                addCand(c, e);
+                for (int p = 0; p < nop; p++) {
+                    for (int d = 0; d < SUPERLEAVES; d++) {
+                        addCand(c, e | LEAF(d) << 12 | ops[p] << 16);
+                        addCand(c, LEAF(d) | e << 4 | ops[p] << 16);
+                    }
+                }
+            }
+        }
+    }
+    qsort(c->superopt.cands, c->superopt.ncand, sizeof(unsigned), byCost);
+}
+
+// Find the cheapest replacement of a shape with k operands: a constant,
+// or the first candidate that gives the same values on the tests and
+// then passes verify()
+static Shape search(Compiler* c, unsigned shape, int k) {
+    Superopt* s = &c->superopt;
+    unsigned in[NTEST][SUPERLEAVES], out[NTEST], seed = 1;
+    Shape e = {shape, shape, 0, 0};
+    int i, t, limit = shapeCost(shape);
+
+    for (t = 0; t < NTEST; t++) {
+        for (i = 0; i < SUPERLEAVES; i++) {
+            in[t][i] = t < NBOUNDARY ? boundary[(t + 2 * i) % NBOUNDARY]
+                                     : random32(&seed);
+        }
+        out[t] = eval(shape, in[t]);
+    }
+    for (t = 1; t < NTEST && out[t] == out[0]; t++)
+        ;
+    if (t == NTEST) {
+        e.known = 1;
+        e.value = (int)out[0];
+        if (verify(&e, k)) {
+            return e;
+        }
+        e.known = 0;
+    }
+    if (!s->ncand) {
+        makeCands(c);
+    }
+    for (i = 0; i < s->ncand && shapeCost(s->cands[i]) < limit; i++) {
+        if (uses(s->cands[i]) >> k) {
+            continue;
+        }
+        for (t = 0; t < NTEST && eval(s->cands[i], in[t]) == out[t]; t++)
+            ;
+        if (t == NTEST) {
+            e.best = s->cands[i];
+            if (verify(&e, k)) {
+                return e;
+            }
+            e.best = shape;
+        }
+    }
+    return e;
+}
+
+static Shape* findShape(Superopt* s, unsigned shape) {
+    unsigned mask = s->cap - 1;
+    for (unsigned i = shape * 2654435761u & mask;; i = (i + 1) & mask) {
+        if (!s->shapes[i].shape || s->shapes[i].shape == shape) {
+            return &s->shapes[i];
+        }
+    }
+}
+
+static void rehashShapes(Compiler* c) {
+    Superopt* s = &c->superopt;
+    Shape* old = s->shapes;
+    int oldcap = s->cap;
+    int cap = s->cap ? s->cap << 1 : 256;
+    Shape* shapes = (Shape*)calloc(cap, sizeof(Shape));
+    if (!shapes) {
+        error(c, RUNOUT);
+    }
+    s->shapes = shapes;
+    s->cap = cap;
+    for (int i = 0; i < oldcap; i++) {
+        if (old[i].shape) {
+            *findShape(s, old[i].shape) = old[i];
+        }
+    }
+    free(old);
+}
+
+// The result of the search for a shape, searching it if it is new
+static Shape lookup(Compiler* c, unsigned shape, int k) {
+    Superopt* s = &c->superopt;
+    Shape* slot;
+
+    if (2 * (s->count + 1) > s->cap) {
+        rehashShapes(c);
+    }
+    slot = findShape(s, shape);
+    if (!slot->shape) {
+        *slot = search(c, shape, k);
+        s->count++;
+    }
+    return *slot;
+}
+
+// Operators of a window and its operands
+typedef struct {
+    int ops[SUPEROPS];
+    int nop;
+    int leaves[SUPERLEAVES];
+    int nleaf;
+} Window;
+
+static int inWindow(const Window* w, int node) {
+    for (int i = 0; i < w->nop; i++) {
+        if (w->ops[i] == node) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Take the operators of the window at node, breadth first
+static void cut(Compiler* c, int node, int maxops, Window* w) {
+    const BTNode* pool = c->parser.pool;
+    w->ops[0] = node;
+    w->nop = 1;
+    w->nleaf = 0;
+    for (int i = 0; i < w->nop; i++) {
+        int kids[2] = {pool[w->ops[i]].left, pool[w->ops[i]].right};
+        for (int j = 0; j < 2; j++) {
+            if (w->nop < maxops && isOp(pool[kids[j]].op) &&
+                !inWindow(w, kids[j])) {
+                w->ops[w->nop++] = kids[j];
+            }
+        }
+    }
+}
+
+// Append the post-order of the window under node to shape, numbering
+// its operands. Fail on an operand that writes, traps or is an INT,
+// which the other passes already fold, on too many of them, or on more
+// tokens than SUPEROPS operators have, if an operator is shared
+static int serialize(Compiler* c, Window* w, int node, unsigned* shape,
+                     int* pos) {
+    const BTNode* n = &c->parser.pool[node];
+    int i;
+
+    if (inWindow(w, node)) {
+        if (!serialize(c, w, n->left, shape, pos) ||
+            !serialize(c, w, n->right, shape, pos) ||
+            *pos == 2 * SUPEROPS + 1) {
+            return 0;
+        }
+        *shape |= (unsigned)n->op << 4 * (*pos)++;
+        return 1;
+    }
+    if (n->op == OP_INT || (c->parser.flags[node] & (F_WRITE | F_TRAP))) {
+        return 0;
+    }
+    if (*pos == 2 * SUPEROPS + 1) {
+        return 0;
+    }
+    for (i = 0; i < w->nleaf && w->leaves[i] != node; i++)
+        ;
+    if (i == w->nleaf) {
+        if (i == SUPERLEAVES) {
+            return 0;
+        }
+        w->leaves[w->nleaf++] = node;
+    }
+    *shape |= (unsigned)LEAF(i) << 4 * (*pos)++;
+    return 1;
+}
+
+// Build a shape over the operands of a window
+static int rebuild(Compiler* c, unsigned shape, const int* leaves) {
+    int stack[SUPEROPS + 2], sp = 0;
+    for (; shape; shape >>= 4) {
+        int t = shape & 15;
+        if (t >= LEAF(0)) {
+            stack[sp++] = leaves[t - LEAF(0)];
+        } else {
+            sp--;
+            stack[sp - 1] = makeNode(c, (OpType)t, 0, stack[sp - 1],
+                                     stack[sp]);
+        }
+    }
+    return stack[0];
+}
+
+int superoptimize(Compiler* c, int node) {
+    Window w;
+    Shape e;
+
+    if (!isOp(c->parser.pool[node].op)) {
+        return node;
+    }
+    // The largest window first, then one operator less, as long as
+    // there are more operators than one
+    for (int maxops = SUPEROPS; maxops > 1; maxops--) {
+        unsigned shape = 0;
+        int pos = 0;
+        cut(c, node, maxops, &w);
+        if (w.nop < maxops || !serialize(c, &w, node, &shape, &pos)) {
+            continue;
+        }
+        e = lookup(c, shape, w.nleaf);
+        if (e.known) {
+            return knownInt(c, e.value);
+        }
+        if (e.best != shape) {
+            return rebuild(c, e.best, w.leaves);
+        }
+    }
+    return node;
+}
+
+void freeSuperopt(Superopt* s) {
+    free(s->shapes);
+    free(s->cands);
+}
@@ -0,0 +1,42 @@
+#ifndef __SUPEROPT__
+#define __SUPEROPT__
+
+#include "parser.h"
+
+// A window is a subtree of at most SUPEROPS operators of ADD, SUB, MUL,
+// AND, OR and XOR, cut off at at most SUPERLEAVES operands that neither
+// write nor trap. Its shape is its post-order, 4 bits per token: the
+// OpType of an operator, or LEAF(i) for the i-th distinct operand
+#define SUPEROPS 3
+#define SUPERLEAVES 3
+#define LEAF(i) (12 + (i))
+
+// Result of the search for one shape
+typedef struct {
+    unsigned shape;  // 0 if the slot is empty
+    unsigned best;   // cheapest equal shape, shape itself if there is none
+    int known;       // 1 if the window is always value
+    int value;
+} Shape;
+
+typedef struct {
+    // Open addressing table of the shapes searched so far. It is kept
+    // between compilations, so a shape is only searched once per compiler
+    Shape *shapes;
+    int count, cap;
+
+    // The expressions of up to two operators over the operands, the
+    // replacements that are tried, cheapest first
+    unsigned *cands;
+    int ncand, candcap;
+} Superopt;
+
+// Replace the window at node by the cheapest expression of at most two
+// operators that is equal to it, and return the node that replaces it.
+// Equal means equal on random and boundary inputs, and on all inputs
+// of 5 or 8 bits
+extern int superoptimize(Compiler *c, int node);
+
+extern void freeSuperopt(Superopt *s);
+
+#endif  // __SUPEROPT__
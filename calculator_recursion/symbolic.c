@@ -0,0 +1,635 @@
+#include "symbolic.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "compiler.h"
+
+// Larger products and sums stay opaque atoms, so that the forms of a
+// long program do not blow up
+#define MAXPRODUCT 64  // terms multiplied pairwise
+#define MAXDEGREE 8    // atoms in a monomial
+#define MAXSUM 256     // terms of a sum
+
+// Sums nested deeper than this are not re-synthesized, synthesis
+// recurses once per level
+#define MAXNEST 2000
+
+// Word i of form f
+#define WORD(s, f, i) ((s)->words[(s)->forms[f].start + (i)])
+#define COEF(s, p, i) WORD(s, p, 2 * (i))
+#define MONO(s, p, i) WORD(s, p, 2 * (i) + 1)
+#define TERMS(s, p) ((s)->forms[p].len / 2)
+
+// A coefficient is negative as a 32-bit signed number
+#define NEGATIVE(k) ((int)(k) < 0)
+
+static unsigned magnitude(unsigned k) {
+    return NEGATIVE(k) ? -k : k;
+}
+
+static void push(Compiler* c, unsigned w) {
+    Symbolic* s = &c->symbolic;
+    s->words = (unsigned*)grow(c, s->words, &s->wordcap, s->nword + 1,
+                               sizeof(unsigned));
+    s->words[s->nword++] = w;
+}
+
+static unsigned formHash(FormKind kind, const unsigned* w, int len) {
+    unsigned h = (2166136261u ^ kind) * 16777619u;
+    for (int i = 0; i < len; i++) {
+        h = (h ^ w[i]) * 16777619u;
+    }
+    return h;
+}
+
+// The slot of a form equal to (kind, w[0..len)), or the empty slot where
+// it goes
+static int* findForm(Symbolic* s, FormKind kind, const unsigned* w,
+                     int len) {
+    unsigned mask = s->slotcap - 1;
+    for (unsigned i = formHash(kind, w, len) & mask;; i = (i + 1) & mask) {
+        const Form* f = s->slots[i] ? &s->forms[s->slots[i] - 1] : NULL;
+        if (!f || (f->kind == kind && f->len == len &&
+                   !memcmp(s->words + f->start, w, len * sizeof(unsigned)))) {
+            return &s->slots[i];
+        }
+    }
+}
+
+static void rehashForms(Compiler* c) {
+    Symbolic* s = &c->symbolic;
+    int cap = s->slotcap ? s->slotcap << 1 : 1024;
+    int* slots = (int*)calloc(cap, sizeof(int));
+    if (!slots) {
+        error(c, RUNOUT);
+    }
+    free(s->slots);
+    s->slots = slots;
+    s->slotcap = cap;
+    for (int f = 0; f < s->nform; f++) {
+        const Form* form = &s->forms[f];
+        *findForm(s, form->kind, s->words + form->start, form->len) = f + 1;
+    }
+}
+
+// The form in words[start..nword), or an equal one that already exists,
+// in which case the new words are dropped
+static int form(Compiler* c, FormKind kind, int start) {
+    Symbolic* s = &c->symbolic;
+    int* slot;
+    if (2 * (s->nform + 1) > s->slotcap) {
+        rehashForms(c);
+    }
+    slot = findForm(s, kind, s->words + start, s->nword - start);
+    if (*slot) {
+        s->nword = start;
+        return *slot - 1;
+    }
+    s->forms = (Form*)grow(c, s->forms, &s->formcap, s->nform + 1,
+                           sizeof(Form));
+    s->forms[s->nform] = (Form){kind, start, s->nword - start, 0, 0};
+    *slot = s->nform + 1;
+    return s->nform++;
+}
+
+static int constPoly(Compiler* c, unsigned k) {
+    int start = c->symbolic.nword;
+    if (k) {
+        push(c, k);
+        push(c, c->symbolic.one);
+    }
+    return form(c, FORM_POLY, start);
+}
+
+// The polynomial of the atom (op, a, b)
+static int atomPoly(Compiler* c, OpType op, int a, int b) {
+    Symbolic* s = &c->symbolic;
+    int start = s->nword;
+    push(c, op);
+    push(c, a);
+    push(c, b);
+    a = form(c, FORM_ATOM, start);
+    start = s->nword;
+    push(c, a);
+    a = form(c, FORM_MONO, start);
+    start = s->nword;
+    push(c, 1);
+    push(c, a);
+    return form(c, FORM_POLY, start);
+}
+
+// Test if polynomial p is the constant *k
+static int isConst(const Symbolic* s, int p, unsigned* k) {
+    if (!TERMS(s, p)) {
+        *k = 0;
+        return 1;
+    } else if (TERMS(s, p) == 1 && MONO(s, p, 0) == (unsigned)s->one) {
+        *k = COEF(s, p, 0);
+        return 1;
+    }
+    return 0;
+}
+
+// p + sign * q, sign is 1 or -1
+static int addPoly(Compiler* c, int p, int q, unsigned sign) {
+    Symbolic* s = &c->symbolic;
+    int np = TERMS(s, p), nq = TERMS(s, q), i = 0, j = 0, start = s->nword;
+    if (np + nq > MAXSUM) {
+        return atomPoly(c, sign == 1 ? OP_ADD : OP_SUB, p, q);
+    }
+    while (i < np || j < nq) {
+        unsigned coef, mono;
+        if (j == nq || (i < np && MONO(s, p, i) < MONO(s, q, j))) {
+            coef = COEF(s, p, i);
+            mono = MONO(s, p, i++);
+        } else if (i == np || MONO(s, q, j) < MONO(s, p, i)) {
+            coef = sign * COEF(s, q, j);
+            mono = MONO(s, q, j++);
+        } else {
+            coef = COEF(s, p, i) + sign * COEF(s, q, j++);
+            mono = MONO(s, p, i++);
+        }
+        if (coef) {
+            push(c, coef);
+            push(c, mono);
+        }
+    }
+    return form(c, FORM_POLY, start);
+}
+
+static int scalePoly(Compiler* c, int p, unsigned k) {
+    Symbolic* s = &c->symbolic;
+    int start = s->nword;
+    for (int i = 0; i < TERMS(s, p); i++) {
+        if (COEF(s, p, i) * k != 0) {
+            push(c, COEF(s, p, i) * k);
+            push(c, MONO(s, p, i));
+        }
+    }
+    return form(c, FORM_POLY, start);
+}
+
+static int mulMono(Compiler* c, int m1, int m2) {
+    Symbolic* s = &c->symbolic;
+    int a = 0, b = 0, na = s->forms[m1].len, nb = s->forms[m2].len;
+    int start = s->nword;
+    while (a < na || b < nb) {
+        if (b == nb || (a < na && WORD(s, m1, a) <= WORD(s, m2, b))) {
+            push(c, WORD(s, m1, a++));
+        } else {
+            push(c, WORD(s, m2, b++));
+        }
+    }
+    return form(c, FORM_MONO, start);
+}
+
+static int degree(const Symbolic* s, int p) {
+    int d = 0;
+    for (int i = 0; i < TERMS(s, p); i++) {
+        if (s->forms[MONO(s, p, i)].len > d) {
+            d = s->forms[MONO(s, p, i)].len;
+        }
+    }
+    return d;
+}
+
+static int byMonomial(const void* a, const void* b) {
+    unsigned x = *(const unsigned*)a, y = *(const unsigned*)b;
+    return x < y ? -1 : x > y;
+}
+
+static int mulPoly(Compiler* c, int p, int q) {
+    Symbolic* s = &c->symbolic;
+    int np = TERMS(s, p), nq = TERMS(s, q), n = 0, start;
+    unsigned k;
+
+    if (isConst(s, q, &k)) {
+        return scalePoly(c, p, k);
+    } else if (isConst(s, p, &k)) {
+        return scalePoly(c, q, k);
+    } else if (np * nq > MAXPRODUCT ||
+               degree(s, p) + degree(s, q) > MAXDEGREE) {
+        return atomPoly(c, OP_MUL, p < q ? p : q, p < q ? q : p);
+    }
+    s->terms = (unsigned*)grow(c, s->terms, &s->termcap, 2 * np * nq,
+                               sizeof(unsigned));
+    for (int i = 0; i < np; i++) {
+        for (int j = 0; j < nq; j++) {
+            s->terms[n++] = mulMono(c, MONO(s, p, i), MONO(s, q, j));
+            s->terms[n++] = COEF(s, p, i) * COEF(s, q, j);
+        }
+    }
+    qsort(s->terms, n / 2, 2 * sizeof(unsigned), byMonomial);
+    start = s->nword;
+    for (int i = 0; i < n;) {
+        unsigned mono = s->terms[i], coef = 0;
+        for (; i < n && s->terms[i] == mono; i += 2) {
+            coef += s->terms[i + 1];
+        }
+        if (coef) {
+            push(c, coef);
+            push(c, mono);
+        }
+    }
+    return form(c, FORM_POLY, start);
+}
+
+// AND, OR or XOR, with the identities that keep it a polynomial
+static int bitPoly(Compiler* c, OpType op, int p, int q) {
+    const Symbolic* s = &c->symbolic;
+    unsigned a, b;
+    int t;
+
+    if (isConst(s, p, &a) && isConst(s, q, &b)) {
+        return constPoly(c, op == OP_AND ? a & b : op == OP_OR ? a | b : a ^ b);
+    } else if (p == q) {
+        return op == OP_XOR ? constPoly(c, 0) : p;
+    }
+    if (isConst(s, p, &b)) {
+        t = p;
+        p = q;
+        q = t;
+    }
+    if (isConst(s, q, &b) && b == 0) {
+        return op == OP_AND ? q : p;
+    } else if (isConst(s, q, &b) && b == ~0u && op != OP_XOR) {
+        return op == OP_AND ? p : q;
+    }
+    return atomPoly(c, op, p < q ? p : q, p < q ? q : p);
+}
+
+// Note that the program divides by q
+static void trap(Compiler* c, int q) {
+    Symbolic* s = &c->symbolic;
+    unsigned k;
+    if ((isConst(s, q, &k) && k) || s->forms[q].trap) {
+        return;
+    }
+    s->traps = (int*)grow(c, s->traps, &s->trapcap, s->ntrap + 1, sizeof(int));
+    s->traps[s->ntrap++] = q;
+    s->forms[q].trap = 1;
+}
+
+static int divPoly(Compiler* c, int p, int q) {
+    const Symbolic* s = &c->symbolic;
+    unsigned a, b;
+
+    trap(c, q);
+    if (isConst(s, q, &b) && b == 1) {
+        return p;
+    } else if (isConst(s, q, &b) && b && isConst(s, p, &a)) {
+        // INT_MIN / -1 wraps around to INT_MIN, as on the machine
+        return constPoly(c, (int)b == -1 ? 0u - a
+                                         : (unsigned)((int)a / (int)b));
+    } else if (p == q || !TERMS(s, p)) {
+        // Unless q is zero, and then nothing is computed anyway
+        return constPoly(c, p == q);
+    }
+    return atomPoly(c, OP_DIV, p, q);
+}
+
+// Find the polynomials of every variable after the buffered program
+static void execute(Compiler* c) {
+    Symbolic* s = &c->symbolic;
+    const Parser* p = &c->parser;
+    int sym;
+
+    s->nform = s->nword = s->ntrap = 0;
+    if (s->slots) {
+        memset(s->slots, 0, s->slotcap * sizeof(int));
+    }
+    s->one = form(c, FORM_MONO, s->nword);
+    s->vars = (int*)grow(c, s->vars, &s->varcap, c->symbols.count,
+                         sizeof(int));
+    for (sym = 0; sym < c->symbols.count; sym++) {
+        s->vars[sym] = sym < 3 ? atomPoly(c, OP_ID, sym, 0) : constPoly(c, 0);
+    }
+    for (int st = 0; st < p->nstmt; st++) {
+        const BTNode* code = p->prog + p->stmts[st];
+        int n = p->stmts[st + 1] - p->stmts[st];
+        s->vals = (int*)grow(c, s->vals, &s->valcap, n + 1, sizeof(int));
+        for (int i = 1; i <= n; i++) {
+            const BTNode* inst = &code[i];
+            int l = inst->left ? s->vals[inst->left] : 0;
+            int r = inst->right ? s->vals[inst->right] : 0;
+            int* var = s->vars + (inst->op == OP_INT ? 0 : inst->val);
+            int v = 0;
+            switch (inst->op) {
+                case OP_INT:
+                    v = constPoly(c, inst->val);
+                    break;
+                case OP_ID:
+                    v = *var;
+                    break;
+                case OP_ADD:
+                case OP_SUB:
+                    v = addPoly(c, l, r, inst->op == OP_ADD ? 1 : ~0u);
+                    break;
+                case OP_MUL:
+                    v = mulPoly(c, l, r);
+                    break;
+                case OP_DIV:
+                    v = divPoly(c, l, r);
+                    break;
+                case OP_AND:
+                case OP_OR:
+                case OP_XOR:
+                    v = bitPoly(c, inst->op, l, r);
+                    break;
+                case OP_ASSIGN:
+                    v = *var = r;
+                    break;
+                case OP_ADD_ASSIGN:
+                case OP_SUB_ASSIGN:
+                    v = *var = addPoly(c, *var, r,
+                                       inst->op == OP_ADD_ASSIGN ? 1 : ~0u);
+                    break;
+                case OP_INC:
+                case OP_DEC:
+                    v = *var = addPoly(c, *var, constPoly(c, 1),
+                                       inst->op == OP_INC ? 1 : ~0u);
+                    break;
+            }
+            s->vals[i] = v;
+        }
+    }
+}
+
+static int inst(Compiler* c, OpType op, int val, int left, int right) {
+    Symbolic* s = &c->symbolic;
+    s->code = (BTNode*)grow(c, s->code, &s->codecap, s->ncode + 2,
+                            sizeof(BTNode));
+    s->code[++s->ncode] = (BTNode){op, val, left, right};
+    return s->ncode;
+}
+
+static int synPoly(Compiler* c, int p);
+
+static int synAtom(Compiler* c, int a) {
+    Symbolic* s = &c->symbolic;
+    if (!s->forms[a].code) {
+        OpType op = (OpType)WORD(s, a, 0);
+        int code;
+        if (op == OP_ID) {
+            code = inst(c, OP_ID, WORD(s, a, 1), NIL, NIL);
+        } else {
+            int left = synPoly(c, WORD(s, a, 1));
+            int right = synPoly(c, WORD(s, a, 2));
+            code = inst(c, op, 0, left, right);
+            if (op == OP_DIV) {
+                s->forms[WORD(s, a, 2)].trap = 2;
+            }
+        }
+        s->forms[a].code = code;
+    }
+    return s->forms[a].code;
+}
+
+// A product of atoms, a square from its root and anything else from its
+// first atoms
+static int synMono(Compiler* c, int m) {
+    Symbolic* s = &c->symbolic;
+    if (!s->forms[m].code) {
+        int len = s->forms[m].len, square = 1, start = s->nword, i, code;
+        if (len == 1) {
+            code = synAtom(c, WORD(s, m, 0));
+        } else {
+            for (i = 0; i < len; i += 2) {
+                square &= i + 1 < len && WORD(s, m, i) == WORD(s, m, i + 1);
+            }
+            for (i = 0; i < len - 1; i += square ? 2 : 1) {
+                push(c, WORD(s, m, i));
+            }
+            code = synMono(c, form(c, FORM_MONO, start));
+            code = inst(c, OP_MUL, 0, code,
+                        square ? code : synAtom(c, WORD(s, m, len - 1)));
+        }
+        s->forms[m].code = code;
+    }
+    return s->forms[m].code;
+}
+
+static void part(Compiler* c, int sign, int code) {
+    Symbolic* s = &c->symbolic;
+    s->parts = (int*)grow(c, s->parts, &s->partcap, s->nparts + 2,
+                          sizeof(int));
+    s->parts[s->nparts++] = sign;
+    s->parts[s->nparts++] = code;
+}
+
+static void synInto(Compiler* c, int p, int sign, unsigned* k);
+
+// Add sign * p to the sum, for p whose terms have coefficients of 1 or
+// -1, factoring out the atom that the most terms have:
+// a * b + a * c + d -> a * (b + c) + d
+static void horner(Compiler* c, int p, int first, int sign, unsigned* k) {
+    Symbolic* s = &c->symbolic;
+    int n = TERMS(s, p), best = -1, bestCount = 1, i, j, a, start, q, r;
+    unsigned* t;
+
+    for (i = first; i < n; i++) {
+        int m = MONO(s, p, i);
+        for (a = 0; a < s->forms[m].len; a++) {
+            int atom = WORD(s, m, a), count = 0;
+            for (j = first; j < n; j++) {
+                int m2 = MONO(s, p, j), b = 0;
+                while (b < s->forms[m2].len && WORD(s, m2, b) != (unsigned)atom) {
+                    b++;
+                }
+                count += b < s->forms[m2].len;
+            }
+            if (count > bestCount) {
+                best = atom;
+                bestCount = count;
+            }
+        }
+    }
+    if (best < 0) {
+        for (i = first; i < n; i++) {
+            part(c, NEGATIVE(COEF(s, p, i)) ? -sign : sign,
+                 synMono(c, MONO(s, p, i)));
+        }
+        return;
+    }
+
+    // p = best * q + r
+    s->terms = (unsigned*)grow(c, s->terms, &s->termcap, 2 * n,
+                               sizeof(unsigned));
+    j = 0;
+    for (i = first; i < n; i++) {
+        int m = MONO(s, p, i), dropped = 0;
+        start = s->nword;
+        for (a = 0; a < s->forms[m].len; a++) {
+            if (!dropped && WORD(s, m, a) == (unsigned)best) {
+                dropped = 1;
+            } else {
+                push(c, WORD(s, m, a));
+            }
+        }
+        if (dropped) {
+            s->terms[j++] = form(c, FORM_MONO, start);
+            s->terms[j++] = COEF(s, p, i);
+        } else {
+            s->nword = start;
+        }
+    }
+    qsort(s->terms, j / 2, 2 * sizeof(unsigned), byMonomial);
+    start = s->nword;
+    for (t = s->terms; t < s->terms + j; t += 2) {
+        push(c, t[1]);
+        push(c, t[0]);
+    }
+    q = form(c, FORM_POLY, start);
+    start = s->nword;
+    for (i = first; i < n; i++) {
+        int m = MONO(s, p, i), b = 0;
+        while (b < s->forms[m].len && WORD(s, m, b) != (unsigned)best) {
+            b++;
+        }
+        if (b == s->forms[m].len) {
+            push(c, COEF(s, p, i));
+            push(c, m);
+        }
+    }
+    r = form(c, FORM_POLY, start);
+    a = synAtom(c, best);
+    part(c, sign, inst(c, OP_MUL, 0, a, synPoly(c, q)));
+    synInto(c, r, sign, k);
+}
+
+// Add sign * p to the sum being built, its constant to *k
+// Terms with the same coefficient, up to sign, share one multiplication
+// by it: 3 * a - 3 * b + c -> (a - b) * 3 + c
+static void synInto(Compiler* c, int p, int sign, unsigned* k) {
+    Symbolic* s = &c->symbolic;
+    int n = TERMS(s, p), first = 0, i, j;
+
+    if (++s->depth > MAXNEST) {
+        error(c, RUNOUT);
+    }
+    if (n && MONO(s, p, 0) == (unsigned)s->one) {
+        *k += sign * COEF(s, p, 0);
+        first = 1;
+    }
+    for (i = first; i < n && magnitude(COEF(s, p, i)) == 1; i++)
+        ;
+    if (i == n) {
+        horner(c, p, first, sign, k);
+        s->depth--;
+        return;
+    }
+    for (i = first; i < n; i++) {
+        unsigned mag = magnitude(COEF(s, p, i));
+        int neg = NEGATIVE(COEF(s, p, i)), start = s->nword, inner;
+        for (j = first; j < i && magnitude(COEF(s, p, j)) != mag; j++)
+            ;
+        if (j < i) {
+            continue;
+        }
+        // The group, with its first term positive
+        for (j = i; j < n; j++) {
+            if (magnitude(COEF(s, p, j)) == mag) {
+                push(c, NEGATIVE(COEF(s, p, j)) == neg ? 1 : ~0u);
+                push(c, MONO(s, p, j));
+            }
+        }
+        inner = form(c, FORM_POLY, start);
+        if (mag == 1) {
+            synInto(c, inner, neg ? -sign : sign, k);
+        } else {
+            part(c, neg ? -sign : sign,
+                 inst(c, OP_MUL, 0, synPoly(c, inner),
+                      inst(c, OP_INT, (int)mag, NIL, NIL)));
+        }
+    }
+    s->depth--;
+}
+
+// The sum of the terms from parts[base] on and k
+static int finish(Compiler* c, int base, unsigned k) {
+    Symbolic* s = &c->symbolic;
+    int acc = 0, first = -1, i;
+
+    for (i = base; i < s->nparts && first < 0; i += 2) {
+        if (s->parts[i] > 0) {
+            first = i;
+        }
+    }
+    if (first >= 0) {
+        acc = s->parts[first + 1];
+    } else if (base < s->nparts && k) {
+        acc = inst(c, OP_INT, (int)k, NIL, NIL);
+        k = 0;
+    } else if (base < s->nparts) {
+        first = base;
+        acc = inst(c, OP_SUB, 0, inst(c, OP_INT, 0, NIL, NIL),
+                   s->parts[base + 1]);
+    }
+    for (i = base; i < s->nparts; i += 2) {
+        if (i != first) {
+            acc = inst(c, s->parts[i] > 0 ? OP_ADD : OP_SUB, 0, acc,
+                       s->parts[i + 1]);
+        }
+    }
+    s->nparts = base;
+    if (!acc) {
+        return inst(c, OP_INT, (int)k, NIL, NIL);
+    } else if (k) {
+        acc = inst(c, NEGATIVE(k) ? OP_SUB : OP_ADD, 0, acc,
+                   inst(c, OP_INT, (int)magnitude(k), NIL, NIL));
+    }
+    return acc;
+}
+
+static int synPoly(Compiler* c, int p) {
+    Symbolic* s = &c->symbolic;
+    if (!s->forms[p].code) {
+        int base = s->nparts;
+        unsigned k = 0;
+        synInto(c, p, 1, &k);
+        s->forms[p].code = finish(c, base, k);
+    }
+    return s->forms[p].code;
+}
+
+int resynthesize(Compiler* c) {
+    Symbolic* s = &c->symbolic;
+    int root[3], sym, i;
+
+    execute(c);
+    for (i = 0; i < s->nform; i++) {
+        s->forms[i].code = 0;
+    }
+    s->ncode = s->nparts = s->depth = 0;
+    for (sym = 0; sym < 3; sym++) {
+        root[sym] = s->vars[sym] == atomPoly(c, OP_ID, sym, 0)
+                        ? 0
+                        : synPoly(c, s->vars[sym]);
+    }
+    // A division that may be by zero is still done, by itself if its
+    // result is not needed
+    for (i = 0; i < s->ntrap; i++) {
+        if (s->forms[s->traps[i]].trap == 1) {
+            int d = synPoly(c, s->traps[i]);
+            inst(c, OP_DIV, 0, d, d);
+        }
+    }
+    for (sym = 0; sym < 3; sym++) {
+        if (root[sym]) {
+            inst(c, OP_ASSIGN, sym, NIL, root[sym]);
+        }
+    }
+    return s->ncode;
+}
+
+void freeSymbolic(Symbolic* s) {
+    free(s->forms);
+    free(s->words);
+    free(s->slots);
+    free(s->vars);
+    free(s->vals);
+    free(s->traps);
+    free(s->terms);
+    free(s->code);
+    free(s->parts);
+}
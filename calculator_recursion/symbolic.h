@@ -0,0 +1,63 @@
+#ifndef __SYMBOLIC__
+#define __SYMBOLIC__
+
+#include "parser.h"
+
+// Normal forms of the values a program computes from the initial x, y
+// and z. There is no control flow, so every value is a function of them
+// - an atom is an input, or an operation that polynomials do not
+//   express, of two polynomials: a DIV, AND, OR or XOR, or an ADD or MUL
+//   whose result would be too large
+// - a monomial is a product of atoms, sorted by ID
+// - a polynomial is a sum of terms coef * monomial, sorted by monomial,
+//   with the constant on the empty monomial and 32-bit wraparound
+// Forms are hash-consed, so equal forms have equal IDs
+typedef enum { FORM_ATOM, FORM_MONO, FORM_POLY } FormKind;
+
+typedef struct {
+    FormKind kind;
+    int start, len;  // words[start .. start + len) are its contents
+    int code;        // instruction that computes it, 0 if none yet
+    int trap;        // 1 for a divisor that may be zero, 2 once divided by
+} Form;
+
+// Atom: op, then the symbol of an OP_ID or two polynomials
+// Monomial: atoms; polynomial: (coef, monomial) pairs
+typedef struct {
+    Form *forms;
+    int nform, formcap;
+    unsigned *words;
+    int nword, wordcap;
+    int *slots;  // open addressing table of form ID + 1, 0 if empty
+    int slotcap;
+    int one;     // the empty monomial
+
+    // Symbolic execution of the buffered program
+    int *vars;   // polynomial of each variable
+    int *vals;   // polynomial of each instruction of a statement
+    int *traps;  // divisors that may be zero
+    int varcap, valcap, ntrap, trapcap;
+
+    // Scratch terms of a product, (monomial, coef) pairs
+    unsigned *terms;
+    int termcap;
+
+    // The program that is re-synthesized, code[1..ncode], and the
+    // stack of (sign, instruction) terms of the sums being built
+    BTNode *code;
+    int ncode, codecap;
+    int *parts;
+    int nparts, partcap;
+    int depth;  // synInto() calls in progress
+} Symbolic;
+
+// Execute the buffered program symbolically, then rebuild it as
+// instructions that only compute the final x, y and z from their normal
+// forms, and the divisions that may be by zero
+// Return the number of instructions, in code[1..]
+// Fail with RUNOUT if the forms are nested too deep
+extern int resynthesize(Compiler *c);
+
+extern void freeSymbolic(Symbolic *s);
+
+#endif  // __SYMBOLIC__
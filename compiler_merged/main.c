@@ -2,11 +2,37 @@
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <setjmp.h>
+#include <stdarg.h>
+
+
+// for cost
+// A copy of assembly_parser/cost.h, keep them in sync: make test in
+// calculator_recursion/ checks that the costs are the same
+// Clock cycles of each instruction of the machine
+// The simulator counts these, and the compiler picks its code by them
+#define COST_MOV_REG 10    // MOV reg reg
+#define COST_MOV_CONST 10  // MOV reg const
+#define COST_LOAD 200      // MOV reg [addr]
+#define COST_STORE 200     // MOV [addr] reg
+#define COST_ADD 10
+#define COST_SUB 10
+#define COST_MUL 30
+#define COST_DIV 50
+#define COST_AND 10
+#define COST_OR 10
+#define COST_XOR 10
+#define COST_EXIT 20
 
 
 // for lex
 #define MAXLEN 256
 
+// All state of one compilation, see compiler.h
+typedef struct Compiler Compiler;
+
 // Token types
 typedef enum {
     UNKNOWN, END, ENDFILE, 
@@ -18,14 +44,45 @@ typedef enum {
     INCDEC,
 } TokenSet;
 
+// A lexeme as an (offset, length) span of the input buffer
+typedef struct {
+    size_t offset;
+    int length;
+} Span;
+
+// State of the lexer
+typedef struct {
+    const char *buf;
+    size_t len, pos;
+    TokenSet token;
+    Span span;
+    int value, symbol;
+} Lexer;
+
+// Lex from src[0..len)
+extern void setInput(Compiler *c, const char *src, size_t len);
+
 // Test if a token matches the current token 
-extern int match(TokenSet token);
+extern int match(Compiler *c, TokenSet token);
 
 // Get the next token
-extern void advance(void);
+extern void advance(Compiler *c);
 
 // Get the lexeme of the current token
-extern char *getLexeme(void);
+// The text is not null-terminated, use getSpan() for its length
+extern const char *getLexeme(Compiler *c);
+
+// Get the value of the current INT token
+extern int getValue(Compiler *c);
+
+// Get the symbol ID of the current ID token
+extern int getSymbol(Compiler *c);
+
+// Get the span of the current token
+extern Span getSpan(Compiler *c);
+
+// Get the text of a span
+extern const char *spanText(Compiler *c, Span span);
 
 
 // for parser
@@ -33,13 +90,13 @@ extern char *getLexeme(void);
 // Make sure you set PRINTERR to 0 before you submit your code
 #define PRINTERR 0
 
-// Call this macro to print error message and exit the program
+// Call this macro to print error message and abort the compilation
 // This will also print where you called it in your program
-#define error(errorNum)                                                       \
+#define error(c, errorNum)                                                    \
     {                                                                         \
         if (PRINTERR)                                                         \
             fprintf(stderr, "error() called at %s:%d: ", __FILE__, __LINE__); \
-        err(errorNum);                                                        \
+        err(c, errorNum);                                                     \
     }
 
 // Error types
@@ -55,61 +112,446 @@ typedef enum {
     SYNTAXERR
 } ErrorType;
 
-// Structure of a tree node
-typedef struct _Node {
-    TokenSet token_type;
-    int val;
-    char lexeme[MAXLEN];
-    struct _Node* left;
-    struct _Node* right;
+// Operators of a tree node
+typedef enum {
+    OP_INT, OP_ID,
+    OP_ADD, OP_SUB, OP_MUL, OP_DIV,
+    OP_AND, OP_OR, OP_XOR,
+    OP_ASSIGN, OP_ADD_ASSIGN, OP_SUB_ASSIGN,
+    OP_INC, OP_DEC,
+} OpType;
+
+// Structure of a tree node, 16 bytes
+// Children are indices into the node pool, NIL if there is none
+typedef struct {
+    OpType op;
+    int val;  // value of an INT, symbol ID of an ID or of an INC/DEC target
+    int left;
+    int right;
 } BTNode;
 
-// Make a new node according to token type and lexeme
-extern BTNode* makeNode(TokenSet tok, const char* lexe);
+#define NIL 0
+
+// Flags of a subtree
+#define F_WRITE 1     // assigns a variable
+#define F_TRAP 2      // may divide by zero or read an undefined variable
+#define F_VARIABLE 4  // reads a variable, even if its value is now known
 
-// Free the syntax tree
-extern void freeTree(BTNode* root);
+// Entry of the operator stack
+// A LPAREN or an assignment also marks where its operand starts
+typedef struct {
+    OpType op;
+    int prec;  // PREC_PAREN, PREC_ASSIGN or the binding power
+    int sym;   // target of an assignment
+} Pending;
+
+// State of the parser
+typedef struct {
+    // The node pool of the current statement, index 0 is never used
+    BTNode *pool;
+    unsigned char *flags;  // flags of each node
+    int poolsize, poolcap, flagcap;
+
+    // The tree of the current statement flattened in post-order, so that
+    // every instruction comes after its operands: ir[1..irsize]
+    BTNode *ir;
+    int irsize, ircap;
+    int *placed;  // ir index of each pool node
+    int *label;   // registers the subtree of each pool node needs
+    int *work;
+    int placedcap, labelcap, workcap;
+
+    // Operand and operator stacks of assign_expr()
+    int *operands;
+    Pending *operators;
+    int noperand, noperator, operandcap, operatorcap;
+
+    // Pairs of nodes still to compare in sameTree()
+    int *pairs;
+    int paircap;
+
+    // Open addressing table of the nodes that can be shared, so that
+    // equal side-effect free subtrees are built once: node index, 0 if
+    // empty. Nodes made before barrier, the node after the last write,
+    // are not shared
+    int *cons;
+    int conscap, barrier;
+
+    // The statements of the program, flattened one after another and
+    // kept until the end: statement s is prog[stmts[s] + 1 .. stmts[s + 1]]
+    // and its operands are relative to prog + stmts[s]
+    BTNode *prog;
+    int progsize, progcap;
+    int *stmts;
+    int nstmt, stmtcap;
+} Parser;
 
-extern BTNode* factor(void);
-extern BTNode* muldiv_expr(void);
-extern BTNode* muldiv_expr_tail(BTNode* left);
-extern BTNode* addsub_expr(void);
-extern BTNode* addsub_expr_tail(BTNode* left);
-extern BTNode* xor_expr(void);
-extern BTNode* xor_expr_tail(BTNode* left);
-extern BTNode* or_expr(void);
-extern BTNode* or_expr_tail(BTNode* left);
-extern BTNode* and_expr(void);
-extern BTNode* and_expr_tail(BTNode* left);
-extern BTNode* assign_expr(void);
-extern void statement(void);
+// Make a new node and return its index in the pool, or the index of an
+// equal node if the statement already has one that can be shared
+// The pool may move, so do not keep pointers into it across this call
+extern int makeNode(Compiler *c, OpType op, int val, int left, int right);
 
-// Print error message and exit the program
-extern void err(ErrorType errorNum);
+// Make an INT for a value that is known without being written as a
+// constant, so a division by it when it is zero is left to run time
+// instead of being DIVZERO
+extern int knownInt(Compiler *c, int val);
 
+// Free the syntax tree of the statement by resetting the node pool
+extern void freeTree(Compiler *c);
+
+// Flatten the tree under root into ir[], a shared node only once, and
+// return its size
+extern int linearize(Compiler *c, int root);
+
+extern int assign_expr(Compiler *c);
+
+// Compile one statement, return 0 once the input is exhausted
+extern int statement(Compiler *c);
+
+// Release the memory of the parser
+extern void freeParser(Parser *p);
+
+// Print error message and abort the compilation
+extern void err(Compiler *c, ErrorType errorNum);
 
 
 // for codeGen
-#define TBLSIZE 64
+// Bytes of data memory, variables get one 4-byte word each
+#define MEMSIZE 256
 
 
 // Structure of the symbol table
 typedef struct {
-    char name[MAXLEN];
+    int name;  // offset of the name in the name pool
+    int len;
+    int addr;  // address of x, y and z, -1 for the others
+    int set;   // 1 once the parser has seen the variable assigned
+    int reg;   // register that still holds its value, -1 if none
+    int next;  // next symbol cached in the same register, -1 if none
+
+    // Constant propagation: known is 1 while the variable surely holds
+    // value at the point the parser is at, 0 while it depends on the
+    // input or is not assigned yet
+    int known;
+    int value;
 } Symbol;
 
 
-// The symbol table
-extern Symbol table[TBLSIZE];
+// The symbol table, a hash table that grows as needed
+typedef struct {
+    Symbol *table;
+    int count, cap;
+
+    // Open addressing slots holding symbol ID + 1, 0 if empty
+    int *slots;
+    int slotcap;
+
+    // All names back to back
+    char *names;
+    int namelen, namecap;
+} SymbolTable;
+
+// A multiplication by a constant as MOV, ADD and SUB on the register of
+// the product and one scratch register
+#define MULSTEPS 4
+#define MULCHAINS 32
+
+typedef struct {
+    unsigned char op;        // OP_ADD, OP_SUB, or OP_ASSIGN for a MOV
+    unsigned char dst, src;  // 0 for the product, 1 for the scratch register
+} MulStep;
+
+typedef struct {
+    int k;
+    int n, cost;
+    MulStep step[MULSTEPS];
+} MulChain;
+
+// Instructions takeReg() looks ahead for the next use of a value
+#define LOOKAHEAD 256
+
+// State of the code generator
+typedef struct {
+    // Register allocation of the whole program, by instruction
+    int *regs;   // register holding the value, -1 if it is in none
+    int *uses;   // uses of the value that are still to be generated
+    int *spill;  // address of the slot it was spilled to, -1 if none
+    int *alias;  // the value an ID is, if it was in a register, else 0
+    int regcap, usecap, spillcap, aliascap;
+    int owner[8];  // value in each register, 0 if it is free
+    int pin[3];    // values the current instruction needs in registers
+    int nslot;     // spill slots made, from the top of memory down
+    int freeslot[MEMSIZE / 4];  // slots of values that are dead
+    int nfree;
+
+    // x, y and z while their value is still in a register. Every
+    // assignment is stored at once, so a register never holds a value
+    // that memory does not have, unless they are pinned to r0-r2
+    int first;      // first register for values, 3 if x, y, z are pinned
+    int loaded;     // bit of each pinned variable that has its value
+    int cached[8];  // first symbol cached in each register, -1 if none
+    int stamp[8];   // when the register was last used for a variable
+    int clock;
+
+    // Chains cheaper than a MUL by a constant, found once per compiler
+    MulChain chains[MULCHAINS];
+    int nchain;
+
+    // Liveness of the buffered program, so that only what can change
+    // x, y and z or divide by zero is generated
+    unsigned char *need;  // N_* bits of each instruction of the program
+    unsigned char *live;  // variables that are read before the next write
+    BTNode *kept;         // the instructions of the program that are kept
+    int *map;             // index in kept of each instruction's value
+    int *def;             // index in kept of each variable's value
+    int needcap, livecap, keptcap, mapcap, defcap;
+} CodeGen;
+
+// Bits of need[]
+#define N_USED 1   // the value is an operand of a kept instruction
+#define N_KEEP 2   // the instruction is generated
+#define N_STORE 4  // the variable it writes is read again
+
+// Initialize the symbol table with builtin variables, with none of them
+// in a register
+extern void initTable(Compiler *c);
+
+// Get the symbol ID of a name, adding it to the table if it is new
+extern int intern(Compiler *c, const char *name, int len);
+
+// Get the address of x, y or z, the only variables in memory
+extern int get_addr(Compiler *c, int sym);
+
+// Mark each variable code[1..n] assigns as set, in order, and fail with
+// NOTFOUND on a read of one that is not set yet
+extern void bind_vars(Compiler *c, const BTNode *code, int n);
+
+// Cycles of a multiplication by the constant k, with its MOV, as a
+// chain or as a MUL
+extern int mulCost(Compiler *c, int k);
+
+// Generate code for the post-order instructions code[1..n]
+extern void generate_code(Compiler *c, const BTNode *code, int n);
+
+// Generate the buffered statements as one block, without the
+// instructions whose result is never read, and the end of the program
+// with x, y and z in r0-r2. The other variables never go to memory: a
+// read of one is the value last assigned to it, which stays in a
+// register until it is spilled
+// At level 2 the code re-synthesized from the normal forms of x, y and z
+// is generated too, and the cheaper of the two is kept
+// The code goes through peephole() before it is written out
+extern void generate_program(Compiler *c);
+
+// Release the memory of the symbol table and the code generator
+extern void freeSymbols(SymbolTable *st);
+extern void freeCodeGen(CodeGen *g);
+
+
+// for symbolic
+// Normal forms of the values a program computes from the initial x, y
+// and z. There is no control flow, so every value is a function of them
+// - an atom is an input, or an operation that polynomials do not
+//   express, of two polynomials: a DIV, AND, OR or XOR, or an ADD or MUL
+//   whose result would be too large
+// - a monomial is a product of atoms, sorted by ID
+// - a polynomial is a sum of terms coef * monomial, sorted by monomial,
+//   with the constant on the empty monomial and 32-bit wraparound
+// Forms are hash-consed, so equal forms have equal IDs
+typedef enum { FORM_ATOM, FORM_MONO, FORM_POLY } FormKind;
+
+typedef struct {
+    FormKind kind;
+    int start, len;  // words[start .. start + len) are its contents
+    int code;        // instruction that computes it, 0 if none yet
+    int trap;        // 1 for a divisor that may be zero, 2 once divided by
+} Form;
+
+// Atom: op, then the symbol of an OP_ID or two polynomials
+// Monomial: atoms; polynomial: (coef, monomial) pairs
+typedef struct {
+    Form *forms;
+    int nform, formcap;
+    unsigned *words;
+    int nword, wordcap;
+    int *slots;  // open addressing table of form ID + 1, 0 if empty
+    int slotcap;
+    int one;     // the empty monomial
+
+    // Symbolic execution of the buffered program
+    int *vars;   // polynomial of each variable
+    int *vals;   // polynomial of each instruction of a statement
+    int *traps;  // divisors that may be zero
+    int varcap, valcap, ntrap, trapcap;
+
+    // Scratch terms of a product, (monomial, coef) pairs
+    unsigned *terms;
+    int termcap;
+
+    // The program that is re-synthesized, code[1..ncode], and the
+    // stack of (sign, instruction) terms of the sums being built
+    BTNode *code;
+    int ncode, codecap;
+    int *parts;
+    int nparts, partcap;
+    int depth;  // synInto() calls in progress
+} Symbolic;
+
+// Execute the buffered program symbolically, then rebuild it as
+// instructions that only compute the final x, y and z from their normal
+// forms, and the divisions that may be by zero
+// Return the number of instructions, in code[1..]
+// Fail with RUNOUT if the forms are nested too deep
+extern int resynthesize(Compiler *c);
+
+extern void freeSymbolic(Symbolic *s);
 
-// Initialize the symbol table with builtin variables
-extern void initTable(void);
 
-// Get the address of a variable
-extern int get_addr(char *str, int add_var);
+// for inst
+// Instructions of the target machine, as INST of the simulator
+typedef enum {
+    I_MOV, I_ADD, I_SUB, I_MUL, I_DIV, I_EXIT, I_AND, I_OR, I_XOR
+} Opcode;
+
+typedef enum { A_REG, A_CONST, A_ADDR } ArgType;
+
+typedef struct {
+    Opcode opcode;
+    ArgType op1_type;
+    int op1_value;
+    ArgType op2_type;  // not used by EXIT
+    int op2_value;
+} Inst;
+
+// Rules of the peephole pass
+typedef enum {
+    P_LOAD,  // load of the value the register already has
+    P_MOVE,  // MOV of the value the register already has, or a read of a
+             // register whose value a lower one has too
+    P_PAIR,  // load of a value a register has, or store of the value
+             // the word already has
+    P_DEAD,  // write to a register or a word that is never read
+    P_RULES
+} Rule;
+
+extern const char *ruleNames[P_RULES];
+
+// Growable array of instructions
+typedef struct {
+    Inst *inst;
+    int n, cap;
+    int fired[P_RULES];  // times each rule changed it
+} InstBuffer;
+
+// Append an instruction to c->insts
+extern void put(Compiler *c, Opcode opcode, ArgType op1_type, int op1_value,
+                ArgType op2_type, int op2_value);
+
+// Remove and rewrite the instructions of b that do not change what r0-r2
+// hold at the EXIT, or the divisions b does, and count the rules that
+// fired in b->fired
+extern void peephole(InstBuffer *b);
+
+// Clock cycles of b, by the costs the simulator counts
+extern long instCycles(const InstBuffer *b);
+
+// Append b to the output as text
+extern void writeInsts(Compiler *c, const InstBuffer *b);
+
+
+// for superopt
+// A window is a subtree of at most SUPEROPS operators of ADD, SUB, MUL,
+// AND, OR and XOR, cut off at at most SUPERLEAVES operands that neither
+// write nor trap. Its shape is its post-order, 4 bits per token: the
+// OpType of an operator, or LEAF(i) for the i-th distinct operand
+#define SUPEROPS 3
+#define SUPERLEAVES 3
+#define LEAF(i) (12 + (i))
+
+// Result of the search for one shape
+typedef struct {
+    unsigned shape;  // 0 if the slot is empty
+    unsigned best;   // cheapest equal shape, shape itself if there is none
+    int known;       // 1 if the window is always value
+    int value;
+} Shape;
+
+typedef struct {
+    // Open addressing table of the shapes searched so far. It is kept
+    // between compilations, so a shape is only searched once per compiler
+    Shape *shapes;
+    int count, cap;
+
+    // The expressions of up to two operators over the operands, the
+    // replacements that are tried, cheapest first
+    unsigned *cands;
+    int ncand, candcap;
+} Superopt;
+
+// Replace the window at node by the cheapest expression of at most two
+// operators that is equal to it, and return the node that replaces it.
+// Equal means equal on random and boundary inputs, and on all inputs
+// of 5 or 8 bits
+extern int superoptimize(Compiler *c, int node);
+
+extern void freeSuperopt(Superopt *s);
+
+
+// for compiler
+// Growable output buffer, owned by the caller
+// data is allocated with malloc() and may be moved by compile()
+typedef struct {
+    char *data;
+    size_t len, cap;
+} Buffer;
+
+// Code generation choices, set by the caller before compile()
+typedef struct {
+    int pin;  // keep x, y and z in r0-r2 instead of in memory, default 1
+
+    // 2 also re-synthesizes the program from the normal forms of x, y
+    // and z, default 1
+    int level;
+
+    // Evaluate the whole program at compile time, with x, y and z
+    // starting as mem[0..2] instead of unknown, default 0
+    int eval;
+    int mem[3];
+} Options;
+
+// All state of one compilation
+// Nothing is global, so each thread can compile with its own Compiler
+struct Compiler {
+    Lexer lex;
+    Parser parser;
+    SymbolTable symbols;
+    CodeGen codegen;
+    Symbolic symbolic;
+    Superopt superopt;
+    Options opt;
+    Buffer *out;
+    InstBuffer *insts;    // where the code generator puts instructions
+    InstBuffer alt[2];    // the code of each way generate_program() tries
+    long fired[P_RULES];  // peephole rules fired in the code written out
+    jmp_buf fail;         // where err() returns to
+};
+
+// Make a compiler, NULL if out of memory
+// A compiler can be reused, it keeps its memory between compilations
+extern Compiler *newCompiler(void);
+extern void freeCompiler(Compiler *c);
+
+// Compile src[0..len) and append the assembly to out
+// Return 0, or the ErrorType of the error that stopped the compilation
+// The statements are only generated at the end of the input, so an
+// error in the input leaves nothing in out but "EXIT 1"
+extern int compile(Compiler *c, const char *src, size_t len, Buffer *out);
 
-// Evaluate the syntax tree
-extern void generate_code(BTNode *root, int use_reg);
+// Append formatted text to the output
+extern void emit(Compiler *c, const char *fmt, ...);
+
+// Grow an array to hold need elements of size bytes
+extern void *grow(Compiler *c, void *ptr, int *cap, int need, size_t size);
 
 
 
@@ -118,526 +560,3602 @@ lex implementation
 ============================================================================================*/
 
 
-static TokenSet getToken(void);
-static TokenSet curToken = UNKNOWN;
-static char lexeme[MAXLEN];
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// Character classes of the tokenizer
+typedef enum {
+    C_OTHER, C_BLANK, C_NEWLINE,
+    C_DIGIT, C_ALPHA,
+    C_ADDSUB, C_MULDIV,
+    C_ASSIGN, C_LPAREN, C_RPAREN,
+    C_AND, C_OR, C_XOR,
+    // Two-character tokens, told apart by the character after '+' or '-'
+    C_ADDSUB_ASSIGN, C_INCDEC,
+} CharClass;
 
-TokenSet getToken(void) {
-    int i = 0;
-    char c = '\0';
+// Runs that are scanned several bytes at a time
+typedef enum { RUN_BLANK, RUN_DIGIT, RUN_IDENT } RunKind;
 
-    while ((c = fgetc(stdin)) == ' ' || c == '\t')
-        ;
+static TokenSet getToken(Compiler *c);
+
+static const unsigned char charClass[256] = {
+    ['0' ... '9'] = C_DIGIT,
+    ['a' ... 'z'] = C_ALPHA, ['A' ... 'Z'] = C_ALPHA, ['_'] = C_ALPHA,
+    [' '] = C_BLANK,         ['\t'] = C_BLANK,      ['\n'] = C_NEWLINE,
+    ['+'] = C_ADDSUB,        ['-'] = C_ADDSUB,
+    ['*'] = C_MULDIV,        ['/'] = C_MULDIV,
+    ['='] = C_ASSIGN,        ['('] = C_LPAREN,       [')'] = C_RPAREN,
+    ['&'] = C_AND,           ['|'] = C_OR,           ['^'] = C_XOR,
+};
+
+// Token of each class, INT and ID continue as runs
+static const TokenSet classToken[] = {
+    [C_OTHER] = UNKNOWN, [C_BLANK] = UNKNOWN, [C_NEWLINE] = END,
+    [C_DIGIT] = INT,     [C_ALPHA] = ID,
+    [C_ADDSUB] = ADDSUB, [C_MULDIV] = MULDIV,
+    [C_ASSIGN] = ASSIGN, [C_LPAREN] = LPAREN, [C_RPAREN] = RPAREN,
+    [C_AND] = AND,       [C_OR] = OR,         [C_XOR] = XOR,
+    [C_ADDSUB_ASSIGN] = ADDSUB_ASSIGN, [C_INCDEC] = INCDEC,
+};
+
+void setInput(Compiler *c, const char *src, size_t len) {
+    c->lex.buf = src;
+    c->lex.len = len;
+    c->lex.pos = 0;
+    c->lex.token = UNKNOWN;
+}
+
+/*
+ * SWAR helpers: eight bytes at a time in a uint64_t, with the result of
+ * a per-byte test in the high bit of each byte.
+ */
+#define ONES 0x0101010101010101ULL
+#define HIGH 0x8080808080808080ULL
+
+static inline uint64_t load8(const char *p) {
+    uint64_t v;
+    memcpy(&v, p, 8);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap64(v);
+#endif
+    return v;
+}
+
+// Bytes equal to c
+static inline uint64_t swarEq(uint64_t v, unsigned char c) {
+    uint64_t t = v ^ (ONES * c);
+    return ~(((t & ~HIGH) + ~HIGH) | t) & HIGH;
+}
+
+// Bytes in [lo, hi], both below 0x80
+static inline uint64_t swarRange(uint64_t v, unsigned char lo,
+                                 unsigned char hi) {
+    uint64_t x = v & ~HIGH;
+    uint64_t ge = x + ONES * (0x80 - lo);
+    uint64_t gt = x + ONES * (0x7f - hi);
+    return ge & ~gt & ~v & HIGH;
+}
+
+static inline uint64_t swarRun(uint64_t v, RunKind kind) {
+    switch (kind) {
+        case RUN_BLANK:
+            return swarEq(v, ' ') | swarEq(v, '\t');
+        case RUN_DIGIT:
+            return swarRange(v, '0', '9');
+        default:
+            return swarRange(v | (ONES * 0x20), 'a', 'z') |
+                   swarRange(v, '0', '9') | swarEq(v, '_');
+    }
+}
+
+#if defined(__AVX2__)
+typedef __m256i vec;
+#define VWIDTH 32
+#define vload(p) _mm256_loadu_si256((const __m256i *)(p))
+#define vset(c) _mm256_set1_epi8((char)(c))
+#define vor(a, b) _mm256_or_si256(a, b)
+#define veq(a, b) _mm256_cmpeq_epi8(a, b)
+#define vsub(a, b) _mm256_sub_epi8(a, b)
+#define vmin(a, b) _mm256_min_epu8(a, b)
+#define vmask(a) ((uint32_t)_mm256_movemask_epi8(a))
+#elif defined(__SSE2__)
+typedef __m128i vec;
+#define VWIDTH 16
+#define vload(p) _mm_loadu_si128((const __m128i *)(p))
+#define vset(c) _mm_set1_epi8((char)(c))
+#define vor(a, b) _mm_or_si128(a, b)
+#define veq(a, b) _mm_cmpeq_epi8(a, b)
+#define vsub(a, b) _mm_sub_epi8(a, b)
+#define vmin(a, b) _mm_min_epu8(a, b)
+#define vmask(a) ((uint32_t)_mm_movemask_epi8(a))
+#endif
+
+#ifdef VWIDTH
+// Bytes in [lo, hi], as an unsigned compare of byte - lo against hi - lo
+static inline vec vrange(vec v, unsigned char lo, unsigned char hi) {
+    vec d = vsub(v, vset(lo));
+    return veq(vmin(d, vset(hi - lo)), d);
+}
+
+static inline uint32_t vecRun(vec v, RunKind kind) {
+    switch (kind) {
+        case RUN_BLANK:
+            return vmask(vor(veq(v, vset(' ')), veq(v, vset('\t'))));
+        case RUN_DIGIT:
+            return vmask(vrange(v, '0', '9'));
+        default:
+            return vmask(vor(vor(vrange(vor(v, vset(0x20)), 'a', 'z'),
+                                 vrange(v, '0', '9')),
+                             veq(v, vset('_'))));
+    }
+}
+#endif
+
+static inline int inRun(unsigned char c, RunKind kind) {
+    switch (kind) {
+        case RUN_BLANK:
+            return charClass[c] == C_BLANK;
+        case RUN_DIGIT:
+            return charClass[c] == C_DIGIT;
+        default:
+            return charClass[c] == C_DIGIT || charClass[c] == C_ALPHA;
+    }
+}
+
+// Length of the run of kind at p, looking at no more than n bytes
+static size_t scanRun(const char *p, size_t n, RunKind kind) {
+    size_t i = 0;
+    uint64_t stop;
+
+#ifdef VWIDTH
+    for (; i + VWIDTH <= n; i += VWIDTH) {
+        uint32_t vstop = ~vecRun(vload(p + i), kind);
+#if VWIDTH < 32
+        vstop &= (1u << VWIDTH) - 1;
+#endif
+        if (vstop)
+            return i + __builtin_ctz(vstop);
+    }
+#endif
+    for (; i + 8 <= n; i += 8) {
+        stop = ~swarRun(load8(p + i), kind) & HIGH;
+        if (stop)
+            return i + (__builtin_ctzll(stop) >> 3);
+    }
+    while (i < n && inRun((unsigned char)p[i], kind))
+        ++i;
+    return i;
+}
 
-    if (isdigit(c)) {
-        lexeme[0] = c;
-        c = fgetc(stdin);
-        i = 1;
-        while (isdigit(c) && i < MAXLEN) {
-            lexeme[i] = c;
-            ++i;
-            c = fgetc(stdin);
-        }
-        ungetc(c, stdin);
-        lexeme[i] = '\0';
-        return INT;
-    } else if (c == '+' || c == '-') {
-        lexeme[0] = c;
-        c = fgetc(stdin);
-        if (c == '=') {
-            lexeme[1] = c;
-            lexeme[2] = '\0';
-            return ADDSUB_ASSIGN;
-        }
-        if (c == lexeme[0]) {
-            lexeme[1] = c;
-            lexeme[2] = '\0';
-            return INCDEC;
-        }
-        ungetc(c, stdin);
-        lexeme[1] = '\0';
-        return ADDSUB;
-    } else if (c == '*' || c == '/') {
-        lexeme[0] = c;
-        lexeme[1] = '\0';
-        return MULDIV;
-    } else if (c == '&') {
-        lexeme[0] = c;
-        lexeme[1] = '\0';
-        return AND;
-    } else if (c == '|') {
-        lexeme[0] = c;
-        lexeme[1] = '\0';
-        return OR;
-    } else if (c == '^') {
-        lexeme[0] = c;
-        lexeme[1] = '\0';
-        return XOR;
-    } else if (c == '\n') {
-        lexeme[0] = '\0';
-        return END;
-    } else if (c == '=') {
-        strcpy(lexeme, "=");
-        return ASSIGN;
-    } else if (c == '(') {
-        strcpy(lexeme, "(");
-        return LPAREN;
-    } else if (c == ')') {
-        strcpy(lexeme, ")");
-        return RPAREN;
-    } else if (isalpha(c) || c == '_') {
-        lexeme[0] = c;
-        c = fgetc(stdin);
-        i = 1;
-        while ((isalnum(c) || c == '_') && i < MAXLEN) {
-            lexeme[i] = c;
-            ++i;
-            c = fgetc(stdin);
-        }
-        ungetc(c, stdin);
-        lexeme[i] = '\0';
-        return ID;
-    } else if (c == EOF) {
+// Value of eight ASCII digits
+static inline uint32_t parse8(const char *p) {
+    uint64_t v;
+    memcpy(&v, p, 8);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap64(v);
+#endif
+    v -= ONES * '0';
+    v = v * 10 + (v >> 8);
+    v = (((v & 0x000000FF000000FFULL) * (100 + (1000000ULL << 32))) +
+         (((v >> 16) & 0x000000FF000000FFULL) * (1 + (10000ULL << 32)))) >>
+        32;
+    return (uint32_t)v;
+}
+
+// Scan an integer literal at p and build its value (modulo 2^32) on the way
+static size_t scanNumber(const char *p, size_t n, int *value) {
+    uint32_t val = 0;
+    size_t i = 0, run;
+
+    for (; i + 8 <= n; i += 8) {
+        if (~swarRun(load8(p + i), RUN_DIGIT) & HIGH)
+            break;
+        val = val * 100000000u + parse8(p + i);
+    }
+    run = i + scanRun(p + i, n - i, RUN_DIGIT);
+    for (; i < run; i++)
+        val = val * 10 + (uint32_t)(p[i] - '0');
+    *value = (int)val;
+    return run;
+}
+
+TokenSet getToken(Compiler *c) {
+    Lexer *lex = &c->lex;
+    const char *buf = lex->buf;
+    size_t start, pos = lex->pos, len = lex->len;
+    unsigned char ch;
+    CharClass cls;
+
+    if (pos < len && charClass[(unsigned char)buf[pos]] == C_BLANK)
+        pos += scanRun(buf + pos, len - pos, RUN_BLANK);
+    start = pos;
+    lex->span.offset = start;
+    lex->span.length = 0;
+    if (pos >= len) {
+        lex->pos = pos;
         return ENDFILE;
-    } else {
-        return UNKNOWN;
     }
+
+    ch = (unsigned char)buf[pos++];
+    cls = (CharClass)charClass[ch];
+    switch (cls) {
+        case C_DIGIT:
+            pos += scanNumber(buf + start, len - start, &lex->value) - 1;
+            break;
+        case C_ALPHA:
+            // Identifiers are split every MAXLEN - 1 characters, as before
+            pos += scanRun(buf + pos,
+                           len - pos < MAXLEN - 2 ? len - pos : MAXLEN - 2,
+                           RUN_IDENT);
+            // Intern once here so that codegen never compares names
+            lex->symbol = intern(c, buf + start, (int)(pos - start));
+            break;
+        case C_ADDSUB:
+            if (pos < len && (buf[pos] == '=' || buf[pos] == (char)ch)) {
+                cls = buf[pos++] == '=' ? C_ADDSUB_ASSIGN : C_INCDEC;
+            }
+            break;
+        default:
+            break;
+    }
+    lex->pos = pos;
+    lex->span.length = (int)(pos - start);
+    return classToken[cls];
+}
+
+void advance(Compiler *c) {
+    c->lex.token = getToken(c);
+}
+
+int match(Compiler *c, TokenSet token) {
+    if (c->lex.token == UNKNOWN)
+        advance(c);
+    return token == c->lex.token;
+}
+
+const char *getLexeme(Compiler *c) {
+    return c->lex.buf + c->lex.span.offset;
 }
 
-void advance(void) {
-    curToken = getToken();
+Span getSpan(Compiler *c) {
+    return c->lex.span;
 }
 
-int match(TokenSet token) {
-    if (curToken == UNKNOWN)
-        advance();
-    return token == curToken;
+int getValue(Compiler *c) {
+    return c->lex.value;
 }
 
-char* getLexeme(void) {
-    return lexeme;
+int getSymbol(Compiler *c) {
+    return c->lex.symbol;
+}
+
+const char *spanText(Compiler *c, Span span) {
+    return c->lex.buf + span.offset;
 }
 
 
+
 /*============================================================================================
 parser implementation
 ============================================================================================*/
 
 
-BTNode* makeNode(TokenSet tok, const char* lexe) {
-    BTNode* node = (BTNode*)malloc(sizeof(BTNode));
-    strcpy(node->lexeme, lexe);
-    node->token_type = tok;
-    node->val = 0;
-    node->left = NULL;
-    node->right = NULL;
-    return node;
+// Flags of a new node, from its operator and its operands
+static int nodeFlags(Compiler* c, const BTNode* n) {
+    const BTNode* pool = c->parser.pool;
+    const unsigned char* flags = c->parser.flags;
+    switch (n->op) {
+        case OP_INT:
+            return 0;
+        case OP_ID:
+            return c->symbols.table[n->val].set ? F_VARIABLE
+                                                : F_VARIABLE | F_TRAP;
+        case OP_ASSIGN:
+        case OP_ADD_ASSIGN:
+        case OP_SUB_ASSIGN:
+        case OP_INC:
+        case OP_DEC:
+            return F_WRITE | F_TRAP | F_VARIABLE | flags[n->right];
+        case OP_DIV:
+            // A divisor that is not a nonzero INT may be zero at run time
+            if (pool[n->right].op != OP_INT || pool[n->right].val == 0) {
+                return flags[n->left] | flags[n->right] | F_TRAP;
+            }
+            return flags[n->left] | flags[n->right];
+        default:
+            return flags[n->left] | flags[n->right];
+    }
 }
 
-void optimize(BTNode* node) {
-    if (node->left && node->right && node->left->token_type == INT &&
-        node->right->token_type == INT) {
-        int a = node->left->val, b = node->right->val;
-        switch (node->lexeme[0]) {
-            case '+':
-                node->val = a + b;
-                break;
-            case '-':
-                node->val = a - b;
-                break;
-            case '*':
-                node->val = a * b;
-                break;
-            case '/':
-                if (node->right->val == 0) {
-                    error(DIVZERO);
-                }
-                node->val = a / b;
-                break;
+static unsigned nodeHash(OpType op, int val, int left, int right) {
+    unsigned h = 2166136261u;
+    h = (h ^ op) * 16777619u;
+    h = (h ^ (unsigned)val) * 16777619u;
+    h = (h ^ (unsigned)left) * 16777619u;
+    return (h ^ (unsigned)right) * 16777619u;
+}
 
-            case '&':
-                node->val = a & b;
-                break;
-            case '|':
-                node->val = a | b;
-                break;
-            case '^':
-                node->val = a ^ b;
-                break;
-            default:
-                break;
+// INT nodes are not shared, a constant zero may or may not be DIVZERO
+static int sharable(OpType op) {
+    return op == OP_ID || (op >= OP_ADD && op <= OP_XOR);
+}
+
+// The slot of a node equal to (op, val, left, right), or the empty slot
+// where it goes
+static int* findNode(Parser* p, OpType op, int val, int left, int right) {
+    unsigned mask = p->conscap - 1;
+    for (unsigned i = nodeHash(op, val, left, right) & mask;;
+         i = (i + 1) & mask) {
+        int node = p->cons[i];
+        const BTNode* n = &p->pool[node];
+        if (!node || (node >= p->barrier && node < p->poolsize &&
+                      n->op == op && n->val == val && n->left == left &&
+                      n->right == right)) {
+            return &p->cons[i];
         }
-        freeTree(node->left);
-        freeTree(node->right);
-        node->left = node->right = 0;
-        node->token_type = INT;
     }
 }
 
-void freeTree(BTNode* root) {
-    if (root != NULL) {
-        freeTree(root->left);
-        freeTree(root->right);
-        free(root);
+static void rehashNodes(Compiler* c) {
+    Parser* p = &c->parser;
+    int cap = p->conscap ? p->conscap << 1 : 256;
+    int* cons = (int*)calloc(cap, sizeof(int));
+    if (!cons) {
+        error(c, RUNOUT);
+    }
+    free(p->cons);
+    p->cons = cons;
+    p->conscap = cap;
+    for (int i = p->barrier; i < p->poolsize; i++) {
+        const BTNode* n = &p->pool[i];
+        if (sharable(n->op) && !(p->flags[i] & F_WRITE)) {
+            *findNode(p, n->op, n->val, n->left, n->right) = i;
+        }
     }
 }
 
-// factor := INT | ID |
-//           INCDEC ID |
-//		   	 LPAREN assign_expr RPAREN
-BTNode* factor(void) {
-    BTNode* retp = NULL;
+int makeNode(Compiler* c, OpType op, int val, int left, int right) {
+    Parser* p = &c->parser;
+    BTNode* n;
+    int* slot = NULL;
 
-    if (match(INT)) {
-        retp = makeNode(INT, getLexeme());
-        retp->val = atoi(getLexeme());
-        advance();
-    } else if (match(ID)) {
-        retp = makeNode(ID, getLexeme());
-        advance();
-    } else if (match(INCDEC)) {
-        retp = makeNode(INCDEC, getLexeme());
-        advance();
-        if (match(ID)) {
-            retp->left = makeNode(ID, getLexeme());
-            advance();
-        } else {
-            error(NOTID);
-        }
-    } else if (match(LPAREN)) {
-        advance();
-        retp = assign_expr();
-        if (match(RPAREN))
-            advance();
-        else
-            error(MISPAREN);
-    } else {
-        error(SYNTAXERR);
+    if (sharable(op) && !(left && (p->flags[left] & F_WRITE)) &&
+        !(right && (p->flags[right] & F_WRITE))) {
+        if (2 * p->poolsize >= p->conscap) {
+            rehashNodes(c);
+        }
+        slot = findNode(p, op, val, left, right);
+        if (*slot) {
+            return *slot;
+        }
+    }
+    p->pool = (BTNode*)grow(c, p->pool, &p->poolcap, p->poolsize + 1,
+                            sizeof(BTNode));
+    p->flags = (unsigned char*)grow(c, p->flags, &p->flagcap,
+                                    p->poolsize + 1, 1);
+    n = &p->pool[p->poolsize];
+    n->op = op;
+    n->val = val;
+    n->left = left;
+    n->right = right;
+    p->flags[p->poolsize] = nodeFlags(c, n);
+    if (slot) {
+        *slot = p->poolsize;
+    } else if (p->flags[p->poolsize] & F_WRITE) {
+        // What is read after a write may differ from what was read before
+        p->barrier = p->poolsize + 1;
+    }
+    return p->poolsize++;
+}
+
+// Operator of the current ADDSUB, MULDIV, AND, OR or XOR token
+static OpType binaryOp(Compiler* c) {
+    char ch = *getLexeme(c);
+    if (match(c, AND)) {
+        return OP_AND;
+    } else if (match(c, OR)) {
+        return OP_OR;
+    } else if (match(c, XOR)) {
+        return OP_XOR;
+    }
+    switch (ch) {
+        case '+':
+            return OP_ADD;
+        case '-':
+            return OP_SUB;
+        case '*':
+            return OP_MUL;
+        default:
+            return OP_DIV;
     }
-    return retp;
 }
 
-// unary_expr := ADDSUB unary_expr | factor
-BTNode* unary_expr(void) {
-    BTNode* node = NULL;
-    if (match(ADDSUB)) {
-        node = makeNode(ADDSUB, getLexeme());
-        advance();
-        if (node->lexeme[0] == '+') {
-            return unary_expr();
+// Test if two side-effect free subtrees compute the same value
+static int sameTree(Compiler* c, int a, int b) {
+    Parser* p = &c->parser;
+    const BTNode* pool;
+    int top = 0;
+
+    for (;;) {
+        pool = p->pool;
+        if (a != b) {
+            if (pool[a].op != pool[b].op || pool[a].val != pool[b].val) {
+                return 0;
+            }
+            if (pool[a].left) {
+                p->pairs = (int*)grow(c, p->pairs, &p->paircap, top + 2,
+                                      sizeof(int));
+                p->pairs[top++] = pool[a].right;
+                p->pairs[top++] = pool[b].right;
+                a = pool[a].left;
+                b = pool[b].left;
+                continue;
+            }
         }
-        node->left = makeNode(INT, "0");
-        node->left->val = 0;
-        node->right = unary_expr();
-        optimize(node);
-        return node;
-    } else {
-        return factor();
+        if (top == 0) {
+            return 1;
+        }
+        b = p->pairs[--top];
+        a = p->pairs[--top];
     }
 }
 
-// muldiv_expr := unary_expr muldiv_expr_tail
-BTNode* muldiv_expr(void) {
-    BTNode* node = unary_expr();
-    return muldiv_expr_tail(node);
+// Turn a node whose value is known although it reads variables into an
+// INT, which is not a constant zero for DIVZERO
+static int constant(Compiler* c, int node, int val) {
+    BTNode* n = &c->parser.pool[node];
+    n->op = OP_INT;
+    n->val = val;
+    n->left = n->right = NIL;
+    c->parser.flags[node] = F_VARIABLE;
+    return node;
 }
 
-// muldiv_expr_tail := MULDIV unary_expr muldiv_expr_tail | NiL
-BTNode* muldiv_expr_tail(BTNode* left) {
-    BTNode* node = NULL;
+#define IS_INT(node, v) (pool[node].op == OP_INT && pool[node].val == (v))
 
-    if (match(MULDIV)) {
-        node = makeNode(MULDIV, getLexeme());
-        advance();
-        node->left = left;
-        node->right = unary_expr();
-        optimize(node);
-        return muldiv_expr_tail(node);
-    } else {
-        return left;
+// Apply the algebraic identities to a binary node whose operands are not
+// both INT and return the node that replaces it
+// An operand is dropped only if it neither writes nor traps, an operand
+// that is kept is still evaluated exactly once
+static int simplify(Compiler* c, int node) {
+    const BTNode* pool = c->parser.pool;
+    const unsigned char* flags = c->parser.flags;
+    BTNode* n = &c->parser.pool[node];
+    int left = n->left, right = n->right;
+    int pureLeft = !(flags[left] & (F_WRITE | F_TRAP));
+    int pureRight = !(flags[right] & (F_WRITE | F_TRAP));
+
+    switch (n->op) {
+        case OP_ADD:
+            if (IS_INT(right, 0)) {
+                return left;
+            }
+            if (IS_INT(left, 0)) {
+                return right;
+            }
+            break;
+        case OP_SUB:
+            if (IS_INT(right, 0)) {
+                return left;
+            }
+            if (pureLeft && pureRight && sameTree(c, left, right)) {
+                return constant(c, node, 0);
+            }
+            break;
+        case OP_MUL:
+            if (IS_INT(right, 1)) {
+                return left;
+            }
+            if (IS_INT(left, 1)) {
+                return right;
+            }
+            if ((IS_INT(left, 0) && pureRight) ||
+                (IS_INT(right, 0) && pureLeft)) {
+                return constant(c, node, 0);
+            }
+            break;
+        case OP_DIV:
+            // 0 / x must still divide, x may be zero
+            if (IS_INT(right, 1)) {
+                return left;
+            }
+            break;
+        case OP_AND:
+            if (IS_INT(right, -1)) {
+                return left;
+            }
+            if (IS_INT(left, -1)) {
+                return right;
+            }
+            if ((IS_INT(left, 0) && pureRight) ||
+                (IS_INT(right, 0) && pureLeft)) {
+                return constant(c, node, 0);
+            }
+            if (!(flags[node] & F_WRITE) && sameTree(c, left, right)) {
+                return left;
+            }
+            break;
+        case OP_OR:
+            if (IS_INT(right, 0)) {
+                return left;
+            }
+            if (IS_INT(left, 0)) {
+                return right;
+            }
+            if ((IS_INT(left, -1) && pureRight) ||
+                (IS_INT(right, -1) && pureLeft)) {
+                return constant(c, node, -1);
+            }
+            if (!(flags[node] & F_WRITE) && sameTree(c, left, right)) {
+                return left;
+            }
+            break;
+        case OP_XOR:
+            if (IS_INT(right, 0)) {
+                return left;
+            }
+            if (IS_INT(left, 0)) {
+                return right;
+            }
+            if (pureLeft && pureRight && sameTree(c, left, right)) {
+                return constant(c, node, 0);
+            }
+            break;
+        default:
+            break;
     }
+    return node;
+}
+
+static int optimize(Compiler* c, int node);
+
+// A term of a chain of one operator, split into its variable part e and
+// its constant k: sign * e + k for ADD and SUB, e op k for the others
+// e is NIL if the term is a constant
+typedef struct {
+    int e, sign;
+    unsigned k;
+    int consts;  // INT nodes that the term is made of
+} Term;
+
+static unsigned identity(OpType op) {
+    return op == OP_MUL ? 1 : op == OP_AND ? ~0u : 0;
 }
 
-// addsub_expr := muldiv_expr addsub_expr_tail
-BTNode* addsub_expr(void) {
-    BTNode* node = muldiv_expr();
-    return addsub_expr_tail(node);
+static unsigned combine(OpType op, unsigned a, unsigned b) {
+    switch (op) {
+        case OP_MUL:
+            return a * b;
+        case OP_AND:
+            return a & b;
+        case OP_OR:
+            return a | b;
+        case OP_XOR:
+            return a ^ b;
+        default:
+            return a + b;
+    }
 }
 
-// addsub_expr_tail := ADDSUB muldiv_expr addsub_expr_tail | NiL
-BTNode* addsub_expr_tail(BTNode* left) {
-    BTNode* node = NULL;
+static Term split(Compiler* c, OpType family, int node) {
+    const BTNode* pool = c->parser.pool;
+    const BTNode* n = &pool[node];
+    Term t = {node, 1, identity(family), 0};
 
-    if (match(ADDSUB)) {
-        node = makeNode(ADDSUB, getLexeme());
-        advance();
-        node->left = left;
-        node->right = muldiv_expr();
-        optimize(node);
-        return addsub_expr_tail(node);
-    } else {
-        return left;
+    if (n->op == OP_INT) {
+        t.e = NIL;
+        t.k = n->val;
+        t.consts = 1;
+    } else if (n->op == family || (family == OP_ADD && n->op == OP_SUB)) {
+        if (pool[n->right].op == OP_INT) {
+            t.e = n->left;
+            t.k = n->op == OP_SUB ? -(unsigned)pool[n->right].val
+                                  : (unsigned)pool[n->right].val;
+            t.consts = 1;
+        } else if (pool[n->left].op == OP_INT) {
+            t.e = n->right;
+            t.sign = n->op == OP_SUB ? -1 : 1;
+            t.k = pool[n->left].val;
+            t.consts = 1;
+        }
     }
+    return t;
+}
+
+static int build(Compiler* c, OpType op, int left, int right) {
+    return optimize(c, makeNode(c, op, 0, left, right));
 }
 
-// and_expr := addsub_expr and_expr_tail
-BTNode* and_expr(void) {
-    BTNode* node = addsub_expr();
-    return and_expr_tail(node);
+static int buildInt(Compiler* c, unsigned k) {
+    return makeNode(c, OP_INT, (int)k, NIL, NIL);
 }
 
-// and_expr_tail := AND addsub_expr and_expr_tail | NiL
-BTNode* and_expr_tail(BTNode* left) {
-    BTNode* node = NULL;
+// Move the constants of a chain of ADD and SUB, or of one of MUL, AND,
+// OR and XOR, to its root and fold them there:
+// (a + 1) + 2 -> a + 3, (1 - a) + b -> (b - a) + 1,
+// (2 * a) * b -> (a * b) * 2
+// Every node is built this way, so only the operands can have a
+// constant, at their root, and one level is enough. The variable parts
+// are evaluated in the same order, unless neither of them writes
+static int reassociate(Compiler* c, int node) {
+    const BTNode* pool = c->parser.pool;
+    OpType op = pool[node].op, family = op == OP_SUB ? OP_ADD : op;
+    int left = pool[node].left, right = pool[node].right;
+    int writes, e, sign;
+    Term l, r;
+    unsigned k;
+
+    if (op < OP_ADD || op > OP_XOR || op == OP_DIV) {
+        return node;
+    }
+    l = split(c, family, left);
+    r = split(c, family, right);
+    if (!(l.consts && l.e) && !(r.consts && r.e) && l.consts + r.consts < 2) {
+        return node;
+    }
+    writes = l.e && r.e &&
+             ((c->parser.flags[l.e] | c->parser.flags[r.e]) & F_WRITE);
 
-    if (match(AND)) {
-        node = makeNode(AND, getLexeme());
-        advance();
-        node->left = left;
-        node->right = addsub_expr();
-        optimize(node);
-        return and_expr_tail(node);
+    if (family != OP_ADD) {
+        k = combine(op, l.k, r.k);
+        e = l.e && r.e ? build(c, op, l.e, r.e) : l.e ? l.e : r.e;
+        if (k == identity(op)) {
+            return e;
+        }
+        return build(c, op, e, buildInt(c, k));
+    }
+
+    if (op == OP_SUB) {
+        r.sign = -r.sign;
+        r.k = -r.k;
+    }
+    k = l.k + r.k;
+    if (!r.e) {
+        e = l.e;
+        sign = l.sign;
+    } else if (!l.e) {
+        e = r.e;
+        sign = r.sign;
+    } else if (l.sign > 0) {
+        e = build(c, r.sign > 0 ? OP_ADD : OP_SUB, l.e, r.e);
+        sign = 1;
+    } else if (r.sign < 0) {
+        e = build(c, OP_ADD, l.e, r.e);
+        sign = -1;
+    } else if (!writes) {
+        e = build(c, OP_SUB, r.e, l.e);
+        sign = 1;
+    } else if (r.consts) {
+        // k - l + r, so that l is still evaluated first
+        return build(c, OP_ADD, build(c, OP_SUB, buildInt(c, k), l.e), r.e);
     } else {
-        return left;
+        return node;
+    }
+    if (sign < 0) {
+        return build(c, OP_SUB, buildInt(c, k), e);
+    } else if (k == 0) {
+        return e;
+    } else if ((int)k < 0 && k != 0x80000000u) {
+        return build(c, OP_SUB, e, buildInt(c, -k));
     }
+    return build(c, OP_ADD, e, buildInt(c, k));
 }
 
-// xor_expr := and_expr xor_expr_tail
-BTNode* xor_expr(void) {
-    BTNode* node = and_expr();
-    return xor_expr_tail(node);
+// Whether node is an operation of a chain of family, ADD and SUB for
+// OP_ADD
+static int inChain(const BTNode* pool, OpType family, int node) {
+    return pool[node].op == family ||
+           (family == OP_ADD && pool[node].op == OP_SUB);
 }
 
-// xor_expr_tail := XOR and_expr xor_expr_tail | NiL
-BTNode* xor_expr_tail(BTNode* left) {
-    BTNode* node = NULL;
+// Make a chain left-deep: a + (b - c) -> (a + b) - c,
+// a - (b - c) -> (a - b) + c, a * (b * c) -> (a * b) * c
+// The operands are still evaluated in the same order, even if one of
+// them writes, and the chain needs no more registers than its operands.
+// Only one level is rotated, if b is not a chain itself: the operands
+// were built this way, so a long chain in parentheses is not rebuilt
+// once per term
+static int rotate(Compiler* c, int node) {
+    const BTNode* pool = c->parser.pool;
+    OpType op = pool[node].op, family = op == OP_SUB ? OP_ADD : op;
+    int a = pool[node].left, right = pool[node].right, b, d;
+    OpType inner, outer;
 
-    if (match(XOR)) {
-        node = makeNode(XOR, getLexeme());
-        advance();
-        node->left = left;
-        node->right = and_expr();
-        optimize(node);
-        return xor_expr_tail(node);
-    } else {
-        return left;
+    // k - (b + c) is how reassociate() puts the constant of a chain at
+    // its root, so it stays
+    if (op < OP_ADD || op > OP_XOR || op == OP_DIV || pool[a].op == OP_INT ||
+        !inChain(pool, family, right)) {
+        return node;
     }
+    inner = pool[right].op;
+    b = pool[right].left;
+    d = pool[right].right;
+    if (inChain(pool, family, b)) {
+        return node;
+    }
+    // The sign of c flips if exactly one of the two is a SUB
+    outer = family != OP_ADD ? op : op == inner ? OP_ADD : OP_SUB;
+    return build(c, outer, build(c, op, a, b), d);
+}
+
+// The operand of a negation 0 - e, which unary minus makes, NIL if
+// node is not one
+static int negated(const BTNode* pool, int node) {
+    return pool[node].op == OP_SUB && IS_INT(pool[node].left, 0)
+               ? pool[node].right
+               : NIL;
 }
 
-// or_expr := xor_expr or_expr_tail
-BTNode* or_expr(void) {
-    BTNode* node = xor_expr();
-    return or_expr_tail(node);
+// The INT operand of a MUL, NIL if it has none
+static int factor(const BTNode* pool, int node) {
+    if (pool[node].op != OP_MUL) {
+        return NIL;
+    }
+    return pool[pool[node].right].op == OP_INT  ? pool[node].right
+           : pool[pool[node].left].op == OP_INT ? pool[node].left
+                                                : NIL;
 }
 
-// or_expr_tail := OR xor_expr or_expr_tail | NiL
-BTNode* or_expr_tail(BTNode* left) {
-    BTNode* node = NULL;
+// -e for a MUL e that is cheaper to negate than to compute: one with a
+// negated factor, or by a constant whose negation is cheaper, else NIL
+static int opposite(Compiler* c, int node) {
+    const BTNode* pool = c->parser.pool;
+    int left = pool[node].left, right = pool[node].right;
+    int k = factor(pool, node);
+    unsigned minus;
 
-    if (match(OR)) {
-        node = makeNode(OR, getLexeme());
-        advance();
-        node->left = left;
-        node->right = xor_expr();
-        optimize(node);
-        return or_expr_tail(node);
-    } else {
-        return left;
+    if (pool[node].op != OP_MUL) {
+        return NIL;
+    }
+    if (negated(pool, left)) {
+        return build(c, OP_MUL, negated(pool, left), right);
+    }
+    if (negated(pool, right)) {
+        return build(c, OP_MUL, left, negated(pool, right));
     }
+    if (!k) {
+        return NIL;
+    }
+    minus = -(unsigned)pool[k].val;
+    if (mulCost(c, (int)minus) < mulCost(c, pool[k].val)) {
+        return build(c, OP_MUL, k == right ? left : right,
+                     buildInt(c, minus));
+    }
+    return NIL;
 }
 
-// assign_expr := ID ASSIGN assign_expr | ID ADDSUB_ASSIGN assign_expr | or_expr
-BTNode* assign_expr(void) {
-    BTNode *retp = NULL, *left = or_expr();
-    if (left->token_type == ID) {
-        if (match(ASSIGN)) {
-            retp = makeNode(ASSIGN, getLexeme());
-            retp->left = left;
-            advance();
-            retp->right = assign_expr();
-            return retp;
-        } else if (match(ADDSUB_ASSIGN)) {
-            retp = makeNode(ADDSUB_ASSIGN, getLexeme());
-            retp->left = left;
-            advance();
-            retp->right = assign_expr();
-            return retp;
-        }
-    }
-    return left;
+// a * -k for -(a * k), if that is cheaper than the negation, else NIL
+static int sink(Compiler* c, int a, int k) {
+    int val = c->parser.pool[k].val;
+    unsigned minus = -(unsigned)val;
+    if (mulCost(c, (int)minus) <=
+        COST_MOV_CONST + COST_SUB + mulCost(c, val)) {
+        return build(c, OP_MUL, a, buildInt(c, minus));
+    }
+    return NIL;
 }
 
-// statement := ENDFILE | END | assign_expr END
-void statement(void) {
-    BTNode* retp = NULL;
-
-    if (match(ENDFILE)) {
-        puts("MOV r0 [0]");
-        puts("MOV r1 [4]");
-        puts("MOV r2 [8]");
-        puts("EXIT 0");
-        exit(0);
-    } else if (match(END)) {
-        advance();
-    } else {
-        retp = assign_expr();
-        if (match(END)) {
-            generate_code(retp, 0);
-            freeTree(retp);
-            advance();
-        } else {
-            error(SYNTAXERR);
+// Cancel the negations that unary minus makes, a MOV and a SUB each:
+// a + (-b) * c -> a - b * c, a - (-b) * c -> a + b * c, and so for
+// (-b) * c + a unless a or b writes, as reassociate() does for -b alone
+// (-a) * (-b) -> a * b
+// -(a - b) -> b - a unless a or b writes
+// (-a) * k and -(a * k) -> a * -k if that is cheaper
+// DIV is left alone, -a / b is not -(a / b) for a = INT_MIN
+static int negate(Compiler* c, int node) {
+    const BTNode* pool = c->parser.pool;
+    const unsigned char* flags = c->parser.flags;
+    OpType op = pool[node].op;
+    int left = pool[node].left, right = pool[node].right, k, x;
+
+    if (op == OP_ADD || op == OP_SUB) {
+        if ((x = opposite(c, right))) {
+            return build(c, op == OP_ADD ? OP_SUB : OP_ADD, left, x);
+        }
+        if (op == OP_ADD && !((flags[left] | flags[right]) & F_WRITE) &&
+            (x = opposite(c, left))) {
+            return build(c, OP_SUB, right, x);
+        }
+    }
+    if (op == OP_SUB && IS_INT(left, 0)) {
+        if (pool[right].op == OP_SUB &&
+            !((flags[pool[right].left] | flags[pool[right].right]) &
+              F_WRITE)) {
+            return build(c, OP_SUB, pool[right].right, pool[right].left);
+        }
+        k = factor(pool, right);
+        if (k && (x = sink(c,
+                           k == pool[right].right ? pool[right].left
+                                                  : pool[right].right,
+                           k))) {
+            return x;
+        }
+    } else if (op == OP_MUL) {
+        if (negated(pool, left) && negated(pool, right)) {
+            return build(c, OP_MUL, negated(pool, left),
+                         negated(pool, right));
+        }
+        k = factor(pool, node);
+        x = k == right ? negated(pool, left) : negated(pool, right);
+        if (k && x && (x = sink(c, x, k))) {
+            return x;
         }
     }
+    return node;
 }
 
-void err(ErrorType errorNum) {
-    if (PRINTERR) {
-        fprintf(stderr, "error: ");
-        switch (errorNum) {
-            case MISPAREN:
-                fprintf(stderr, "mismatched parenthesis\n");
+static int optimize(Compiler* c, int node) {
+    BTNode* pool = c->parser.pool;
+    BTNode* n = &pool[node];
+    int reassociated, propagated, simplified, superoptimized;
+    if (n->left && n->right && pool[n->left].op == OP_INT &&
+        pool[n->right].op == OP_INT) {
+        int a = pool[n->left].val, b = pool[n->right].val;
+        // Wrapping around as the machine does, without signed overflow
+        switch (n->op) {
+            case OP_ADD:
+                n->val = (int)((unsigned)a + (unsigned)b);
                 break;
-            case NOTID:
-                fprintf(stderr, "number or identifier expected\n");
-                break;
-            case NOTNUMID:
-                fprintf(stderr, "number or identifier expected\n");
+            case OP_SUB:
+                n->val = (int)((unsigned)a - (unsigned)b);
                 break;
-            case NOTFOUND:
-                fprintf(stderr, "variable not defined\n");
+            case OP_MUL:
+                n->val = (int)((unsigned)a * (unsigned)b);
                 break;
-            case RUNOUT:
-                fprintf(stderr, "out of memory\n");
+            case OP_DIV:
+                if (b == 0) {
+                    // Divides by zero at run time if the divisor only
+                    // became known by simplification, unless the whole
+                    // program is evaluated now
+                    if ((c->parser.flags[node] & F_VARIABLE) &&
+                        !c->opt.eval) {
+                        return node;
+                    }
+                    error(c, DIVZERO);
+                }
+                // INT_MIN / -1 wraps around to INT_MIN, as on the machine
+                n->val = b == -1 ? (int)(0u - (unsigned)a) : a / b;
                 break;
-            case NOTLVAL:
-                fprintf(stderr, "lvalue required as an operand\n");
+            case OP_AND:
+                n->val = a & b;
                 break;
-            case DIVZERO:
-                fprintf(stderr, "divide by constant zero\n");
+            case OP_OR:
+                n->val = a | b;
                 break;
-            case SYNTAXERR:
-                fprintf(stderr, "syntax error\n");
+            case OP_XOR:
+                n->val = a ^ b;
                 break;
             default:
-                fprintf(stderr, "undefined error\n");
-                break;
+                return node;
         }
+        n->left = n->right = NIL;
+        n->op = OP_INT;
+        c->parser.flags[node] &= F_VARIABLE;
+        return node;
+    }
+    reassociated = reassociate(c, node);
+    if (reassociated != node) {
+        return reassociated;
     }
-    printf("EXIT 1");
-    exit(0);
+    propagated = negate(c, node);
+    if (propagated != node) {
+        return propagated;
+    }
+    simplified = simplify(c, node);
+    if (simplified != node) {
+        return simplified;
+    }
+    superoptimized = superoptimize(c, node);
+    if (superoptimized != node) {
+        return superoptimized;
+    }
+    return rotate(c, node);
 }
 
+void freeTree(Compiler* c) {
+    Parser* p = &c->parser;
+    p->poolsize = p->barrier = 1;
+    if (p->cons) {
+        memset(p->cons, 0, p->conscap * sizeof(int));
+    }
+}
+
+// Sethi-Ullman numbers: the registers the subtree of each node needs
+// if its heavier operand is evaluated first. Operands are made before
+// the nodes that use them, so one pass in pool order is enough
+static void labelNodes(Compiler* c) {
+    Parser* p = &c->parser;
+    const BTNode* pool = p->pool;
+    int* label = p->label;
+
+    label[NIL] = 0;
+    for (int i = 1; i < p->poolsize; i++) {
+        int l = label[pool[i].left], r = label[pool[i].right];
+        label[i] = l == r ? l + 1 : l > r ? l : r;
+    }
+}
+
+int linearize(Compiler* c, int root) {
+    Parser* p = &c->parser;
+    const BTNode* pool = p->pool;
+    BTNode* ir;
+    int *placed, *work;
+    int top = 0, irsize = 0;
+
+    p->ir = (BTNode*)grow(c, p->ir, &p->ircap, p->poolsize + 1,
+                          sizeof(BTNode));
+    p->placed = (int*)grow(c, p->placed, &p->placedcap, p->poolsize + 1,
+                           sizeof(int));
+    p->label = (int*)grow(c, p->label, &p->labelcap, p->poolsize + 1,
+                          sizeof(int));
+    p->work = (int*)grow(c, p->work, &p->workcap, 3 * (p->poolsize + 1),
+                         sizeof(int));
+    ir = p->ir;
+    placed = p->placed;
+    work = p->work;
+    memset(placed, 0, p->poolsize * sizeof(int));
+    labelNodes(c);
+    // A node is pushed once to visit its operands, then once negated to
+    // be placed after them. A shared node is pushed by each of its users
+    // but only visited by the first
+    // The operand that needs more registers goes first, so that fewer
+    // values wait in registers, unless one of them writes a variable
+    // that the other may read
+    work[top++] = root;
+    while (top > 0) {
+        int node = work[--top];
+        if (placed[node > 0 ? node : -node]) {
+            continue;
+        } else if (node > 0) {
+            int left = pool[node].left, right = pool[node].right;
+            work[top++] = -node;
+            if (left && right && p->label[right] > p->label[left] &&
+                !((p->flags[left] | p->flags[right]) & F_WRITE)) {
+                work[top++] = left;
+                work[top++] = right;
+            } else {
+                if (right) {
+                    work[top++] = right;
+                }
+                if (left) {
+                    work[top++] = left;
+                }
+            }
+        } else {
+            BTNode* inst = &ir[++irsize];
+            *inst = pool[-node];
+            inst->left = placed[inst->left];
+            inst->right = placed[inst->right];
+            placed[-node] = irsize;
+        }
+    }
+    return p->irsize = irsize;
+}
+
+// Binding power of the binary operators, NEG is unary minus
+#define PREC_NEG 6
+static const int precedence[] = {
+    [OP_OR] = 1,  [OP_XOR] = 2, [OP_AND] = 3,
+    [OP_ADD] = 4, [OP_SUB] = 4, [OP_MUL] = 5, [OP_DIV] = 5,
+};
+
+#define PREC_PAREN -1
+#define PREC_ASSIGN 0
+
+static void pushOperand(Compiler* c, int node) {
+    Parser* p = &c->parser;
+    p->operands = (int*)grow(c, p->operands, &p->operandcap,
+                             p->noperand + 1, sizeof(int));
+    p->operands[p->noperand++] = node;
+}
+
+static void pushOperator(Compiler* c, OpType op, int prec, int sym) {
+    Parser* p = &c->parser;
+    p->operators = (Pending*)grow(c, p->operators, &p->operatorcap,
+                                  p->noperator + 1, sizeof(Pending));
+    p->operators[p->noperator].op = op;
+    p->operators[p->noperator].prec = prec;
+    p->operators[p->noperator++].sym = sym;
+}
+
+// An INT for a value known from a variable, which is not a constant
+// zero for DIVZERO
+int knownInt(Compiler* c, int val) {
+    int node = makeNode(c, OP_INT, val, NIL, NIL);
+    c->parser.flags[node] = F_VARIABLE;
+    return node;
+}
+
+// A read of variable sym, as its value if that is known at this point
+static int readVar(Compiler* c, int sym) {
+    const Symbol* s = &c->symbols.table[sym];
+    return s->known ? knownInt(c, s->value)
+                    : makeNode(c, OP_ID, sym, NIL, NIL);
+}
+
+// Make the node of an assignment, update or INC/DEC of variable sym, as
+// an assignment of the new value if that is known, and record whether
+// sym has a known value after it
+// Nodes are made in the order the program runs, so the value a
+// variable is known to have is the one it has when it is read
+static int writeVar(Compiler* c, OpType op, int sym, int right) {
+    Symbol* s = &c->symbols.table[sym];
+    int node;
+    if (s->known && (op == OP_INC || op == OP_DEC ||
+                     (op != OP_ASSIGN && c->parser.pool[right].op == OP_INT))) {
+        unsigned k = op == OP_INC || op == OP_DEC ? 1
+                                                  : c->parser.pool[right].val;
+        unsigned v = op == OP_INC || op == OP_ADD_ASSIGN ? s->value + k
+                                                         : s->value - k;
+        right = knownInt(c, (int)v);
+        op = OP_ASSIGN;
+    }
+    if (c->opt.eval && op == OP_ASSIGN && c->parser.pool[right].op == OP_INT) {
+        // Only the final values of x, y and z are generated
+        s->known = 1;
+        s->value = c->parser.pool[right].val;
+        return right;
+    }
+    node = makeNode(c, op, sym, NIL, right);
+    s->known = op == OP_ASSIGN && c->parser.pool[right].op == OP_INT;
+    s->value = s->known ? c->parser.pool[right].val : 0;
+    return node;
+}
+
+// Pop the top operator and combine its operands into a node
+static void reduce(Compiler* c) {
+    Parser* p = &c->parser;
+    Pending top = p->operators[--p->noperator];
+    int right = p->operands[--p->noperand];
+    if (top.prec == PREC_ASSIGN) {
+        pushOperand(c, writeVar(c, top.op, top.sym, right));
+    } else {
+        int left = p->operands[--p->noperand];
+        pushOperand(c, optimize(c, makeNode(c, top.op, 0, left, right)));
+    }
+}
+
+// Reduce every operator above the innermost LPAREN or assignment
+static void reduceFrame(Compiler* c) {
+    Parser* p = &c->parser;
+    while (p->noperator > 0 &&
+           p->operators[p->noperator - 1].prec > PREC_ASSIGN) {
+        reduce(c);
+    }
+}
+
+// The operand on top as a read of its variable, once it is known not to
+// be assigned: a variable is kept as an ID until then, also inside
+// parentheses, as in "(a) = 3"
+static void readTop(Compiler* c) {
+    Parser* p = &c->parser;
+    int* top = &p->operands[p->noperand - 1];
+    if (p->pool[*top].op == OP_ID) {
+        *top = readVar(c, p->pool[*top].val);
+    }
+}
+
+// Reduce everything above the innermost LPAREN, which is left in place
+static void reduceParen(Compiler* c) {
+    Parser* p = &c->parser;
+    while (p->noperator > 0 &&
+           p->operators[p->noperator - 1].prec != PREC_PAREN) {
+        reduce(c);
+    }
+}
+
+// assign_expr := ID ASSIGN assign_expr | ID ADDSUB_ASSIGN assign_expr | or_expr
+// or_expr     := xor_expr { OR xor_expr }
+// xor_expr    := and_expr { XOR and_expr }
+// and_expr    := addsub_expr { AND addsub_expr }
+// addsub_expr := muldiv_expr { ADDSUB muldiv_expr }
+// muldiv_expr := unary_expr { MULDIV unary_expr }
+// unary_expr  := ADDSUB unary_expr | factor
+// factor      := INT | ID | INCDEC ID | LPAREN assign_expr RPAREN
+//
+// Parsed by operator precedence with explicit stacks, so neither long nor
+// deeply nested lines use native stack. The trees are the ones the
+// recursive descent parser built: left-associative binary operators,
+// right-associative assignments, and unary minus as 0 - operand.
+int assign_expr(Compiler* c) {
+    Parser* p = &c->parser;
+    int depth = 0;
+
+    p->noperand = p->noperator = 0;
+    while (1) {
+        // An operand, after any prefix operators
+        if (match(c, ADDSUB)) {
+            if (*getLexeme(c) == '-') {
+                pushOperand(c, makeNode(c, OP_INT, 0, NIL, NIL));
+                pushOperator(c, OP_SUB, PREC_NEG, 0);
+            }
+            advance(c);
+            continue;
+        } else if (match(c, LPAREN)) {
+            pushOperator(c, OP_INT, PREC_PAREN, 0);
+            depth++;
+            advance(c);
+            continue;
+        } else if (match(c, INT)) {
+            pushOperand(c, makeNode(c, OP_INT, getValue(c), NIL, NIL));
+        } else if (match(c, ID)) {
+            pushOperand(c, makeNode(c, OP_ID, getSymbol(c), NIL, NIL));
+        } else if (match(c, INCDEC)) {
+            OpType op = *getLexeme(c) == '+' ? OP_INC : OP_DEC;
+            advance(c);
+            if (!match(c, ID)) {
+                error(c, NOTID);
+            }
+            pushOperand(c, writeVar(c, op, getSymbol(c), NIL));
+        } else {
+            error(c, SYNTAXERR);
+        }
+        advance(c);
+
+        // Then operators that follow it
+        while (1) {
+            if (match(c, RPAREN) && depth > 0) {
+                if (p->operators[p->noperator - 1].prec != PREC_PAREN) {
+                    readTop(c);
+                }
+                reduceParen(c);
+                p->noperator--;
+                depth--;
+                advance(c);
+            } else if (match(c, ASSIGN) || match(c, ADDSUB_ASSIGN)) {
+                OpType op = match(c, ASSIGN) ? OP_ASSIGN
+                            : *getLexeme(c) == '+' ? OP_ADD_ASSIGN
+                                                   : OP_SUB_ASSIGN;
+                int target;
+                reduceFrame(c);
+                target = p->operands[p->noperand - 1];
+                if (p->pool[target].op != OP_ID) {
+                    error(c, depth ? MISPAREN : SYNTAXERR);
+                }
+                p->noperand--;
+                pushOperator(c, op, PREC_ASSIGN, p->pool[target].val);
+                advance(c);
+                break;
+            } else if (match(c, ADDSUB) || match(c, MULDIV) ||
+                       match(c, AND) || match(c, OR) || match(c, XOR)) {
+                OpType op = binaryOp(c);
+                int prec = precedence[op];
+                readTop(c);
+                while (p->noperator > 0 &&
+                       p->operators[p->noperator - 1].prec >= prec) {
+                    reduce(c);
+                }
+                pushOperator(c, op, prec, 0);
+                advance(c);
+                break;
+            } else {
+                if (depth > 0) {
+                    error(c, MISPAREN);
+                }
+                readTop(c);
+                while (p->noperator > 0) {
+                    reduce(c);
+                }
+                return p->operands[--p->noperand];
+            }
+        }
+    }
+}
+
+// Append ir[1..n] to the program
+static void keepStatement(Compiler* c, int n) {
+    Parser* p = &c->parser;
+    p->prog = (BTNode*)grow(c, p->prog, &p->progcap, p->progsize + n + 1,
+                            sizeof(BTNode));
+    p->stmts = (int*)grow(c, p->stmts, &p->stmtcap, p->nstmt + 2,
+                          sizeof(int));
+    memcpy(p->prog + p->progsize + 1, p->ir + 1, n * sizeof(BTNode));
+    p->stmts[p->nstmt] = p->progsize;
+    p->progsize += n;
+    p->stmts[++p->nstmt] = p->progsize;
+}
+
+// statement := ENDFILE | END | assign_expr END
+int statement(Compiler* c) {
+    int retp = NIL, n;
+
+    if (match(c, ENDFILE)) {
+        generate_program(c);
+        return 0;
+    } else if (match(c, END)) {
+        advance(c);
+    } else {
+        retp = assign_expr(c);
+        if (match(c, END)) {
+            n = linearize(c, retp);
+            bind_vars(c, c->parser.ir, n);
+            keepStatement(c, n);
+            freeTree(c);
+            advance(c);
+        } else {
+            error(c, SYNTAXERR);
+        }
+    }
+    return 1;
+}
+
+void freeParser(Parser* p) {
+    free(p->pool);
+    free(p->flags);
+    free(p->ir);
+    free(p->placed);
+    free(p->label);
+    free(p->work);
+    free(p->operands);
+    free(p->operators);
+    free(p->pairs);
+    free(p->cons);
+    free(p->prog);
+    free(p->stmts);
+}
+
+void err(Compiler* c, ErrorType errorNum) {
+    if (PRINTERR) {
+        fprintf(stderr, "error: ");
+        switch (errorNum) {
+            case MISPAREN:
+                fprintf(stderr, "mismatched parenthesis\n");
+                break;
+            case NOTID:
+                fprintf(stderr, "number or identifier expected\n");
+                break;
+            case NOTNUMID:
+                fprintf(stderr, "number or identifier expected\n");
+                break;
+            case NOTFOUND:
+                fprintf(stderr, "variable not defined\n");
+                break;
+            case RUNOUT:
+                fprintf(stderr, "out of memory\n");
+                break;
+            case NOTLVAL:
+                fprintf(stderr, "lvalue required as an operand\n");
+                break;
+            case DIVZERO:
+                fprintf(stderr, "divide by constant zero\n");
+                break;
+            case SYNTAXERR:
+                fprintf(stderr, "syntax error\n");
+                break;
+            default:
+                fprintf(stderr, "undefined error\n");
+                break;
+        }
+    }
+    emit(c, "EXIT 1");
+    longjmp(c->fail, errorNum);
+}
+
+
+
+/*============================================================================================
+codeGen implementation
+============================================================================================*/
+
+
+static unsigned hash(const char* name, int len) {
+    unsigned h = 2166136261u;
+    for (int i = 0; i < len; i++) {
+        h = (h ^ (unsigned char)name[i]) * 16777619u;
+    }
+    return h;
+}
+
+static int* find_slot(SymbolTable* st, const char* name, int len,
+                      unsigned h) {
+    for (int i = h & (st->slotcap - 1);; i = (i + 1) & (st->slotcap - 1)) {
+        int sym = st->slots[i] - 1;
+        if (sym < 0 ||
+            (st->table[sym].len == len &&
+             memcmp(st->names + st->table[sym].name, name, len) == 0)) {
+            return &st->slots[i];
+        }
+    }
+}
+
+static void rehash(Compiler* c) {
+    SymbolTable* st = &c->symbols;
+    int cap = st->slotcap ? st->slotcap << 1 : 64;
+    int* slots = (int*)calloc(cap, sizeof(int));
+    if (!slots) {
+        error(c, RUNOUT);
+    }
+    free(st->slots);
+    st->slots = slots;
+    st->slotcap = cap;
+    for (int i = 0; i < st->count; i++) {
+        const char* name = st->names + st->table[i].name;
+        *find_slot(st, name, st->table[i].len, hash(name, st->table[i].len)) =
+            i + 1;
+    }
+}
+
+static void cache(Compiler* c, int sym, int r);
+
+// Forget what the registers hold, as at the start of the program
+static void resetRegs(Compiler* c) {
+    for (int r = 0; r < 8; r++) {
+        c->codegen.cached[r] = -1;
+    }
+    for (int sym = 0; sym < c->symbols.count; sym++) {
+        c->symbols.table[sym].reg = -1;
+    }
+    // x, y and z are in their registers from the start, but their initial
+    // values are only loaded when needed
+    c->codegen.first = c->opt.pin ? 3 : 0;
+    c->codegen.loaded = 0;
+    c->codegen.nslot = c->codegen.nfree = 0;
+    for (int sym = 0; sym < c->codegen.first; sym++) {
+        cache(c, sym, sym);
+    }
+}
+
+void initTable(Compiler* c) {
+    SymbolTable* st = &c->symbols;
+    st->count = st->namelen = 0;
+    if (st->slots) {
+        memset(st->slots, 0, st->slotcap * sizeof(int));
+    }
+    intern(c, "x", 1);
+    intern(c, "y", 1);
+    intern(c, "z", 1);
+    for (int sym = 0; sym < 3; sym++) {
+        st->table[sym].addr = sym << 2;
+        st->table[sym].set = 1;
+    }
+    resetRegs(c);
+    for (int sym = 0; sym < 3 && c->opt.eval; sym++) {
+        st->table[sym].known = 1;
+        st->table[sym].value = c->opt.mem[sym];
+    }
+}
+
+int intern(Compiler* c, const char* name, int len) {
+    SymbolTable* st = &c->symbols;
+    unsigned h = hash(name, len);
+    int* slot;
+
+    if (2 * (st->count + 1) > st->slotcap) {
+        rehash(c);
+    }
+    slot = find_slot(st, name, len, h);
+    if (*slot) {
+        return *slot - 1;
+    }
+    st->table = (Symbol*)grow(c, st->table, &st->cap, st->count + 1,
+                              sizeof(Symbol));
+    st->names = (char*)grow(c, st->names, &st->namecap, st->namelen + len, 1);
+    memcpy(st->names + st->namelen, name, len);
+    st->table[st->count].name = st->namelen;
+    st->table[st->count].len = len;
+    st->table[st->count].addr = -1;
+    st->table[st->count].set = 0;
+    st->table[st->count].reg = -1;
+    st->table[st->count].known = 0;
+    st->table[st->count].value = 0;
+    st->namelen += len;
+    *slot = st->count + 1;
+    return st->count++;
+}
+
+int get_addr(Compiler* c, int sym) {
+    return c->symbols.table[sym].addr;
+}
+
+void bind_vars(Compiler* c, const BTNode* code, int n) {
+    Symbol* table = c->symbols.table;
+    for (int i = 1; i <= n; i++) {
+        switch (code[i].op) {
+            case OP_ID:
+            case OP_ADD_ASSIGN:
+            case OP_SUB_ASSIGN:
+            case OP_INC:
+            case OP_DEC:
+                if (!table[code[i].val].set) {
+                    error(c, NOTFOUND);
+                }
+                break;
+            case OP_ASSIGN:
+                table[code[i].val].set = 1;
+                break;
+            default:
+                break;
+        }
+    }
+}
+
+void freeSymbols(SymbolTable* st) {
+    free(st->table);
+    free(st->slots);
+    free(st->names);
+}
+
+// Instruction of each binary operator, and MOV for a step of a chain
+static const Opcode opcodes[] = {
+    [OP_ADD] = I_ADD, [OP_SUB] = I_SUB, [OP_MUL] = I_MUL, [OP_DIV] = I_DIV,
+    [OP_AND] = I_AND, [OP_OR] = I_OR,   [OP_XOR] = I_XOR,
+    [OP_ADD_ASSIGN] = I_ADD, [OP_SUB_ASSIGN] = I_SUB,
+    [OP_INC] = I_ADD, [OP_DEC] = I_SUB, [OP_ASSIGN] = I_MOV,
+};
+
+// What MOV k and MUL cost, which a chain has to beat
+#define MUL_BUDGET (COST_MOV_CONST + COST_MUL)
+
+static void addChain(CodeGen* g, unsigned k, int cost, const MulStep* step,
+                     int n) {
+    MulChain* chain = NULL;
+    for (int i = 0; i < g->nchain; i++) {
+        if (g->chains[i].k == (int)k) {
+            chain = &g->chains[i];
+        }
+    }
+    if (!chain) {
+        if (g->nchain == MULCHAINS) {
+            return;
+        }
+        chain = &g->chains[g->nchain++];
+        chain->k = (int)k;
+    } else if (chain->cost <= cost) {
+        return;
+    }
+    chain->cost = cost;
+    chain->n = n;
+    memcpy(chain->step, step, n * sizeof(MulStep));
+}
+
+// Try every chain of up to MULSTEPS steps under MUL_BUDGET
+// val[0] and val[1] are the multiples of the operand in the two
+// registers, the scratch register is unknown until written
+static void searchChains(CodeGen* g, unsigned val[2], int known, int cost,
+                         MulStep* step, int n) {
+    static const MulStep moves[] = {
+        {OP_ASSIGN, 1, 0}, {OP_ASSIGN, 0, 1}, {OP_ADD, 0, 0}, {OP_ADD, 0, 1},
+        {OP_ADD, 1, 0},    {OP_ADD, 1, 1},    {OP_SUB, 0, 0}, {OP_SUB, 0, 1},
+        {OP_SUB, 1, 0},    {OP_SUB, 1, 1},
+    };
+
+    addChain(g, val[0], cost, step, n);
+    if (n == MULSTEPS) {
+        return;
+    }
+    for (size_t i = 0; i < sizeof(moves) / sizeof(moves[0]); i++) {
+        MulStep m = moves[i];
+        unsigned next[2] = {val[0], val[1]};
+        int more;
+        if ((m.src == 1 && !known) ||
+            (m.op != OP_ASSIGN && m.dst == 1 && !known)) {
+            continue;
+        }
+        if (m.op == OP_ASSIGN) {
+            next[m.dst] = val[m.src];
+            more = COST_MOV_REG;
+        } else if (m.op == OP_ADD) {
+            next[m.dst] = val[m.dst] + val[m.src];
+            more = COST_ADD;
+        } else {
+            next[m.dst] = val[m.dst] - val[m.src];
+            more = COST_SUB;
+        }
+        if (cost + more < MUL_BUDGET) {
+            step[n] = m;
+            searchChains(g, next, known || m.dst == 1, cost + more, step,
+                         n + 1);
+        }
+    }
+}
+
+// The chain for a MUL by k, NULL if MUL is cheaper
+static const MulChain* findChain(CodeGen* g, int k) {
+    if (!g->nchain) {
+        unsigned val[2] = {1, 0};
+        MulStep step[MULSTEPS];
+        searchChains(g, val, 0, 0, step, 0);
+    }
+    for (int i = 0; i < g->nchain; i++) {
+        if (g->chains[i].k == k) {
+            return &g->chains[i];
+        }
+    }
+    return NULL;
+}
+
+// The chain for a MUL whose operand *k is an INT, NULL if MUL is cheaper
+// *x is set to the other operand
+static const MulChain* mulChain(Compiler* c, const BTNode* code,
+                                const BTNode* inst, int* k, int* x) {
+    CodeGen* g = &c->codegen;
+
+    if (inst->op != OP_MUL) {
+        return NULL;
+    }
+    if (code[inst->right].op == OP_INT) {
+        *k = inst->right;
+        *x = inst->left;
+    } else if (code[inst->left].op == OP_INT) {
+        *k = inst->left;
+        *x = inst->right;
+    } else {
+        return NULL;
+    }
+    return findChain(g, code[*k].val);
+}
+
+int mulCost(Compiler* c, int k) {
+    const MulChain* chain = findChain(&c->codegen, k);
+    return chain ? chain->cost : MUL_BUDGET;
+}
+
+// The value of an operand, an ASSIGN has the value it stores and an ID
+// may be a value that is already in a register
+static int value(const CodeGen* g, const BTNode* code, int i) {
+    while (code[i].op == OP_ASSIGN || g->alias[i]) {
+        i = code[i].op == OP_ASSIGN ? code[i].right : g->alias[i];
+    }
+    return i;
+}
+
+// The first instruction from code[at] on that uses value v, or
+// at + LOOKAHEAD if none is that close
+static int nextUse(const CodeGen* g, const BTNode* code, int n, int at,
+                   int v) {
+    int end = n - at < LOOKAHEAD ? n : at + LOOKAHEAD - 1;
+    for (int i = at; i <= end; i++) {
+        if ((code[i].left && value(g, code, code[i].left) == v) ||
+            (code[i].right && value(g, code, code[i].right) == v)) {
+            return i;
+        }
+    }
+    return at + LOOKAHEAD;
+}
+
+// Forget the variables cached in register r, which is about to change
+static void clobber(Compiler* c, int r) {
+    Symbol* table = c->symbols.table;
+    for (int sym = c->codegen.cached[r]; sym >= 0; sym = table[sym].next) {
+        table[sym].reg = -1;
+    }
+    c->codegen.cached[r] = -1;
+}
+
+// Note that register r holds the value of variable sym, which no other
+// register does any more
+static void cache(Compiler* c, int sym, int r) {
+    Symbol* table = c->symbols.table;
+    CodeGen* g = &c->codegen;
+    if (table[sym].reg >= 0) {
+        int* link = &g->cached[table[sym].reg];
+        while (*link != sym) {
+            link = &table[*link].next;
+        }
+        *link = table[sym].next;
+    }
+    table[sym].reg = r;
+    table[sym].next = g->cached[r];
+    g->cached[r] = sym;
+    g->stamp[r] = ++g->clock;
+}
+
+// A register that holds neither a value nor a variable, -1 if none
+static int freeReg(const CodeGen* g) {
+    for (int r = g->first; r < 8; r++) {
+        if (!g->owner[r] && g->cached[r] < 0) {
+            return r;
+        }
+    }
+    return -1;
+}
+
+static int cachedCount(Compiler* c, int r) {
+    int count = 0;
+    for (int sym = c->codegen.cached[r]; sym >= 0;
+         sym = c->symbols.table[sym].next) {
+        count++;
+    }
+    return count;
+}
+
+// A register without a value that caches fewer variables than register
+// than, which are cheaper to lose, -1 if none
+static int spareReg(Compiler* c, int than) {
+    CodeGen* g = &c->codegen;
+    int best = -1, bestCount = cachedCount(c, than);
+    for (int r = g->first; r < 8; r++) {
+        if (r != than && !g->owner[r]) {
+            int count = cachedCount(c, r);
+            if (count < bestCount ||
+                (count == bestCount && best >= 0 &&
+                 g->stamp[r] < g->stamp[best])) {
+                best = r;
+                bestCount = count;
+            }
+        }
+    }
+    return best;
+}
+
+// What it costs to take the register of value v and get it back: an INT
+// is made again, a value that was spilled is still in its slot, any
+// other value is stored first
+static int evictCost(const CodeGen* g, const BTNode* code, int v) {
+    return code[v].op == OP_INT ? COST_MOV_CONST
+           : g->spill[v] >= 0   ? COST_LOAD
+                                : COST_STORE + COST_LOAD;
+}
+
+// A free spill slot, one of a dead value if there is one
+static int takeSlot(Compiler* c) {
+    CodeGen* g = &c->codegen;
+    if (g->nfree) {
+        return g->freeslot[--g->nfree];
+    }
+    // Memory below the slots holds x, y and z
+    if (3 + g->nslot == MEMSIZE / 4) {
+        error(c, RUNOUT);
+    }
+    return MEMSIZE - 4 * ++g->nslot;
+}
+
+// Get a register to write for the instruction at. If all are taken,
+// drop the variable used longest ago, which costs a load if it is read
+// again, or else spill the value whose next use is furthest for what it
+// costs to get it back. The values in pin[] are never spilled
+static int takeReg(Compiler* c, const BTNode* code, int n, int at) {
+    CodeGen* g = &c->codegen;
+    int victim = freeReg(g), far = 0, cost = 1;
+
+    if (victim >= 0) {
+        return victim;
+    }
+    for (int r = g->first; r < 8; r++) {
+        if (!g->owner[r] && (victim < 0 || g->stamp[r] < g->stamp[victim])) {
+            victim = r;
+        }
+    }
+    if (victim >= 0) {
+        clobber(c, victim);
+        return victim;
+    }
+    for (int r = g->first; r < 8; r++) {
+        int v = g->owner[r], next, more;
+        if (v == g->pin[0] || v == g->pin[1] || v == g->pin[2]) {
+            continue;
+        }
+        next = nextUse(g, code, n, at, v) - at;
+        more = evictCost(g, code, v);
+        if ((long)next * cost > (long)far * more) {
+            victim = r;
+            far = next;
+            cost = more;
+        }
+    }
+    // A value already spilled is still in its slot, values never change
+    if (code[g->owner[victim]].op != OP_INT && g->spill[g->owner[victim]] < 0) {
+        g->spill[g->owner[victim]] = takeSlot(c);
+        put(c, I_MOV, A_ADDR, g->spill[g->owner[victim]], A_REG, victim);
+    }
+    g->regs[g->owner[victim]] = -1;
+    g->owner[victim] = 0;
+    clobber(c, victim);
+    return victim;
+}
+
+// Get the register of value v, reloading it if it was spilled
+static int load(Compiler* c, const BTNode* code, int n, int at, int v) {
+    CodeGen* g = &c->codegen;
+    if (g->regs[v] < 0) {
+        int r = takeReg(c, code, n, at);
+        if (code[v].op == OP_INT) {
+            put(c, I_MOV, A_REG, r, A_CONST, code[v].val);
+        } else {
+            put(c, I_MOV, A_REG, r, A_ADDR, g->spill[v]);
+        }
+        g->regs[v] = r;
+        g->owner[r] = v;
+    }
+    return g->regs[v];
+}
+
+// Put value v in register r
+static void define(CodeGen* g, int v, int r) {
+    g->regs[v] = r;
+    g->owner[r] = v;
+}
+
+// Free the register and the spill slot of value v, which is dead
+static void retire(CodeGen* g, int v) {
+    if (g->regs[v] >= 0) {
+        g->owner[g->regs[v]] = 0;
+        g->regs[v] = -1;
+    }
+    if (g->spill[v] >= 0) {
+        g->freeslot[g->nfree++] = g->spill[v];
+        g->spill[v] = -1;
+    }
+}
+
+// Count a use of value v, and free it after the last one
+static void drop(CodeGen* g, int v) {
+    if (--g->uses[v] == 0) {
+        retire(g, v);
+    }
+}
+
+// Load the initial value of a pinned variable, unless it was already
+static void loadPinned(Compiler* c, int sym) {
+    if (!(c->codegen.loaded & 1 << sym)) {
+        put(c, I_MOV, A_REG, sym, A_ADDR, get_addr(c, sym));
+        c->codegen.loaded |= 1 << sym;
+    }
+}
+
+// Move the value in the register of a pinned variable to another
+// register, before the variable changes
+static void vacate(Compiler* c, const BTNode* code, int n, int at, int r) {
+    CodeGen* g = &c->codegen;
+    int v = g->owner[r];
+    if (v) {
+        int to = takeReg(c, code, n, at);
+        put(c, I_MOV, A_REG, to, A_REG, r);
+        g->owner[r] = 0;
+        define(g, v, to);
+    }
+}
+
+// The register of the pinned variable that instruction at is assigned
+// to right away, if at can compute its value there, else -1
+static int target(Compiler* c, const BTNode* code, int n, int at) {
+    const CodeGen* g = &c->codegen;
+    int r;
+    if (at == n || code[at + 1].op != OP_ASSIGN ||
+        code[at + 1].right != at || code[at + 1].val >= g->first) {
+        return -1;
+    }
+    r = code[at + 1].val;
+    return g->owner[r] ? -1 : r;
+}
+
+// Get the register for instruction at, which updates variable sym, with
+// the old value of sym in it
+static int updateReg(Compiler* c, const BTNode* code, int n, int at,
+                     int sym) {
+    CodeGen* g = &c->codegen;
+    int r = c->symbols.table[sym].reg, use_reg;
+
+    if (sym < g->first) {
+        loadPinned(c, sym);
+        vacate(c, code, n, at, sym);
+        clobber(c, sym);
+        define(g, at, sym);
+        return sym;
+    }
+    if (r >= g->first && !g->owner[r]) {
+        clobber(c, r);
+        define(g, at, r);
+        return r;
+    }
+    if (r >= 0) {
+        g->pin[0] = g->owner[r];
+    }
+    define(g, at, use_reg = takeReg(c, code, n, at));
+    if (r >= 0) {
+        put(c, I_MOV, A_REG, use_reg, A_REG, r);
+    } else {
+        put(c, I_MOV, A_REG, use_reg, A_ADDR, get_addr(c, sym));
+    }
+    return use_reg;
+}
+
+// Whether instruction at can put its result in register r of an
+// operand: if this is the last use of the operand and r does not hold
+// more variables than another register would lose; a pinned variable
+// only gives its register to its own new value
+static int reusable(Compiler* c, const BTNode* code, int n, int at, int dies,
+                    int r) {
+    const CodeGen* g = &c->codegen;
+    if (!dies) {
+        return 0;
+    }
+    if (r < g->first) {
+        return at < n && code[at + 1].op == OP_ASSIGN &&
+               code[at + 1].right == at && code[at + 1].val == r;
+    }
+    return g->cached[r] < 0 || spareReg(c, r) < 0;
+}
+
+void generate_code(Compiler* c, const BTNode* code, int n) {
+    CodeGen* g = &c->codegen;
+    const MulChain* chain;
+    int i, k, x;
+
+    g->regs = (int*)grow(c, g->regs, &g->regcap, n + 1, sizeof(int));
+    g->uses = (int*)grow(c, g->uses, &g->usecap, n + 1, sizeof(int));
+    g->spill = (int*)grow(c, g->spill, &g->spillcap, n + 1, sizeof(int));
+    g->alias = (int*)grow(c, g->alias, &g->aliascap, n + 1, sizeof(int));
+    memset(g->owner, 0, sizeof(g->owner));
+    g->nslot = g->nfree = 0;
+
+    // A shared value is used by each of its users
+    // The constant of a MUL done as a chain is never loaded
+    for (i = 1; i <= n; i++) {
+        g->regs[i] = g->spill[i] = -1;
+        g->uses[i] = g->alias[i] = 0;
+    }
+    for (i = 1; i <= n; i++) {
+        const BTNode* inst = &code[i];
+        if ((chain = mulChain(c, code, inst, &k, &x))) {
+            g->uses[value(g, code, x)]++;
+        } else {
+            if (inst->left) {
+                g->uses[value(g, code, inst->left)]++;
+            }
+            if (inst->right) {
+                g->uses[value(g, code, inst->right)]++;
+            }
+        }
+    }
+
+    for (i = 1; i <= n; i++) {
+        const BTNode* inst = &code[i];
+        int left = inst->left ? value(g, code, inst->left) : NIL;
+        int right = inst->right ? value(g, code, inst->right) : NIL;
+        int use_reg, src, scratch, dies, into;
+
+        g->pin[0] = left;
+        g->pin[1] = right;
+        g->pin[2] = i;
+        switch (inst->op) {
+            case OP_ID:
+                // A variable still in a register is not loaded again
+                // or is the value that holds it
+                if (inst->val < g->first) {
+                    loadPinned(c, inst->val);
+                }
+                src = c->symbols.table[inst->val].reg;
+                if (src >= 0 && !g->owner[src]) {
+                    define(g, i, src);
+                    g->stamp[src] = ++g->clock;
+                } else if (src >= 0) {
+                    g->alias[i] = g->owner[src];
+                    g->uses[g->owner[src]] += g->uses[i];
+                    g->stamp[src] = ++g->clock;
+                    continue;
+                } else {
+                    use_reg = target(c, code, n, i);
+                    if (use_reg < 0) {
+                        use_reg = takeReg(c, code, n, i);
+                    }
+                    clobber(c, use_reg);
+                    define(g, i, use_reg);
+                    put(c, I_MOV, A_REG, use_reg, A_ADDR,
+                        get_addr(c, inst->val));
+                    cache(c, inst->val, use_reg);
+                }
+                break;
+            case OP_INT:
+                if (!g->uses[i] && i != n) {
+                    continue;
+                }
+                use_reg = target(c, code, n, i);
+                if (use_reg < 0) {
+                    use_reg = takeReg(c, code, n, i);
+                }
+                clobber(c, use_reg);
+                define(g, i, use_reg);
+                put(c, I_MOV, A_REG, use_reg, A_CONST, inst->val);
+                break;
+            case OP_ASSIGN:
+                use_reg = load(c, code, n, i, right);
+                if (inst->val < g->first) {
+                    // A pinned variable is never stored
+                    if (use_reg != inst->val) {
+                        vacate(c, code, n, i, inst->val);
+                        clobber(c, inst->val);
+                        put(c, I_MOV, A_REG, inst->val, A_REG, use_reg);
+                    }
+                    g->loaded |= 1 << inst->val;
+                    cache(c, inst->val, inst->val);
+                } else {
+                    put(c, I_MOV, A_ADDR, get_addr(c, inst->val), A_REG,
+                        use_reg);
+                    cache(c, inst->val, use_reg);
+                }
+                drop(g, right);
+                continue;
+            case OP_ADD_ASSIGN:
+            case OP_SUB_ASSIGN:
+                load(c, code, n, i, right);
+                use_reg = updateReg(c, code, n, i, inst->val);
+                // The operand may have been moved out of a pinned register
+                src = load(c, code, n, i, right);
+                put(c, opcodes[inst->op], A_REG, use_reg, A_REG, src);
+                if (inst->val >= g->first) {
+                    put(c, I_MOV, A_ADDR, get_addr(c, inst->val), A_REG,
+                        use_reg);
+                }
+                cache(c, inst->val, use_reg);
+                drop(g, right);
+                break;
+            case OP_INC:
+            case OP_DEC:
+                use_reg = updateReg(c, code, n, i, inst->val);
+                scratch = takeReg(c, code, n, i);
+                put(c, I_MOV, A_REG, scratch, A_CONST, 1);
+                put(c, opcodes[inst->op], A_REG, use_reg, A_REG, scratch);
+                if (inst->val >= g->first) {
+                    put(c, I_MOV, A_ADDR, get_addr(c, inst->val), A_REG,
+                        use_reg);
+                }
+                cache(c, inst->val, use_reg);
+                break;
+            default:
+                chain = mulChain(c, code, inst, &k, &x);
+                if (chain) {
+                    left = value(g, code, x);
+                    right = g->pin[1] = NIL;
+                }
+                use_reg = load(c, code, n, i, left);
+                src = right ? load(c, code, n, i, right) : -1;
+                // Operands of ADD, MUL, AND, OR and XOR can be swapped, so
+                // that the result goes to the register of the right one
+                dies = g->uses[left] == (left == right ? 2 : 1);
+                if (!chain && right != left && inst->op != OP_SUB &&
+                    inst->op != OP_DIV &&
+                    !reusable(c, code, n, i, dies, use_reg) &&
+                    reusable(c, code, n, i, g->uses[right] == 1, src)) {
+                    int t = left;
+                    left = right;
+                    right = t;
+                    src = use_reg;
+                    use_reg = g->regs[left];
+                    dies = 1;
+                }
+                into = target(c, code, n, i);
+                if (reusable(c, code, n, i, dies, use_reg)) {
+                    clobber(c, use_reg);
+                    g->regs[left] = -1;
+                } else {
+                    int copy = into >= 0 ? into
+                               : dies && use_reg >= g->first
+                                   ? spareReg(c, use_reg)
+                                   : takeReg(c, code, n, i);
+                    clobber(c, copy);
+                    put(c, I_MOV, A_REG, copy, A_REG, use_reg);
+                    use_reg = copy;
+                }
+                define(g, i, use_reg);
+                if (chain) {
+                    int reg[2] = {use_reg, -1};
+                    for (int j = 0; j < chain->n; j++) {
+                        const MulStep* step = &chain->step[j];
+                        if (reg[1] < 0 && (step->dst || step->src)) {
+                            reg[1] = takeReg(c, code, n, i);
+                        }
+                        put(c, opcodes[step->op], A_REG, reg[step->dst], A_REG,
+                            reg[step->src]);
+                    }
+                } else {
+                    put(c, opcodes[inst->op], A_REG, use_reg, A_REG, src);
+                }
+                drop(g, left);
+                if (right) {
+                    drop(g, right);
+                }
+                break;
+        }
+        // A value nobody uses, like the root, is not kept
+        if (!g->uses[i]) {
+            retire(g, i);
+        }
+    }
+}
+
+static void generate_exit(Compiler* c) {
+    for (int sym = 0; sym < 3; sym++) {
+        const Symbol* s = &c->symbols.table[sym];
+        // With eval every variable is known, unless a statement that
+        // writes it was left to run time, and then it is where the
+        // generated code keeps it
+        if (c->opt.eval && s->known) {
+            put(c, I_MOV, A_REG, sym, A_CONST, s->value);
+        } else if (c->opt.pin) {
+            loadPinned(c, sym);
+        } else {
+            put(c, I_MOV, A_REG, sym, A_ADDR, get_addr(c, sym));
+        }
+    }
+    put(c, I_EXIT, A_CONST, 0, A_CONST, 0);
+}
+
+// Mark the instructions of statement s that are kept, from the variables
+// that are live after it, and leave live[] as it is before it
+static void liveness(Compiler* c, int s) {
+    const Parser* p = &c->parser;
+    const BTNode* code = p->prog + p->stmts[s];
+    unsigned char* need = c->codegen.need + p->stmts[s];
+    unsigned char* live = c->codegen.live;
+
+    for (int i = p->stmts[s + 1] - p->stmts[s]; i > 0; i--) {
+        const BTNode* inst = &code[i];
+        switch (inst->op) {
+            case OP_ASSIGN:
+            case OP_ADD_ASSIGN:
+            case OP_SUB_ASSIGN:
+            case OP_INC:
+            case OP_DEC:
+                if (live[inst->val]) {
+                    need[i] |= N_STORE | N_KEEP;
+                } else if (need[i] & N_USED) {
+                    need[i] |= N_KEEP;
+                }
+                // An update reads the variable, an assignment kills it
+                live[inst->val] = inst->op != OP_ASSIGN && (need[i] & N_KEEP);
+                break;
+            case OP_ID:
+                if (need[i] & N_USED) {
+                    need[i] |= N_KEEP;
+                    live[inst->val] = 1;
+                }
+                break;
+            case OP_DIV:
+                // A division that may be by zero stays, used or not
+                if (code[inst->right].op != OP_INT ||
+                    code[inst->right].val == 0 || (need[i] & N_USED)) {
+                    need[i] |= N_KEEP;
+                }
+                break;
+            default:
+                if (need[i] & N_USED) {
+                    need[i] |= N_KEEP;
+                }
+                break;
+        }
+        if ((need[i] & N_KEEP) && inst->left) {
+            need[inst->left] |= N_USED;
+        }
+        if ((need[i] & N_KEEP) && inst->right) {
+            need[inst->right] |= N_USED;
+        }
+    }
+}
+
+// Append the kept instructions of statement s to kept[k + 1..] and
+// return the new size. A variable other than x, y and z is the value
+// last assigned to it, and an update of one is the plain operation on
+// that value. So is an update of x, y or z that is never read again
+static int keep(Compiler* c, int s, int k) {
+    const Parser* p = &c->parser;
+    CodeGen* g = &c->codegen;
+    const BTNode* code = p->prog + p->stmts[s];
+    const unsigned char* need = g->need + p->stmts[s];
+    int n = p->stmts[s + 1] - p->stmts[s];
+
+    // An update becomes up to three instructions
+    g->kept = (BTNode*)grow(c, g->kept, &g->keptcap, k + 3 * n + 1,
+                            sizeof(BTNode));
+    g->map = (int*)grow(c, g->map, &g->mapcap, n + 1, sizeof(int));
+    g->map[NIL] = NIL;
+    for (int i = 1; i <= n; i++) {
+        BTNode inst = code[i];
+        BTNode* out = g->kept;
+        int sym = inst.val, old;
+        if (!(need[i] & N_KEEP)) {
+            continue;
+        }
+        inst.left = g->map[inst.left];
+        inst.right = g->map[inst.right];
+        if (inst.op == OP_ID && sym >= 3) {
+            g->map[i] = g->def[sym];
+            continue;
+        }
+        if (inst.op >= OP_ASSIGN && (sym >= 3 || !(need[i] & N_STORE))) {
+            if (inst.op == OP_ASSIGN) {
+                g->map[i] = inst.right;
+                if (sym >= 3) {
+                    g->def[sym] = inst.right;
+                }
+                continue;
+            }
+            if (sym >= 3) {
+                old = g->def[sym];
+            } else {
+                out[++k] = (BTNode){OP_ID, sym, NIL, NIL};
+                old = k;
+            }
+            switch (inst.op) {
+                case OP_ADD_ASSIGN:
+                case OP_SUB_ASSIGN:
+                    inst = (BTNode){inst.op == OP_ADD_ASSIGN ? OP_ADD : OP_SUB,
+                                    0, old, inst.right};
+                    break;
+                default:
+                    out[++k] = (BTNode){OP_INT, 1, NIL, NIL};
+                    inst = (BTNode){inst.op == OP_INC ? OP_ADD : OP_SUB, 0,
+                                    old, k};
+                    break;
+            }
+            if (sym >= 3) {
+                g->def[sym] = k + 1;
+            }
+        }
+        out[++k] = inst;
+        g->map[i] = k;
+    }
+    return k;
+}
+
+// Generate the statements that are kept and the end of the program
+static void generate_statements(Compiler* c) {
+    const Parser* p = &c->parser;
+    CodeGen* g = &c->codegen;
+    int s, n;
+
+    g->need = (unsigned char*)grow(c, g->need, &g->needcap, p->progsize + 1,
+                                   sizeof(unsigned char));
+    g->live = (unsigned char*)grow(c, g->live, &g->livecap,
+                                   c->symbols.count, sizeof(unsigned char));
+    g->def = (int*)grow(c, g->def, &g->defcap, c->symbols.count,
+                        sizeof(int));
+    memset(g->need, 0, p->progsize + 1);
+    memset(g->live, 0, c->symbols.count);
+    // Only x, y and z are read at the end
+    memset(g->live, 1, 3);
+    for (s = p->nstmt - 1; s >= 0; s--) {
+        liveness(c, s);
+    }
+    for (s = n = 0; s < p->nstmt; s++) {
+        n = keep(c, s, n);
+    }
+    if (n) {
+        generate_code(c, g->kept, n);
+    }
+    generate_exit(c);
+}
+
+// Start a way of generating the program in buffer b
+static void begin(Compiler* c, InstBuffer* b) {
+    b->n = 0;
+    memset(b->fired, 0, sizeof(b->fired));
+    c->insts = b;
+}
+
+void generate_program(Compiler* c) {
+    jmp_buf fail;
+    Buffer scratch = {NULL, 0, 0}, *out = c->out;
+    volatile int best = 0;  // set between setjmp() and a longjmp()
+    int n;
+
+    begin(c, &c->alt[0]);
+    generate_statements(c);
+    peephole(&c->alt[0]);
+    // At level 2 both ways, and the cheaper one is kept
+    // Running out of memory for spills only rules the second way out, so
+    // the "EXIT 1" err() writes for it goes to scratch, not to the output
+    memcpy(fail, c->fail, sizeof(jmp_buf));
+    c->out = &scratch;
+    if (c->opt.level >= 2 && !c->opt.eval && !setjmp(c->fail)) {
+        begin(c, &c->alt[1]);
+        n = resynthesize(c);
+        resetRegs(c);
+        if (n) {
+            generate_code(c, c->symbolic.code, n);
+        }
+        generate_exit(c);
+        peephole(&c->alt[1]);
+        best = instCycles(&c->alt[1]) < instCycles(&c->alt[0]);
+    }
+    memcpy(c->fail, fail, sizeof(jmp_buf));
+    c->out = out;
+    free(scratch.data);
+    for (int rule = 0; rule < P_RULES; rule++) {
+        c->fired[rule] += c->alt[best].fired[rule];
+    }
+    writeInsts(c, &c->alt[best]);
+}
+
+void freeCodeGen(CodeGen* g) {
+    free(g->regs);
+    free(g->uses);
+    free(g->spill);
+    free(g->alias);
+    free(g->need);
+    free(g->live);
+    free(g->kept);
+    free(g->map);
+    free(g->def);
+}
+
+
+
+/*============================================================================================
+symbolic implementation
+============================================================================================*/
+
+
+// Larger products and sums stay opaque atoms, so that the forms of a
+// long program do not blow up
+#define MAXPRODUCT 64  // terms multiplied pairwise
+#define MAXDEGREE 8    // atoms in a monomial
+#define MAXSUM 256     // terms of a sum
+
+// Sums nested deeper than this are not re-synthesized, synthesis
+// recurses once per level
+#define MAXNEST 2000
+
+// Word i of form f
+#define WORD(s, f, i) ((s)->words[(s)->forms[f].start + (i)])
+#define COEF(s, p, i) WORD(s, p, 2 * (i))
+#define MONO(s, p, i) WORD(s, p, 2 * (i) + 1)
+#define TERMS(s, p) ((s)->forms[p].len / 2)
+
+// A coefficient is negative as a 32-bit signed number
+#define NEGATIVE(k) ((int)(k) < 0)
+
+static unsigned magnitude(unsigned k) {
+    return NEGATIVE(k) ? -k : k;
+}
+
+static void push(Compiler* c, unsigned w) {
+    Symbolic* s = &c->symbolic;
+    s->words = (unsigned*)grow(c, s->words, &s->wordcap, s->nword + 1,
+                               sizeof(unsigned));
+    s->words[s->nword++] = w;
+}
+
+static unsigned formHash(FormKind kind, const unsigned* w, int len) {
+    unsigned h = (2166136261u ^ kind) * 16777619u;
+    for (int i = 0; i < len; i++) {
+        h = (h ^ w[i]) * 16777619u;
+    }
+    return h;
+}
+
+// The slot of a form equal to (kind, w[0..len)), or the empty slot where
+// it goes
+static int* findForm(Symbolic* s, FormKind kind, const unsigned* w,
+                     int len) {
+    unsigned mask = s->slotcap - 1;
+    for (unsigned i = formHash(kind, w, len) & mask;; i = (i + 1) & mask) {
+        const Form* f = s->slots[i] ? &s->forms[s->slots[i] - 1] : NULL;
+        if (!f || (f->kind == kind && f->len == len &&
+                   !memcmp(s->words + f->start, w, len * sizeof(unsigned)))) {
+            return &s->slots[i];
+        }
+    }
+}
+
+static void rehashForms(Compiler* c) {
+    Symbolic* s = &c->symbolic;
+    int cap = s->slotcap ? s->slotcap << 1 : 1024;
+    int* slots = (int*)calloc(cap, sizeof(int));
+    if (!slots) {
+        error(c, RUNOUT);
+    }
+    free(s->slots);
+    s->slots = slots;
+    s->slotcap = cap;
+    for (int f = 0; f < s->nform; f++) {
+        const Form* form = &s->forms[f];
+        *findForm(s, form->kind, s->words + form->start, form->len) = f + 1;
+    }
+}
+
+// The form in words[start..nword), or an equal one that already exists,
+// in which case the new words are dropped
+static int form(Compiler* c, FormKind kind, int start) {
+    Symbolic* s = &c->symbolic;
+    int* slot;
+    if (2 * (s->nform + 1) > s->slotcap) {
+        rehashForms(c);
+    }
+    slot = findForm(s, kind, s->words + start, s->nword - start);
+    if (*slot) {
+        s->nword = start;
+        return *slot - 1;
+    }
+    s->forms = (Form*)grow(c, s->forms, &s->formcap, s->nform + 1,
+                           sizeof(Form));
+    s->forms[s->nform] = (Form){kind, start, s->nword - start, 0, 0};
+    *slot = s->nform + 1;
+    return s->nform++;
+}
+
+static int constPoly(Compiler* c, unsigned k) {
+    int start = c->symbolic.nword;
+    if (k) {
+        push(c, k);
+        push(c, c->symbolic.one);
+    }
+    return form(c, FORM_POLY, start);
+}
+
+// The polynomial of the atom (op, a, b)
+static int atomPoly(Compiler* c, OpType op, int a, int b) {
+    Symbolic* s = &c->symbolic;
+    int start = s->nword;
+    push(c, op);
+    push(c, a);
+    push(c, b);
+    a = form(c, FORM_ATOM, start);
+    start = s->nword;
+    push(c, a);
+    a = form(c, FORM_MONO, start);
+    start = s->nword;
+    push(c, 1);
+    push(c, a);
+    return form(c, FORM_POLY, start);
+}
+
+// Test if polynomial p is the constant *k
+static int isConst(const Symbolic* s, int p, unsigned* k) {
+    if (!TERMS(s, p)) {
+        *k = 0;
+        return 1;
+    } else if (TERMS(s, p) == 1 && MONO(s, p, 0) == (unsigned)s->one) {
+        *k = COEF(s, p, 0);
+        return 1;
+    }
+    return 0;
+}
+
+// p + sign * q, sign is 1 or -1
+static int addPoly(Compiler* c, int p, int q, unsigned sign) {
+    Symbolic* s = &c->symbolic;
+    int np = TERMS(s, p), nq = TERMS(s, q), i = 0, j = 0, start = s->nword;
+    if (np + nq > MAXSUM) {
+        return atomPoly(c, sign == 1 ? OP_ADD : OP_SUB, p, q);
+    }
+    while (i < np || j < nq) {
+        unsigned coef, mono;
+        if (j == nq || (i < np && MONO(s, p, i) < MONO(s, q, j))) {
+            coef = COEF(s, p, i);
+            mono = MONO(s, p, i++);
+        } else if (i == np || MONO(s, q, j) < MONO(s, p, i)) {
+            coef = sign * COEF(s, q, j);
+            mono = MONO(s, q, j++);
+        } else {
+            coef = COEF(s, p, i) + sign * COEF(s, q, j++);
+            mono = MONO(s, p, i++);
+        }
+        if (coef) {
+            push(c, coef);
+            push(c, mono);
+        }
+    }
+    return form(c, FORM_POLY, start);
+}
+
+static int scalePoly(Compiler* c, int p, unsigned k) {
+    Symbolic* s = &c->symbolic;
+    int start = s->nword;
+    for (int i = 0; i < TERMS(s, p); i++) {
+        if (COEF(s, p, i) * k != 0) {
+            push(c, COEF(s, p, i) * k);
+            push(c, MONO(s, p, i));
+        }
+    }
+    return form(c, FORM_POLY, start);
+}
+
+static int mulMono(Compiler* c, int m1, int m2) {
+    Symbolic* s = &c->symbolic;
+    int a = 0, b = 0, na = s->forms[m1].len, nb = s->forms[m2].len;
+    int start = s->nword;
+    while (a < na || b < nb) {
+        if (b == nb || (a < na && WORD(s, m1, a) <= WORD(s, m2, b))) {
+            push(c, WORD(s, m1, a++));
+        } else {
+            push(c, WORD(s, m2, b++));
+        }
+    }
+    return form(c, FORM_MONO, start);
+}
+
+static int degree(const Symbolic* s, int p) {
+    int d = 0;
+    for (int i = 0; i < TERMS(s, p); i++) {
+        if (s->forms[MONO(s, p, i)].len > d) {
+            d = s->forms[MONO(s, p, i)].len;
+        }
+    }
+    return d;
+}
+
+static int byMonomial(const void* a, const void* b) {
+    unsigned x = *(const unsigned*)a, y = *(const unsigned*)b;
+    return x < y ? -1 : x > y;
+}
+
+static int mulPoly(Compiler* c, int p, int q) {
+    Symbolic* s = &c->symbolic;
+    int np = TERMS(s, p), nq = TERMS(s, q), n = 0, start;
+    unsigned k;
+
+    if (isConst(s, q, &k)) {
+        return scalePoly(c, p, k);
+    } else if (isConst(s, p, &k)) {
+        return scalePoly(c, q, k);
+    } else if (np * nq > MAXPRODUCT ||
+               degree(s, p) + degree(s, q) > MAXDEGREE) {
+        return atomPoly(c, OP_MUL, p < q ? p : q, p < q ? q : p);
+    }
+    s->terms = (unsigned*)grow(c, s->terms, &s->termcap, 2 * np * nq,
+                               sizeof(unsigned));
+    for (int i = 0; i < np; i++) {
+        for (int j = 0; j < nq; j++) {
+            s->terms[n++] = mulMono(c, MONO(s, p, i), MONO(s, q, j));
+            s->terms[n++] = COEF(s, p, i) * COEF(s, q, j);
+        }
+    }
+    qsort(s->terms, n / 2, 2 * sizeof(unsigned), byMonomial);
+    start = s->nword;
+    for (int i = 0; i < n;) {
+        unsigned mono = s->terms[i], coef = 0;
+        for (; i < n && s->terms[i] == mono; i += 2) {
+            coef += s->terms[i + 1];
+        }
+        if (coef) {
+            push(c, coef);
+            push(c, mono);
+        }
+    }
+    return form(c, FORM_POLY, start);
+}
+
+// AND, OR or XOR, with the identities that keep it a polynomial
+static int bitPoly(Compiler* c, OpType op, int p, int q) {
+    const Symbolic* s = &c->symbolic;
+    unsigned a, b;
+    int t;
+
+    if (isConst(s, p, &a) && isConst(s, q, &b)) {
+        return constPoly(c, op == OP_AND ? a & b : op == OP_OR ? a | b : a ^ b);
+    } else if (p == q) {
+        return op == OP_XOR ? constPoly(c, 0) : p;
+    }
+    if (isConst(s, p, &b)) {
+        t = p;
+        p = q;
+        q = t;
+    }
+    if (isConst(s, q, &b) && b == 0) {
+        return op == OP_AND ? q : p;
+    } else if (isConst(s, q, &b) && b == ~0u && op != OP_XOR) {
+        return op == OP_AND ? p : q;
+    }
+    return atomPoly(c, op, p < q ? p : q, p < q ? q : p);
+}
+
+// Note that the program divides by q
+static void trap(Compiler* c, int q) {
+    Symbolic* s = &c->symbolic;
+    unsigned k;
+    if ((isConst(s, q, &k) && k) || s->forms[q].trap) {
+        return;
+    }
+    s->traps = (int*)grow(c, s->traps, &s->trapcap, s->ntrap + 1, sizeof(int));
+    s->traps[s->ntrap++] = q;
+    s->forms[q].trap = 1;
+}
+
+static int divPoly(Compiler* c, int p, int q) {
+    const Symbolic* s = &c->symbolic;
+    unsigned a, b;
+
+    trap(c, q);
+    if (isConst(s, q, &b) && b == 1) {
+        return p;
+    } else if (isConst(s, q, &b) && b && isConst(s, p, &a)) {
+        // INT_MIN / -1 wraps around to INT_MIN, as on the machine
+        return constPoly(c, (int)b == -1 ? 0u - a
+                                         : (unsigned)((int)a / (int)b));
+    } else if (p == q || !TERMS(s, p)) {
+        // Unless q is zero, and then nothing is computed anyway
+        return constPoly(c, p == q);
+    }
+    return atomPoly(c, OP_DIV, p, q);
+}
+
+// Find the polynomials of every variable after the buffered program
+static void execute(Compiler* c) {
+    Symbolic* s = &c->symbolic;
+    const Parser* p = &c->parser;
+    int sym;
+
+    s->nform = s->nword = s->ntrap = 0;
+    if (s->slots) {
+        memset(s->slots, 0, s->slotcap * sizeof(int));
+    }
+    s->one = form(c, FORM_MONO, s->nword);
+    s->vars = (int*)grow(c, s->vars, &s->varcap, c->symbols.count,
+                         sizeof(int));
+    for (sym = 0; sym < c->symbols.count; sym++) {
+        s->vars[sym] = sym < 3 ? atomPoly(c, OP_ID, sym, 0) : constPoly(c, 0);
+    }
+    for (int st = 0; st < p->nstmt; st++) {
+        const BTNode* code = p->prog + p->stmts[st];
+        int n = p->stmts[st + 1] - p->stmts[st];
+        s->vals = (int*)grow(c, s->vals, &s->valcap, n + 1, sizeof(int));
+        for (int i = 1; i <= n; i++) {
+            const BTNode* inst = &code[i];
+            int l = inst->left ? s->vals[inst->left] : 0;
+            int r = inst->right ? s->vals[inst->right] : 0;
+            int* var = s->vars + (inst->op == OP_INT ? 0 : inst->val);
+            int v = 0;
+            switch (inst->op) {
+                case OP_INT:
+                    v = constPoly(c, inst->val);
+                    break;
+                case OP_ID:
+                    v = *var;
+                    break;
+                case OP_ADD:
+                case OP_SUB:
+                    v = addPoly(c, l, r, inst->op == OP_ADD ? 1 : ~0u);
+                    break;
+                case OP_MUL:
+                    v = mulPoly(c, l, r);
+                    break;
+                case OP_DIV:
+                    v = divPoly(c, l, r);
+                    break;
+                case OP_AND:
+                case OP_OR:
+                case OP_XOR:
+                    v = bitPoly(c, inst->op, l, r);
+                    break;
+                case OP_ASSIGN:
+                    v = *var = r;
+                    break;
+                case OP_ADD_ASSIGN:
+                case OP_SUB_ASSIGN:
+                    v = *var = addPoly(c, *var, r,
+                                       inst->op == OP_ADD_ASSIGN ? 1 : ~0u);
+                    break;
+                case OP_INC:
+                case OP_DEC:
+                    v = *var = addPoly(c, *var, constPoly(c, 1),
+                                       inst->op == OP_INC ? 1 : ~0u);
+                    break;
+            }
+            s->vals[i] = v;
+        }
+    }
+}
+
+static int inst(Compiler* c, OpType op, int val, int left, int right) {
+    Symbolic* s = &c->symbolic;
+    s->code = (BTNode*)grow(c, s->code, &s->codecap, s->ncode + 2,
+                            sizeof(BTNode));
+    s->code[++s->ncode] = (BTNode){op, val, left, right};
+    return s->ncode;
+}
+
+static int synPoly(Compiler* c, int p);
+
+static int synAtom(Compiler* c, int a) {
+    Symbolic* s = &c->symbolic;
+    if (!s->forms[a].code) {
+        OpType op = (OpType)WORD(s, a, 0);
+        int code;
+        if (op == OP_ID) {
+            code = inst(c, OP_ID, WORD(s, a, 1), NIL, NIL);
+        } else {
+            int left = synPoly(c, WORD(s, a, 1));
+            int right = synPoly(c, WORD(s, a, 2));
+            code = inst(c, op, 0, left, right);
+            if (op == OP_DIV) {
+                s->forms[WORD(s, a, 2)].trap = 2;
+            }
+        }
+        s->forms[a].code = code;
+    }
+    return s->forms[a].code;
+}
+
+// A product of atoms, a square from its root and anything else from its
+// first atoms
+static int synMono(Compiler* c, int m) {
+    Symbolic* s = &c->symbolic;
+    if (!s->forms[m].code) {
+        int len = s->forms[m].len, square = 1, start = s->nword, i, code;
+        if (len == 1) {
+            code = synAtom(c, WORD(s, m, 0));
+        } else {
+            for (i = 0; i < len; i += 2) {
+                square &= i + 1 < len && WORD(s, m, i) == WORD(s, m, i + 1);
+            }
+            for (i = 0; i < len - 1; i += square ? 2 : 1) {
+                push(c, WORD(s, m, i));
+            }
+            code = synMono(c, form(c, FORM_MONO, start));
+            code = inst(c, OP_MUL, 0, code,
+                        square ? code : synAtom(c, WORD(s, m, len - 1)));
+        }
+        s->forms[m].code = code;
+    }
+    return s->forms[m].code;
+}
+
+static void part(Compiler* c, int sign, int code) {
+    Symbolic* s = &c->symbolic;
+    s->parts = (int*)grow(c, s->parts, &s->partcap, s->nparts + 2,
+                          sizeof(int));
+    s->parts[s->nparts++] = sign;
+    s->parts[s->nparts++] = code;
+}
+
+static void synInto(Compiler* c, int p, int sign, unsigned* k);
+
+// Add sign * p to the sum, for p whose terms have coefficients of 1 or
+// -1, factoring out the atom that the most terms have:
+// a * b + a * c + d -> a * (b + c) + d
+static void horner(Compiler* c, int p, int first, int sign, unsigned* k) {
+    Symbolic* s = &c->symbolic;
+    int n = TERMS(s, p), best = -1, bestCount = 1, i, j, a, start, q, r;
+    unsigned* t;
+
+    for (i = first; i < n; i++) {
+        int m = MONO(s, p, i);
+        for (a = 0; a < s->forms[m].len; a++) {
+            int atom = WORD(s, m, a), count = 0;
+            for (j = first; j < n; j++) {
+                int m2 = MONO(s, p, j), b = 0;
+                while (b < s->forms[m2].len && WORD(s, m2, b) != (unsigned)atom) {
+                    b++;
+                }
+                count += b < s->forms[m2].len;
+            }
+            if (count > bestCount) {
+                best = atom;
+                bestCount = count;
+            }
+        }
+    }
+    if (best < 0) {
+        for (i = first; i < n; i++) {
+            part(c, NEGATIVE(COEF(s, p, i)) ? -sign : sign,
+                 synMono(c, MONO(s, p, i)));
+        }
+        return;
+    }
 
+    // p = best * q + r
+    s->terms = (unsigned*)grow(c, s->terms, &s->termcap, 2 * n,
+                               sizeof(unsigned));
+    j = 0;
+    for (i = first; i < n; i++) {
+        int m = MONO(s, p, i), dropped = 0;
+        start = s->nword;
+        for (a = 0; a < s->forms[m].len; a++) {
+            if (!dropped && WORD(s, m, a) == (unsigned)best) {
+                dropped = 1;
+            } else {
+                push(c, WORD(s, m, a));
+            }
+        }
+        if (dropped) {
+            s->terms[j++] = form(c, FORM_MONO, start);
+            s->terms[j++] = COEF(s, p, i);
+        } else {
+            s->nword = start;
+        }
+    }
+    qsort(s->terms, j / 2, 2 * sizeof(unsigned), byMonomial);
+    start = s->nword;
+    for (t = s->terms; t < s->terms + j; t += 2) {
+        push(c, t[1]);
+        push(c, t[0]);
+    }
+    q = form(c, FORM_POLY, start);
+    start = s->nword;
+    for (i = first; i < n; i++) {
+        int m = MONO(s, p, i), b = 0;
+        while (b < s->forms[m].len && WORD(s, m, b) != (unsigned)best) {
+            b++;
+        }
+        if (b == s->forms[m].len) {
+            push(c, COEF(s, p, i));
+            push(c, m);
+        }
+    }
+    r = form(c, FORM_POLY, start);
+    a = synAtom(c, best);
+    part(c, sign, inst(c, OP_MUL, 0, a, synPoly(c, q)));
+    synInto(c, r, sign, k);
+}
+
+// Add sign * p to the sum being built, its constant to *k
+// Terms with the same coefficient, up to sign, share one multiplication
+// by it: 3 * a - 3 * b + c -> (a - b) * 3 + c
+static void synInto(Compiler* c, int p, int sign, unsigned* k) {
+    Symbolic* s = &c->symbolic;
+    int n = TERMS(s, p), first = 0, i, j;
 
-/*============================================================================================
-codeGen implementation
-============================================================================================*/
-
+    if (++s->depth > MAXNEST) {
+        error(c, RUNOUT);
+    }
+    if (n && MONO(s, p, 0) == (unsigned)s->one) {
+        *k += sign * COEF(s, p, 0);
+        first = 1;
+    }
+    for (i = first; i < n && magnitude(COEF(s, p, i)) == 1; i++)
+        ;
+    if (i == n) {
+        horner(c, p, first, sign, k);
+        s->depth--;
+        return;
+    }
+    for (i = first; i < n; i++) {
+        unsigned mag = magnitude(COEF(s, p, i));
+        int neg = NEGATIVE(COEF(s, p, i)), start = s->nword, inner;
+        for (j = first; j < i && magnitude(COEF(s, p, j)) != mag; j++)
+            ;
+        if (j < i) {
+            continue;
+        }
+        // The group, with its first term positive
+        for (j = i; j < n; j++) {
+            if (magnitude(COEF(s, p, j)) == mag) {
+                push(c, NEGATIVE(COEF(s, p, j)) == neg ? 1 : ~0u);
+                push(c, MONO(s, p, j));
+            }
+        }
+        inner = form(c, FORM_POLY, start);
+        if (mag == 1) {
+            synInto(c, inner, neg ? -sign : sign, k);
+        } else {
+            part(c, neg ? -sign : sign,
+                 inst(c, OP_MUL, 0, synPoly(c, inner),
+                      inst(c, OP_INT, (int)mag, NIL, NIL)));
+        }
+    }
+    s->depth--;
+}
 
-int sbcount = 0;
-Symbol table[TBLSIZE];
+// The sum of the terms from parts[base] on and k
+static int finish(Compiler* c, int base, unsigned k) {
+    Symbolic* s = &c->symbolic;
+    int acc = 0, first = -1, i;
+
+    for (i = base; i < s->nparts && first < 0; i += 2) {
+        if (s->parts[i] > 0) {
+            first = i;
+        }
+    }
+    if (first >= 0) {
+        acc = s->parts[first + 1];
+    } else if (base < s->nparts && k) {
+        acc = inst(c, OP_INT, (int)k, NIL, NIL);
+        k = 0;
+    } else if (base < s->nparts) {
+        first = base;
+        acc = inst(c, OP_SUB, 0, inst(c, OP_INT, 0, NIL, NIL),
+                   s->parts[base + 1]);
+    }
+    for (i = base; i < s->nparts; i += 2) {
+        if (i != first) {
+            acc = inst(c, s->parts[i] > 0 ? OP_ADD : OP_SUB, 0, acc,
+                       s->parts[i + 1]);
+        }
+    }
+    s->nparts = base;
+    if (!acc) {
+        return inst(c, OP_INT, (int)k, NIL, NIL);
+    } else if (k) {
+        acc = inst(c, NEGATIVE(k) ? OP_SUB : OP_ADD, 0, acc,
+                   inst(c, OP_INT, (int)magnitude(k), NIL, NIL));
+    }
+    return acc;
+}
 
-void initTable(void) {
-    strcpy(table[0].name, "x");
-    strcpy(table[1].name, "y");
-    strcpy(table[2].name, "z");
-    sbcount = 3;
+static int synPoly(Compiler* c, int p) {
+    Symbolic* s = &c->symbolic;
+    if (!s->forms[p].code) {
+        int base = s->nparts;
+        unsigned k = 0;
+        synInto(c, p, 1, &k);
+        s->forms[p].code = finish(c, base, k);
+    }
+    return s->forms[p].code;
 }
 
-int get_addr(char* str, int add_var) {
-    for (int i = 0; i < sbcount; i++) {
-        if (strcmp(str, table[i].name) == 0) {
-            return i << 2;
+int resynthesize(Compiler* c) {
+    Symbolic* s = &c->symbolic;
+    int root[3], sym, i;
+
+    execute(c);
+    for (i = 0; i < s->nform; i++) {
+        s->forms[i].code = 0;
+    }
+    s->ncode = s->nparts = s->depth = 0;
+    for (sym = 0; sym < 3; sym++) {
+        root[sym] = s->vars[sym] == atomPoly(c, OP_ID, sym, 0)
+                        ? 0
+                        : synPoly(c, s->vars[sym]);
+    }
+    // A division that may be by zero is still done, by itself if its
+    // result is not needed
+    for (i = 0; i < s->ntrap; i++) {
+        if (s->forms[s->traps[i]].trap == 1) {
+            int d = synPoly(c, s->traps[i]);
+            inst(c, OP_DIV, 0, d, d);
         }
     }
-    if (!add_var) {
-        error(NOTFOUND);
+    for (sym = 0; sym < 3; sym++) {
+        if (root[sym]) {
+            inst(c, OP_ASSIGN, sym, NIL, root[sym]);
+        }
     }
-    strcpy(table[sbcount++].name, str);
-    return (sbcount - 1) << 2;
+    return s->ncode;
 }
 
-void generate_code(BTNode* root, int use_reg) {
-    if (root != NULL) {
-        switch (root->token_type) {
-            case ID:
-                printf("MOV r%d [%d]\n", use_reg, get_addr(root->lexeme, 0));
-                break;
-            case INT:
-                printf("MOV r%d %d\n", use_reg, root->val);
-                break;
-            case ASSIGN:
-                if (root->left->token_type != ID) {
-                    error(NOTID);
-                }
-                generate_code(root->right, use_reg);
-                printf("MOV [%d] r%d\n", get_addr(root->left->lexeme, 1),
-                       use_reg);
-                break;
-            case ADDSUB_ASSIGN:
-                if (root->left->token_type != ID) {
-                    error(NOTID);
+void freeSymbolic(Symbolic* s) {
+    free(s->forms);
+    free(s->words);
+    free(s->slots);
+    free(s->vars);
+    free(s->vals);
+    free(s->traps);
+    free(s->terms);
+    free(s->code);
+    free(s->parts);
+}
+
+/*============================================================================================
+inst implementation
+============================================================================================*/
+
+
+// Words of data memory, as the simulator has
+#define WORDS 64
+
+const char* ruleNames[P_RULES] = {
+    [P_LOAD] = "redundant load",
+    [P_MOVE] = "redundant move",
+    [P_PAIR] = "store/load pair",
+    [P_DEAD] = "dead register",
+};
+
+static const char* names[] = {
+    [I_MOV] = "MOV", [I_ADD] = "ADD", [I_SUB] = "SUB",
+    [I_MUL] = "MUL", [I_DIV] = "DIV", [I_EXIT] = "EXIT",
+    [I_AND] = "AND", [I_OR] = "OR",   [I_XOR] = "XOR",
+};
+
+void put(Compiler* c, Opcode opcode, ArgType op1_type, int op1_value,
+         ArgType op2_type, int op2_value) {
+    InstBuffer* b = c->insts;
+    Inst* inst;
+
+    b->inst = (Inst*)grow(c, b->inst, &b->cap, b->n + 1, sizeof(Inst));
+    inst = &b->inst[b->n++];
+    inst->opcode = opcode;
+    inst->op1_type = op1_type;
+    inst->op1_value = op1_value;
+    inst->op2_type = op2_type;
+    inst->op2_value = op2_value;
+}
+
+// What a register or a word holds: a constant, or the id of a value
+// that is not known until run time
+typedef struct {
+    int known;
+    int value;
+} Val;
+
+static int same(Val a, Val b) {
+    return a.known == b.known && a.value == b.value;
+}
+
+// Whether memory word addr is one the passes track
+static int tracked(int addr) {
+    return addr >= 0 && addr / 4 < WORDS;
+}
+
+// One pass forward, with what each register and word holds: remove the
+// MOVs that change nothing, load from a register instead of memory, and
+// read the lowest register that has a value, so that copies of it die
+static int forward(InstBuffer* b) {
+    Val reg[8], mem[WORDS];
+    int i, w, r, fresh = 0, changed = 0;
+
+    // Registers start with garbage and memory with the input
+    for (r = 0; r < 8; r++) {
+        reg[r].known = 0;
+        reg[r].value = fresh++;
+    }
+    for (i = 0; i < WORDS; i++) {
+        mem[i].known = 0;
+        mem[i].value = fresh++;
+    }
+    for (i = w = 0; i < b->n; i++) {
+        Inst inst = b->inst[i];
+        Val v;
+
+        if (inst.opcode == I_MOV && inst.op1_type == A_ADDR) {
+            if (!tracked(inst.op1_value)) {
+                b->inst[w++] = inst;
+                continue;
+            }
+            v = reg[inst.op2_value];
+            if (same(mem[inst.op1_value / 4], v)) {
+                b->fired[P_PAIR]++;
+                changed = 1;
+                continue;
+            }
+            mem[inst.op1_value / 4] = v;
+            b->inst[w++] = inst;
+            continue;
+        }
+        if (inst.opcode == I_EXIT) {
+            b->inst[w++] = inst;
+            continue;
+        }
+        if (inst.op2_type == A_REG) {
+            v = reg[inst.op2_value];
+            for (r = 0; r < inst.op2_value; r++) {
+                if (same(reg[r], v)) {
+                    inst.op2_value = r;
+                    b->fired[P_MOVE]++;
+                    changed = 1;
+                    break;
                 }
-                generate_code(root->right, (use_reg + 1) % 8);
-                generate_code(root->left, use_reg);
-                if (root->lexeme[0] == '+') {
-                    printf("ADD r%d r%d\n", use_reg, (use_reg + 1) % 8);
-                } else {
-                    printf("SUB r%d r%d\n", use_reg, (use_reg + 1) % 8);
+            }
+        }
+        if (inst.opcode != I_MOV) {
+            // The result is a new value, a DIV by zero leaves the old one
+            // but that is not known either
+            reg[inst.op1_value].known = 0;
+            reg[inst.op1_value].value = fresh++;
+            b->inst[w++] = inst;
+            continue;
+        }
+        if (inst.op2_type == A_CONST) {
+            v.known = 1;
+            v.value = inst.op2_value;
+        } else if (inst.op2_type == A_REG) {
+            v = reg[inst.op2_value];
+        } else if (tracked(inst.op2_value)) {
+            v = mem[inst.op2_value / 4];
+        } else {
+            v.known = 0;
+            v.value = fresh++;
+        }
+        if (same(reg[inst.op1_value], v)) {
+            b->fired[inst.op2_type == A_ADDR ? P_LOAD : P_MOVE]++;
+            changed = 1;
+            continue;
+        }
+        if (inst.op2_type == A_ADDR) {
+            for (r = 0; r < 8; r++) {
+                if (same(reg[r], v)) {
+                    inst.op2_type = A_REG;
+                    inst.op2_value = r;
+                    b->fired[P_PAIR]++;
+                    changed = 1;
+                    break;
                 }
-                printf("MOV [%d] r%d\n", get_addr(root->left->lexeme, 0),
-                       use_reg);
+            }
+        }
+        reg[inst.op1_value] = v;
+        b->inst[w++] = inst;
+    }
+    b->n = w;
+    return changed;
+}
+
+// One pass backward, with the registers and words that are read later:
+// remove the writes to the others. Only r0-r2 are seen at the EXIT, and
+// a DIV stays for the error a zero divisor gives
+static int backward(InstBuffer* b) {
+    unsigned live = 0;
+    unsigned long long words = 0;
+    int i, w, changed = 0;
+
+    for (i = w = b->n - 1; i >= 0; i--) {
+        Inst inst = b->inst[i];
+
+        switch (inst.opcode) {
+            case I_EXIT:
+                live = 7;
+                words = 0;
                 break;
-            case INCDEC:
-                if (root->left->token_type != ID) {
-                    error(NOTID);
+            case I_MOV:
+                if (inst.op1_type == A_ADDR) {
+                    if (!tracked(inst.op1_value)) {
+                        live |= 1u << inst.op2_value;
+                        break;
+                    }
+                    if (!(words >> (inst.op1_value / 4) & 1)) {
+                        b->fired[P_DEAD]++;
+                        changed = 1;
+                        continue;
+                    }
+                    words &= ~(1ull << (inst.op1_value / 4));
+                    live |= 1u << inst.op2_value;
+                    break;
                 }
-                generate_code(root->left, use_reg);
-                printf("MOV r%d, 1\n", (use_reg + 1) % 8);
-                if (root->lexeme[0] == '+') {
-                    printf("ADD r%d r%d\n", use_reg, (use_reg + 1) % 8);
-                } else {
-                    printf("SUB r%d r%d\n", use_reg, (use_reg + 1) % 8);
-                }
-                printf("MOV [%d] r%d\n", get_addr(root->left->lexeme, 0),
-                       use_reg);
-                break;
-            case AND:
-            case OR:
-            case XOR:
-            case ADDSUB:
-            case MULDIV:
-                generate_code(root->left, use_reg);
-                generate_code(root->right, (use_reg + 1) % 8);
-                if (root->lexeme[0] == '+') {
-                    printf("ADD r%d r%d\n", use_reg, (use_reg + 1) % 8);
-                } else if (root->lexeme[0] == '-') {
-                    printf("SUB r%d r%d\n", use_reg, (use_reg + 1) % 8);
-                } else if (root->lexeme[0] == '*') {
-                    printf("MUL r%d r%d\n", use_reg, (use_reg + 1) % 8);
-                } else if (root->lexeme[0] == '/') {
-                    printf("DIV r%d r%d\n", use_reg, (use_reg + 1) % 8);
-                } else if (root->lexeme[0] == '&') {
-                    printf("AND r%d r%d\n", use_reg, (use_reg + 1) % 8);
-                } else if (root->lexeme[0] == '|') {
-                    printf("OR r%d r%d\n", use_reg, (use_reg + 1) % 8);
-                } else if (root->lexeme[0] == '^') {
-                    printf("XOR r%d r%d\n", use_reg, (use_reg + 1) % 8);
+                if (!(live >> inst.op1_value & 1)) {
+                    b->fired[P_DEAD]++;
+                    changed = 1;
+                    continue;
+                }
+                live &= ~(1u << inst.op1_value);
+                if (inst.op2_type == A_REG) {
+                    live |= 1u << inst.op2_value;
+                } else if (inst.op2_type == A_ADDR) {
+                    // An untracked word is never written, so not dead
+                    if (tracked(inst.op2_value)) {
+                        words |= 1ull << (inst.op2_value / 4);
+                    }
                 }
                 break;
             default:
+                if (inst.opcode != I_DIV && !(live >> inst.op1_value & 1)) {
+                    b->fired[P_DEAD]++;
+                    changed = 1;
+                    continue;
+                }
+                live |= 1u << inst.op1_value | 1u << inst.op2_value;
                 break;
         }
+        b->inst[w--] = inst;
+    }
+    // The kept instructions are at the end
+    memmove(b->inst, b->inst + w + 1, (size_t)(b->n - w - 1) * sizeof(Inst));
+    b->n -= w + 1;
+    return changed;
+}
+
+void peephole(InstBuffer* b) {
+    int changed;
+    do {
+        changed = forward(b);
+        changed |= backward(b);
+    } while (changed);
+}
+
+// As cycles() of the simulator
+static int cost(const Inst* i) {
+    switch (i->opcode) {
+        case I_MOV:
+            if (i->op1_type == A_ADDR) {
+                return COST_STORE;
+            }
+            return i->op2_type == A_REG     ? COST_MOV_REG
+                   : i->op2_type == A_CONST ? COST_MOV_CONST
+                                            : COST_LOAD;
+        case I_ADD:
+            return COST_ADD;
+        case I_SUB:
+            return COST_SUB;
+        case I_MUL:
+            return COST_MUL;
+        case I_DIV:
+            return COST_DIV;
+        case I_AND:
+            return COST_AND;
+        case I_OR:
+            return COST_OR;
+        case I_XOR:
+            return COST_XOR;
+        case I_EXIT:
+            return COST_EXIT;
+    }
+    return 0;
+}
+
+long instCycles(const InstBuffer* b) {
+    long total = 0;
+    for (int i = 0; i < b->n; i++) {
+        total += cost(&b->inst[i]);
+    }
+    return total;
+}
+
+void writeInsts(Compiler* c, const InstBuffer* b) {
+    for (int i = 0; i < b->n; i++) {
+        const Inst* inst = &b->inst[i];
+        if (inst->opcode == I_EXIT) {
+            emit(c, "EXIT %d\n", inst->op1_value);
+        } else if (inst->op1_type == A_ADDR) {
+            emit(c, "MOV [%d] r%d\n", inst->op1_value, inst->op2_value);
+        } else if (inst->op2_type == A_REG) {
+            emit(c, "%s r%d r%d\n", names[inst->opcode], inst->op1_value,
+                 inst->op2_value);
+        } else if (inst->op2_type == A_CONST) {
+            emit(c, "MOV r%d %d\n", inst->op1_value, inst->op2_value);
+        } else {
+            emit(c, "MOV r%d [%d]\n", inst->op1_value, inst->op2_value);
+        }
+    }
+}
+
+/*============================================================================================
+superopt implementation
+============================================================================================*/
+
+
+// Inputs a replacement is compared on before it is verified
+#define NTEST 16
+// Random inputs it is verified on, besides the boundary ones
+#define NRANDOM 1024
+
+static const unsigned boundary[] = {0, 1, ~0u, 2, 0x7fffffffu, 0x80000000u};
+#define NBOUNDARY (int)(sizeof boundary / sizeof *boundary)
+
+static const int costs[] = {
+    [OP_ADD] = COST_ADD, [OP_SUB] = COST_SUB, [OP_MUL] = COST_MUL,
+    [OP_AND] = COST_AND, [OP_OR] = COST_OR,   [OP_XOR] = COST_XOR,
+};
+
+// The operators a window is made of, DIV may trap
+static int isOp(OpType op) {
+    return op >= OP_ADD && op <= OP_XOR && op != OP_DIV;
+}
+
+static unsigned apply(int op, unsigned a, unsigned b) {
+    switch (op) {
+        case OP_ADD:
+            return a + b;
+        case OP_SUB:
+            return a - b;
+        case OP_MUL:
+            return a * b;
+        case OP_AND:
+            return a & b;
+        case OP_OR:
+            return a | b;
+        default:
+            return a ^ b;
+    }
+}
+
+// Value of a shape with operands in[]
+static unsigned eval(unsigned shape, const unsigned* in) {
+    unsigned stack[SUPEROPS + 2];
+    int sp = 0;
+    for (; shape; shape >>= 4) {
+        int t = shape & 15;
+        if (t >= LEAF(0)) {
+            stack[sp++] = in[t - LEAF(0)];
+        } else {
+            sp--;
+            stack[sp - 1] = apply(t, stack[sp - 1], stack[sp]);
+        }
+    }
+    return stack[0];
+}
+
+// Cycles of the operators of a shape
+static int shapeCost(unsigned shape) {
+    int total = 0;
+    for (; shape; shape >>= 4) {
+        if ((shape & 15) < LEAF(0)) {
+            total += costs[shape & 15];
+        }
+    }
+    return total;
+}
+
+// Bit of each operand a shape reads
+static unsigned uses(unsigned shape) {
+    unsigned bits = 0;
+    for (; shape; shape >>= 4) {
+        if ((shape & 15) >= LEAF(0)) {
+            bits |= 1u << ((shape & 15) - LEAF(0));
+        }
+    }
+    return bits;
+}
+
+static unsigned random32(unsigned* seed) {
+    *seed = *seed * 1103515245u + 12345u;
+    return *seed ^ *seed << 13 ^ *seed >> 17;
+}
+
+// Whether the replacement of e gives the same low bits of mask as the
+// window, with operands in[]
+static int agrees(const Shape* e, const unsigned* in, unsigned mask) {
+    unsigned want = e->known ? (unsigned)e->value : eval(e->best, in);
+    return ((eval(e->shape, in) ^ want) & mask) == 0;
+}
+
+// Compare the window and the replacement of e, with k operands, on all
+// combinations of boundary values, on random values, and on every
+// input of 8 bits, or of 5 bits for 3 operands. ADD, SUB, MUL, AND, OR
+// and XOR never carry into lower bits, so the low bits of the values
+// are the values on the narrow inputs
+static int verify(const Shape* e, int k) {
+    unsigned in[SUPERLEAVES] = {0}, seed = 7, bits = k <= 2 ? 8 : 5;
+    int i, j, n, m;
+
+    for (n = 1, i = 0; i < k; i++) {
+        n *= NBOUNDARY;
+    }
+    for (i = 0; i < n; i++) {
+        for (j = 0, m = i; j < k; j++, m /= NBOUNDARY) {
+            in[j] = boundary[m % NBOUNDARY];
+        }
+        if (!agrees(e, in, ~0u)) {
+            return 0;
+        }
+    }
+    for (i = 0; i < NRANDOM; i++) {
+        for (j = 0; j < k; j++) {
+            in[j] = random32(&seed);
+        }
+        if (!agrees(e, in, ~0u)) {
+            return 0;
+        }
+    }
+    for (i = 0; i < 1 << bits * k; i++) {
+        for (j = 0; j < k; j++) {
+            in[j] = i >> bits * j & ((1u << bits) - 1);
+        }
+        if (!agrees(e, in, (1u << bits) - 1)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static void addCand(Compiler* c, unsigned shape) {
+    Superopt* s = &c->superopt;
+    s->cands = (unsigned*)grow(c, s->cands, &s->candcap, s->ncand + 1,
+                               sizeof(unsigned));
+    s->cands[s->ncand++] = shape;
+}
+
+static int byCost(const void* a, const void* b) {
+    unsigned x = *(const unsigned*)a, y = *(const unsigned*)b;
+    if (shapeCost(x) != shapeCost(y)) {
+        return shapeCost(x) - shapeCost(y);
+    }
+    return x < y ? -1 : x > y;
+}
+
+// Every expression of up to two operators over three operands: a,
+// a op b, (a op b) op d and d op (a op b)
+static void makeCands(Compiler* c) {
+    static const OpType ops[] = {OP_ADD, OP_SUB, OP_MUL,
+                                 OP_AND, OP_OR,  OP_XOR};
+    int nop = sizeof ops / sizeof *ops;
+
+    for (int a = 0; a < SUPERLEAVES; a++) {
+        addCand(c, LEAF(a));
+    }
+    for (int o = 0; o < nop; o++) {
+        for (int a = 0; a < SUPERLEAVES; a++) {
+            for (int b = 0; b < SUPERLEAVES; b++) {
+                unsigned e = LEAF(a) | LEAF(b) << 4 | ops[o] << 8;
+                addCand(c, e);
+                for (int p = 0; p < nop; p++) {
+                    for (int d = 0; d < SUPERLEAVES; d++) {
+                        addCand(c, e | LEAF(d) << 12 | ops[p] << 16);
+                        addCand(c, LEAF(d) | e << 4 | ops[p] << 16);
+                    }
+                }
+            }
+        }
+    }
+    qsort(c->superopt.cands, c->superopt.ncand, sizeof(unsigned), byCost);
+}
+
+// Find the cheapest replacement of a shape with k operands: a constant,
+// or the first candidate that gives the same values on the tests and
+// then passes verify()
+static Shape search(Compiler* c, unsigned shape, int k) {
+    Superopt* s = &c->superopt;
+    unsigned in[NTEST][SUPERLEAVES], out[NTEST], seed = 1;
+    Shape e = {shape, shape, 0, 0};
+    int i, t, limit = shapeCost(shape);
+
+    for (t = 0; t < NTEST; t++) {
+        for (i = 0; i < SUPERLEAVES; i++) {
+            in[t][i] = t < NBOUNDARY ? boundary[(t + 2 * i) % NBOUNDARY]
+                                     : random32(&seed);
+        }
+        out[t] = eval(shape, in[t]);
+    }
+    for (t = 1; t < NTEST && out[t] == out[0]; t++)
+        ;
+    if (t == NTEST) {
+        e.known = 1;
+        e.value = (int)out[0];
+        if (verify(&e, k)) {
+            return e;
+        }
+        e.known = 0;
+    }
+    if (!s->ncand) {
+        makeCands(c);
+    }
+    for (i = 0; i < s->ncand && shapeCost(s->cands[i]) < limit; i++) {
+        if (uses(s->cands[i]) >> k) {
+            continue;
+        }
+        for (t = 0; t < NTEST && eval(s->cands[i], in[t]) == out[t]; t++)
+            ;
+        if (t == NTEST) {
+            e.best = s->cands[i];
+            if (verify(&e, k)) {
+                return e;
+            }
+            e.best = shape;
+        }
+    }
+    return e;
+}
+
+static Shape* findShape(Superopt* s, unsigned shape) {
+    unsigned mask = s->cap - 1;
+    for (unsigned i = shape * 2654435761u & mask;; i = (i + 1) & mask) {
+        if (!s->shapes[i].shape || s->shapes[i].shape == shape) {
+            return &s->shapes[i];
+        }
+    }
+}
+
+static void rehashShapes(Compiler* c) {
+    Superopt* s = &c->superopt;
+    Shape* old = s->shapes;
+    int oldcap = s->cap;
+    int cap = s->cap ? s->cap << 1 : 256;
+    Shape* shapes = (Shape*)calloc(cap, sizeof(Shape));
+    if (!shapes) {
+        error(c, RUNOUT);
+    }
+    s->shapes = shapes;
+    s->cap = cap;
+    for (int i = 0; i < oldcap; i++) {
+        if (old[i].shape) {
+            *findShape(s, old[i].shape) = old[i];
+        }
+    }
+    free(old);
+}
+
+// The result of the search for a shape, searching it if it is new
+static Shape lookup(Compiler* c, unsigned shape, int k) {
+    Superopt* s = &c->superopt;
+    Shape* slot;
+
+    if (2 * (s->count + 1) > s->cap) {
+        rehashShapes(c);
+    }
+    slot = findShape(s, shape);
+    if (!slot->shape) {
+        *slot = search(c, shape, k);
+        s->count++;
+    }
+    return *slot;
+}
+
+// Operators of a window and its operands
+typedef struct {
+    int ops[SUPEROPS];
+    int nop;
+    int leaves[SUPERLEAVES];
+    int nleaf;
+} Window;
+
+static int inWindow(const Window* w, int node) {
+    for (int i = 0; i < w->nop; i++) {
+        if (w->ops[i] == node) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Take the operators of the window at node, breadth first
+static void cut(Compiler* c, int node, int maxops, Window* w) {
+    const BTNode* pool = c->parser.pool;
+    w->ops[0] = node;
+    w->nop = 1;
+    w->nleaf = 0;
+    for (int i = 0; i < w->nop; i++) {
+        int kids[2] = {pool[w->ops[i]].left, pool[w->ops[i]].right};
+        for (int j = 0; j < 2; j++) {
+            if (w->nop < maxops && isOp(pool[kids[j]].op) &&
+                !inWindow(w, kids[j])) {
+                w->ops[w->nop++] = kids[j];
+            }
+        }
+    }
+}
+
+// Append the post-order of the window under node to shape, numbering
+// its operands. Fail on an operand that writes, traps or is an INT,
+// which the other passes already fold, on too many of them, or on more
+// tokens than SUPEROPS operators have, if an operator is shared
+static int serialize(Compiler* c, Window* w, int node, unsigned* shape,
+                     int* pos) {
+    const BTNode* n = &c->parser.pool[node];
+    int i;
+
+    if (inWindow(w, node)) {
+        if (!serialize(c, w, n->left, shape, pos) ||
+            !serialize(c, w, n->right, shape, pos) ||
+            *pos == 2 * SUPEROPS + 1) {
+            return 0;
+        }
+        *shape |= (unsigned)n->op << 4 * (*pos)++;
+        return 1;
+    }
+    if (n->op == OP_INT || (c->parser.flags[node] & (F_WRITE | F_TRAP))) {
+        return 0;
+    }
+    if (*pos == 2 * SUPEROPS + 1) {
+        return 0;
+    }
+    for (i = 0; i < w->nleaf && w->leaves[i] != node; i++)
+        ;
+    if (i == w->nleaf) {
+        if (i == SUPERLEAVES) {
+            return 0;
+        }
+        w->leaves[w->nleaf++] = node;
+    }
+    *shape |= (unsigned)LEAF(i) << 4 * (*pos)++;
+    return 1;
+}
+
+// Build a shape over the operands of a window
+static int rebuild(Compiler* c, unsigned shape, const int* leaves) {
+    int stack[SUPEROPS + 2], sp = 0;
+    for (; shape; shape >>= 4) {
+        int t = shape & 15;
+        if (t >= LEAF(0)) {
+            stack[sp++] = leaves[t - LEAF(0)];
+        } else {
+            sp--;
+            stack[sp - 1] = makeNode(c, (OpType)t, 0, stack[sp - 1],
+                                     stack[sp]);
+        }
+    }
+    return stack[0];
+}
+
+int superoptimize(Compiler* c, int node) {
+    Window w;
+    Shape e;
+
+    if (!isOp(c->parser.pool[node].op)) {
+        return node;
+    }
+    // The largest window first, then one operator less, as long as
+    // there are more operators than one
+    for (int maxops = SUPEROPS; maxops > 1; maxops--) {
+        unsigned shape = 0;
+        int pos = 0;
+        cut(c, node, maxops, &w);
+        if (w.nop < maxops || !serialize(c, &w, node, &shape, &pos)) {
+            continue;
+        }
+        e = lookup(c, shape, w.nleaf);
+        if (e.known) {
+            return knownInt(c, e.value);
+        }
+        if (e.best != shape) {
+            return rebuild(c, e.best, w.leaves);
+        }
+    }
+    return node;
+}
+
+void freeSuperopt(Superopt* s) {
+    free(s->shapes);
+    free(s->cands);
+}
+
+/*============================================================================================
+compiler implementation
+============================================================================================*/
+
+
+Compiler *newCompiler(void) {
+    Compiler *c = (Compiler *)calloc(1, sizeof(Compiler));
+    if (c) {
+        c->opt.pin = 1;
+        c->opt.level = 1;
+    }
+    return c;
+}
+
+void freeCompiler(Compiler *c) {
+    if (c) {
+        freeParser(&c->parser);
+        freeSymbols(&c->symbols);
+        freeCodeGen(&c->codegen);
+        freeSymbolic(&c->symbolic);
+        freeSuperopt(&c->superopt);
+        free(c->alt[0].inst);
+        free(c->alt[1].inst);
+        free(c);
     }
 }
 
+int compile(Compiler *c, const char *src, size_t len, Buffer *out) {
+    int status;
+
+    c->out = out;
+    status = setjmp(c->fail);
+    if (status) {
+        return status;
+    }
+    freeTree(c);
+    c->parser.progsize = c->parser.nstmt = 0;
+    initTable(c);
+    setInput(c, src, len);
+    while (statement(c))
+        ;
+    return 0;
+}
+
+void emit(Compiler *c, const char *fmt, ...) {
+    Buffer *out = c->out;
+    va_list ap;
+    int n;
+
+    va_start(ap, fmt);
+    n = vsnprintf(out->cap ? out->data + out->len : NULL, out->cap - out->len,
+                  fmt, ap);
+    va_end(ap);
+    if (out->len + n >= out->cap) {
+        size_t cap = out->cap ? out->cap : 4096;
+        char *data;
+        while (out->len + n >= cap) {
+            cap <<= 1;
+        }
+        data = (char *)realloc(out->data, cap);
+        if (!data) {
+            // Nowhere to report it, so the output is only cut short
+            longjmp(c->fail, RUNOUT);
+        }
+        out->data = data;
+        out->cap = cap;
+        va_start(ap, fmt);
+        vsnprintf(out->data + out->len, out->cap - out->len, fmt, ap);
+        va_end(ap);
+    }
+    out->len += n;
+}
+
+void *grow(Compiler *c, void *ptr, int *cap, int need, size_t size) {
+    if (need > *cap) {
+        int newcap = *cap ? *cap : 64;
+        while (need > newcap) {
+            newcap <<= 1;
+        }
+        // On failure ptr and *cap are left as they were, for the next
+        // compilation
+        ptr = realloc(ptr, (size_t)newcap * size);
+        if (!ptr) {
+            error(c, RUNOUT);
+        }
+        *cap = newcap;
+    }
+    return ptr;
+}
+
 
 
 /*============================================================================================
 main
 ============================================================================================*/
 
+
 // This package is a calculator
 // It works like a Python interpretor
 // Example:
@@ -656,15 +4174,96 @@ main
 // term 	  :=  factor term_tail
 // term_tail  :=  MULDIV factor term_tail| NiL
 // factor	  :=  INT | ADDSUB INT |
-//		   	      ID  | ADDSUB ID  |
+//		   	      ID  | ADDSUB ID  | 
 //		   	      ID ASSIGN expr |
 //		   	      LPAREN expr RPAREN |
 //		   	      ADDSUB LPAREN expr RPAREN
 
-int main() {
-    initTable();
-    while (1) {
-        statement();
+#define CHUNK (1 << 20)  // 1 MB
+
+// Read all of stdin into a malloc'ed buffer
+static char* readInput(size_t* len) {
+    size_t cap = CHUNK, n;
+    char* in = (char*)malloc(cap);
+
+    *len = 0;
+    while (in && (n = fread(in + *len, 1, cap - *len, stdin)) > 0) {
+        *len += n;
+        if (*len == cap) {
+            char* more = (char*)realloc(in, cap << 1);
+            if (!more) {
+                free(in);
+                return NULL;
+            }
+            in = more;
+            cap <<= 1;
+        }
+    }
+    return in;
+}
+
+// Usage: main [-u] [-O1 | -O2] [-s] [x y z] < input
+//   -u     keep x, y and z in memory, unpinned
+//   -O1    the default
+//   -O2    also re-synthesize the program from the normal forms of x, y
+//          and z, and keep the cheaper code
+//   -s     print how often each peephole rule fired to stderr
+//   x y z  the initial values of x, y and z, all three or none, to
+//          evaluate the program at compile time
+int main(int argc, char** argv) {
+    Buffer out = {NULL, 0, 0};
+    Compiler* c = newCompiler();
+    size_t len;
+    char* src;
+    int nmem = 0, stats = 0;
+
+    if (!c) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+    // Not getopt(), a negative initial value looks like an option
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-u") == 0) {
+            c->opt.pin = 0;
+        } else if (strcmp(argv[i], "-O1") == 0 ||
+                   strcmp(argv[i], "-O2") == 0) {
+            c->opt.level = argv[i][2] - '0';
+        } else if (strcmp(argv[i], "-s") == 0) {
+            stats = 1;
+        } else if (argv[i][0] == '-' &&
+                   !isdigit((unsigned char)argv[i][1])) {
+            // An option this does not know, not a number
+            nmem = -1;
+            break;
+        } else if (nmem < 3) {
+            c->opt.mem[nmem++] = atoi(argv[i]);
+        } else {
+            nmem = -1;
+            break;
+        }
+    }
+    if (nmem != 0 && nmem != 3) {
+        fprintf(stderr,
+                "usage: %s [-u] [-O1 | -O2] [-s] [x y z] < input\n"
+                "  x y z: the initial values, all three or none\n",
+                argv[0]);
+        freeCompiler(c);
+        return 1;
+    }
+    c->opt.eval = nmem == 3;
+    src = readInput(&len);
+    if (!src) {
+        fprintf(stderr, "out of memory while reading input\n");
+        freeCompiler(c);
+        return 1;
+    }
+    compile(c, src, len, &out);
+    fwrite(out.data, 1, out.len, stdout);
+    for (int rule = 0; stats && rule < P_RULES; rule++) {
+        fprintf(stderr, "%-16s %ld\n", ruleNames[rule], c->fired[rule]);
     }
+    freeCompiler(c);
+    free(src);
+    free(out.data);
     return 0;
 }